@@ -17,6 +17,9 @@
 #include "block/block.h"
 #include "qemu/queue.h"
 #include "qemu/sockets.h"
+#ifdef CONFIG_EPOLL_CREATE1
+#include <sys/epoll.h>
+#endif
 
 struct AioHandler
 {
@@ -42,6 +45,165 @@ static AioHandler *find_aio_handler(AioContext *ctx, int fd)
     return NULL;
 }
 
+#ifdef CONFIG_EPOLL_CREATE1
+
+/* The number of file descriptors above which aio_poll switches to epoll */
+#define EPOLL_ENABLE_THRESHOLD 64
+
+static void aio_epoll_disable(AioContext *ctx)
+{
+    ctx->epoll_available = false;
+    ctx->epoll_enabled = false;
+    if (ctx->epollfd >= 0) {
+        close(ctx->epollfd);
+        ctx->epollfd = -1;
+    }
+}
+
+static int epoll_events_from_pfd(int pfd_events)
+{
+    return (pfd_events & G_IO_IN ? EPOLLIN : 0) |
+           (pfd_events & G_IO_OUT ? EPOLLOUT : 0) |
+           (pfd_events & G_IO_HUP ? EPOLLHUP : 0) |
+           (pfd_events & G_IO_ERR ? EPOLLERR : 0);
+}
+
+static bool aio_epoll_try_enable(AioContext *ctx)
+{
+    AioHandler *node;
+    struct epoll_event event;
+
+    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+        if (node->deleted || !node->pfd.events) {
+            continue;
+        }
+        event.events = epoll_events_from_pfd(node->pfd.events);
+        event.data.ptr = node;
+        if (epoll_ctl(ctx->epollfd, EPOLL_CTL_ADD, node->pfd.fd, &event)) {
+            return false;
+        }
+    }
+    ctx->epoll_enabled = true;
+    return true;
+}
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+    struct epoll_event event;
+    int r;
+
+    if (!ctx->epoll_enabled) {
+        return;
+    }
+    if (!node->pfd.events) {
+        r = epoll_ctl(ctx->epollfd, EPOLL_CTL_DEL, node->pfd.fd, &event);
+    } else {
+        event.data.ptr = node;
+        event.events = epoll_events_from_pfd(node->pfd.events);
+        r = epoll_ctl(ctx->epollfd, is_new ? EPOLL_CTL_ADD : EPOLL_CTL_MOD,
+                      node->pfd.fd, &event);
+    }
+    if (r) {
+        /* Fall back to poll; aio_poll rebuilds its array from scratch */
+        aio_epoll_disable(ctx);
+    }
+}
+
+static int aio_epoll(AioContext *ctx, int64_t timeout)
+{
+    AioHandler *node;
+    struct epoll_event events[128];
+    GPollFD pfd = {
+        .fd = ctx->epollfd,
+        .events = G_IO_IN,
+    };
+    int i, ret = 0;
+
+    /* epoll_wait only has millisecond resolution; wait on the epoll
+     * file descriptor itself to honor a nanosecond timeout.
+     */
+    if (timeout > 0) {
+        ret = qemu_poll_ns(&pfd, 1, timeout);
+    }
+    if (timeout <= 0 || ret > 0) {
+        ret = epoll_wait(ctx->epollfd, events, ARRAY_SIZE(events),
+                         timeout > 0 ? 0 : timeout);
+        for (i = 0; i < ret; i++) {
+            int ev = events[i].events;
+
+            node = events[i].data.ptr;
+            node->pfd.revents = (ev & EPOLLIN ? G_IO_IN : 0) |
+                                (ev & EPOLLOUT ? G_IO_OUT : 0) |
+                                (ev & EPOLLHUP ? G_IO_HUP : 0) |
+                                (ev & EPOLLERR ? G_IO_ERR : 0);
+        }
+    }
+    return ret;
+}
+
+/* Returns true if aio_poll should wait with epoll rather than ppoll.
+ * Switches to epoll the first time @npfd reaches EPOLL_ENABLE_THRESHOLD.
+ */
+static bool aio_epoll_check_poll(AioContext *ctx, unsigned npfd)
+{
+    if (!ctx->epoll_available) {
+        return false;
+    }
+    if (ctx->epoll_enabled) {
+        return true;
+    }
+    if (npfd >= EPOLL_ENABLE_THRESHOLD) {
+        if (aio_epoll_try_enable(ctx)) {
+            return true;
+        }
+        aio_epoll_disable(ctx);
+    }
+    return false;
+}
+
+#else
+
+static void aio_epoll_update(AioContext *ctx, AioHandler *node, bool is_new)
+{
+}
+
+static int aio_epoll(AioContext *ctx, int64_t timeout)
+{
+    abort();
+}
+
+static bool aio_epoll_check_poll(AioContext *ctx, unsigned npfd)
+{
+    return false;
+}
+
+#endif
+
+static bool aio_epoll_enabled(AioContext *ctx)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    return ctx->epoll_enabled;
+#else
+    return false;
+#endif
+}
+
+void aio_context_setup(AioContext *ctx)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    ctx->epollfd = epoll_create1(EPOLL_CLOEXEC);
+    ctx->epoll_available = ctx->epollfd >= 0;
+    ctx->epoll_enabled = false;
+#endif
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+#ifdef CONFIG_EPOLL_CREATE1
+    aio_epoll_disable(ctx);
+#endif
+}
+
 void aio_set_fd_handler(AioContext *ctx,
                         int fd,
                         IOHandler *io_read,
@@ -49,6 +211,7 @@ void aio_set_fd_handler(AioContext *ctx,
                         void *opaque)
 {
     AioHandler *node;
+    bool is_new = false;
 
     node = find_aio_handler(ctx, fd);
 
@@ -56,6 +219,8 @@ void aio_set_fd_handler(AioContext *ctx,
     if (!io_read && !io_write) {
         if (node) {
             g_source_remove_poll(&ctx->source, &node->pfd);
+            node->pfd.events = 0;
+            aio_epoll_update(ctx, node, false);
 
             /* If the lock is held, just mark the node as deleted */
             if (ctx->walking_handlers) {
@@ -78,6 +243,7 @@ void aio_set_fd_handler(AioContext *ctx,
             QLIST_INSERT_HEAD(&ctx->aio_handlers, node, node);
 
             g_source_add_poll(&ctx->source, &node->pfd);
+            is_new = true;
         }
         /* Update handler with latest information */
         node->io_read = io_read;
@@ -87,6 +253,7 @@ void aio_set_fd_handler(AioContext *ctx,
 
         node->pfd.events = (io_read ? G_IO_IN | G_IO_HUP | G_IO_ERR : 0);
         node->pfd.events |= (io_write ? G_IO_OUT | G_IO_ERR : 0);
+        aio_epoll_update(ctx, node, is_new);
     }
 
     aio_notify(ctx);
@@ -212,25 +379,33 @@ bool aio_poll(AioContext *ctx, bool blocking)
 
     g_array_set_size(ctx->pollfds, 0);
 
-    /* fill pollfds */
-    QLIST_FOREACH(node, &ctx->aio_handlers, node) {
-        node->pollfds_idx = -1;
-        if (!node->deleted && node->pfd.events) {
-            GPollFD pfd = {
-                .fd = node->pfd.fd,
-                .events = node->pfd.events,
-            };
-            node->pollfds_idx = ctx->pollfds->len;
-            g_array_append_val(ctx->pollfds, pfd);
+    /* fill pollfds; with epoll the registrations are already in the kernel */
+    if (!aio_epoll_enabled(ctx)) {
+        QLIST_FOREACH(node, &ctx->aio_handlers, node) {
+            node->pollfds_idx = -1;
+            if (!node->deleted && node->pfd.events) {
+                GPollFD pfd = {
+                    .fd = node->pfd.fd,
+                    .events = node->pfd.events,
+                };
+                node->pollfds_idx = ctx->pollfds->len;
+                g_array_append_val(ctx->pollfds, pfd);
+            }
         }
     }
 
     ctx->walking_handlers--;
 
     /* wait until next event */
-    ret = qemu_poll_ns((GPollFD *)ctx->pollfds->data,
-                         ctx->pollfds->len,
-                         blocking ? aio_compute_timeout(ctx) : 0);
+    if (aio_epoll_check_poll(ctx, ctx->pollfds->len)) {
+        /* aio_epoll sets revents directly in the AioHandlers */
+        aio_epoll(ctx, blocking ? aio_compute_timeout(ctx) : 0);
+        ret = 0;
+    } else {
+        ret = qemu_poll_ns((GPollFD *)ctx->pollfds->data,
+                             ctx->pollfds->len,
+                             blocking ? aio_compute_timeout(ctx) : 0);
+    }
 
     /* if we have any readable fds, dispatch event */
     if (ret > 0) {
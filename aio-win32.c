@@ -144,6 +144,14 @@ void aio_set_event_notifier(AioContext *ctx,
     aio_notify(ctx);
 }
 
+void aio_context_setup(AioContext *ctx)
+{
+}
+
+void aio_context_destroy(AioContext *ctx)
+{
+}
+
 bool aio_prepare(AioContext *ctx)
 {
     static struct timeval tv0;
@@ -52,6 +52,7 @@
 #include "exec/ram_addr.h"
 #include "hw/acpi/acpi.h"
 #include "qemu/host-utils.h"
+#include "qemu/rcu_queue.h"
 
 #ifdef DEBUG_ARCH_INIT
 #define DPRINTF(fmt, ...) \
@@ -109,9 +110,9 @@ int graphic_depth = 32;
 #endif
 
 const uint32_t arch_type = QEMU_ARCH;
-static bool mig_throttle_on;
 static int dirty_rate_high_cnt;
-static void check_guest_throttling(void);
+static void mig_throttle_guest_down(uint64_t bytes_dirty_period,
+                                    uint64_t bytes_xfer_period);
 
 static uint64_t bitmap_sync_count;
 
@@ -126,6 +127,14 @@ static uint64_t bitmap_sync_count;
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
 /* 0x80 is reserved in migration.h start with 0x100 next */
+#define RAM_SAVE_FLAG_MAPPED   0x100
+
+/* With x-mapped-ram, RAM goes out in records of up to RAM_MAPPED_CHUNK
+ * bytes whose contents start at a multiple of RAM_MAPPED_ALIGN in the
+ * stream, which is enough for the host page size of all our hosts.
+ */
+#define RAM_MAPPED_ALIGN       0x10000
+#define RAM_MAPPED_CHUNK       (16 << 20)
 
 static struct defconfig_file {
     const char *filename;
@@ -329,6 +338,17 @@ static RAMBlock *last_sent_block;
 static ram_addr_t last_offset;
 static unsigned long *migration_bitmap;
 static uint64_t migration_dirty_pages;
+
+/* Accelerators that support it leave dirty tracking disarmed for pages they
+ * have reported, until we ask them to re-arm it.  Doing that for all of
+ * guest RAM at each bitmap sync is what makes the sync expensive, so instead
+ * each chunk of 1 << MIGRATION_CLEAR_BITMAP_SHIFT pages is re-armed right
+ * before the first page in it is sent.  A set bit means the chunk has been
+ * synced but not re-armed yet.
+ */
+#define MIGRATION_CLEAR_BITMAP_SHIFT 18
+static unsigned long *migration_clear_bitmap;
+static unsigned long migration_clear_bitmap_chunks;
 static uint32_t last_version;
 static bool ram_bulk_stage;
 
@@ -414,6 +434,36 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t **current_data,
     return bytes_sent;
 }
 
+/* Needs the ramlist lock, as it walks the block list */
+static void migration_bitmap_clear_chunk(unsigned long page)
+{
+    unsigned long chunk = page >> MIGRATION_CLEAR_BITMAP_SHIFT;
+    ram_addr_t start, end;
+    RAMBlock *block;
+
+    if (!test_and_clear_bit(chunk, migration_clear_bitmap)) {
+        return;
+    }
+
+    start = (ram_addr_t)chunk << (MIGRATION_CLEAR_BITMAP_SHIFT +
+                                  TARGET_PAGE_BITS);
+    end = start + ((ram_addr_t)1 << (MIGRATION_CLEAR_BITMAP_SHIFT +
+                                     TARGET_PAGE_BITS));
+    trace_migration_bitmap_clear_chunk(start, end - start);
+
+    /* A chunk may straddle blocks, re-arm all of it in one go */
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        ram_addr_t block_start = MAX(start, block->offset);
+        ram_addr_t block_end = MIN(end, block->offset + block->used_length);
+
+        if (block_start < block_end) {
+            memory_region_clear_dirty_bitmap(block->mr,
+                                             block_start - block->offset,
+                                             block_end - block_start);
+        }
+    }
+}
+
 static inline
 ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
                                                  ram_addr_t start)
@@ -425,19 +475,56 @@ ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
 
     unsigned long next;
 
-    if (ram_bulk_stage && nr > base) {
+    if (ram_bulk_stage && nr > base && nr + 1 < size &&
+        test_bit(nr + 1, migration_bitmap)) {
+        /* Fast path: in the bulk stage most pages are still dirty, but
+         * free page reporting may have cleared some of them.
+         */
         next = nr + 1;
     } else {
         next = find_next_bit(migration_bitmap, size, nr);
     }
 
     if (next < size) {
+        /* Re-arm dirty tracking before the page is read for sending */
+        migration_bitmap_clear_chunk(next);
         clear_bit(next, migration_bitmap);
         migration_dirty_pages--;
     }
     return (next - base) << TARGET_PAGE_BITS;
 }
 
+/* Drop pages [page, end) from the bitmap.  Dirty tracking is re-armed
+ * first, so that the next sync catches them once they are written again.
+ * Needs the ramlist lock.
+ */
+static void migration_bitmap_clear_pages(unsigned long page, unsigned long end)
+{
+    for (; page < end; page++) {
+        migration_bitmap_clear_chunk(page);
+        if (test_and_clear_bit(page, migration_bitmap)) {
+            migration_dirty_pages--;
+        }
+    }
+}
+
+/* Called with the iothread lock held, when the guest has reported
+ * [start, start + length) as free.  The guest does not care about the
+ * contents until it writes to the pages again, so do not send them; this
+ * also skips them during the bulk stage.
+ */
+void migration_bitmap_skip_free_range(ram_addr_t start, ram_addr_t length)
+{
+    unsigned long page = DIV_ROUND_UP(start, TARGET_PAGE_SIZE);
+    unsigned long end = (start + length) >> TARGET_PAGE_BITS;
+
+    qemu_mutex_lock_ramlist();
+    if (migration_bitmap) {
+        migration_bitmap_clear_pages(page, end);
+    }
+    qemu_mutex_unlock_ramlist();
+}
+
 static inline bool migration_bitmap_set_dirty(ram_addr_t addr)
 {
     bool ret;
@@ -451,6 +538,15 @@ static inline bool migration_bitmap_set_dirty(ram_addr_t addr)
     return ret;
 }
 
+/*
+ * With x-ignore-shared, RAM that is mapped shared from a file is not
+ * migrated: the destination maps the same file and sees the same pages.
+ */
+static bool ramblock_is_ignored(RAMBlock *block)
+{
+    return migrate_ignore_shared() && qemu_ram_is_shared(block);
+}
+
 static void migration_bitmap_sync_range(ram_addr_t start, ram_addr_t length)
 {
     ram_addr_t addr;
@@ -523,9 +619,15 @@ static void migration_bitmap_sync(void)
     trace_migration_bitmap_sync_start();
     address_space_sync_dirty_bitmap(&address_space_memory);
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (ramblock_is_ignored(block)) {
+            continue;
+        }
         migration_bitmap_sync_range(block->mr->ram_addr, block->used_length);
     }
+    rcu_read_unlock();
+    bitmap_set(migration_clear_bitmap, 0, migration_clear_bitmap_chunks);
     trace_migration_bitmap_sync_end(migration_dirty_pages
                                     - num_dirty_pages_init);
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
@@ -534,23 +636,31 @@ static void migration_bitmap_sync(void)
     /* more than 1 second = 1000 millisecons */
     if (end_time > start_time + 1000) {
         if (migrate_auto_converge()) {
-            /* The following detection logic can be refined later. For now:
-               Check to see if the dirtied bytes is 50% more than the approx.
-               amount of bytes that just got transferred since the last time we
-               were in this routine. If that happens >N times (for now N==4)
-               we turn on the throttle down logic */
+            /* Check to see if the dirtied bytes is 50% more than the approx.
+               amount of bytes that just got transferred since the last time
+               we were in this routine. If that happens twice, start
+               throttling the guest. Once the throttle is engaged it is
+               re-evaluated on every period, so that it follows the dirty
+               rate up and down instead of sticking at one level. */
+            uint64_t bytes_dirty_period = num_dirty_pages_period *
+                                          TARGET_PAGE_SIZE;
+            uint64_t bytes_xfer_period;
+
             bytes_xfer_now = ram_bytes_transferred();
-            if (s->dirty_pages_rate &&
-               (num_dirty_pages_period * TARGET_PAGE_SIZE >
-                   (bytes_xfer_now - bytes_xfer_prev)/2) &&
-               (dirty_rate_high_cnt++ > 4)) {
-                    trace_migration_throttle();
-                    mig_throttle_on = true;
-                    dirty_rate_high_cnt = 0;
-             }
-             bytes_xfer_prev = bytes_xfer_now;
-        } else {
-             mig_throttle_on = false;
+            bytes_xfer_period = bytes_xfer_now - bytes_xfer_prev;
+            if (cpu_throttle_active()) {
+                mig_throttle_guest_down(bytes_dirty_period,
+                                        bytes_xfer_period);
+            } else if (s->dirty_pages_rate &&
+                       (bytes_dirty_period > bytes_xfer_period / 2) &&
+                       (dirty_rate_high_cnt++ >= 2)) {
+                mig_throttle_guest_down(bytes_dirty_period,
+                                        bytes_xfer_period);
+                dirty_rate_high_cnt = 0;
+            }
+            bytes_xfer_prev = bytes_xfer_now;
+        } else if (cpu_throttle_active()) {
+            cpu_throttle_stop();
         }
         if (migrate_use_xbzrle()) {
             if (iterations_prev != 0) {
@@ -622,7 +732,10 @@ static int ram_save_page(QEMUFile *f, RAMBlock* block, ram_addr_t offset,
                                       offset, cont, last_stage);
         if (!last_stage) {
             /* Can't send this cached data async, since the cache page
-             * might get updated before it gets to the wire
+             * might get updated before it gets to the wire.  This also
+             * keeps it away from zero-copy sends, which only guest RAM
+             * may use: a page that changes under the kernel is simply
+             * dirty again and resent, a cache page is not.
              */
             send_async = false;
         }
@@ -660,21 +773,28 @@ static int ram_find_and_save_block(QEMUFile *f, bool last_stage)
     int bytes_sent = 0;
     MemoryRegion *mr;
 
-    if (!block)
-        block = QTAILQ_FIRST(&ram_list.blocks);
+    if (!block) {
+        block = QLIST_FIRST_RCU(&ram_list.blocks);
+        /* Stop after one round even if no block has anything to send */
+        last_seen_block = block;
+    }
 
     while (true) {
         mr = block->mr;
-        offset = migration_bitmap_find_and_reset_dirty(mr, offset);
+        if (ramblock_is_ignored(block)) {
+            offset = block->used_length;
+        } else {
+            offset = migration_bitmap_find_and_reset_dirty(mr, offset);
+        }
         if (complete_round && block == last_seen_block &&
             offset >= last_offset) {
             break;
         }
         if (offset >= block->used_length) {
             offset = 0;
-            block = QTAILQ_NEXT(block, next);
+            block = QLIST_NEXT_RCU(block, next);
             if (!block) {
-                block = QTAILQ_FIRST(&ram_list.blocks);
+                block = QLIST_FIRST_RCU(&ram_list.blocks);
                 complete_round = true;
                 ram_bulk_stage = false;
             }
@@ -728,9 +848,11 @@ uint64_t ram_bytes_total(void)
     RAMBlock *block;
     uint64_t total = 0;
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next)
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         total += block->used_length;
-
+    }
+    rcu_read_unlock();
     return total;
 }
 
@@ -742,10 +864,14 @@ void free_xbzrle_decoded_buf(void)
 
 static void migration_end(void)
 {
+    cpu_throttle_stop();
+
     if (migration_bitmap) {
         memory_global_dirty_log_stop();
         g_free(migration_bitmap);
         migration_bitmap = NULL;
+        g_free(migration_clear_bitmap);
+        migration_clear_bitmap = NULL;
     }
 
     XBZRLE_cache_lock();
@@ -776,12 +902,92 @@ static void reset_ram_globals(void)
 
 #define MAX_WAIT 50 /* ms, half buffered_file limit */
 
+/* With x-mapped-ram, all of RAM goes out once before any other page, in
+ * ram_addr order; mapped_next is the ram_addr to continue from.
+ */
+static bool mapped_pending;
+static ram_addr_t mapped_next;
+
+/* Return the block that holds mapped_next or comes first after it */
+static RAMBlock *ram_mapped_next_block(void)
+{
+    RAMBlock *block, *found = NULL;
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (ramblock_is_ignored(block) ||
+            block->offset + block->used_length <= mapped_next) {
+            continue;
+        }
+        if (!found || block->offset < found->offset) {
+            found = block;
+        }
+    }
+    return found;
+}
+
+/*
+ * With x-mapped-ram, send RAM in records that each hold a range of a
+ * block, with the contents at a RAM_MAPPED_ALIGN-aligned offset of the
+ * stream.  When the stream ends up in a file, the destination can then
+ * map the ranges from it instead of reading them.  Pages that the guest
+ * dirties after their range went out are sent as usual and replace the
+ * mapped copy on the destination.
+ *
+ * Stops at the rate limit unless @last is set.  Returns the number of
+ * bytes sent.  Needs the ramlist lock.
+ */
+static int64_t ram_save_mapped(QEMUFile *f, bool last)
+{
+    static const uint8_t zeroes[RAM_MAPPED_ALIGN];
+    int64_t t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
+    int64_t total_sent = 0;
+
+    while (mapped_pending && (last || !qemu_file_rate_limit(f))) {
+        RAMBlock *block = ram_mapped_next_block();
+        ram_addr_t offset, size;
+        int pad;
+
+        if (!block) {
+            mapped_pending = false;
+            /* There is nothing left to send in bulk */
+            ram_bulk_stage = false;
+            break;
+        }
+
+        offset = MAX(mapped_next, block->offset) - block->offset;
+        size = MIN(block->used_length - offset, RAM_MAPPED_CHUNK);
+        migration_bitmap_clear_pages((block->offset + offset) >>
+                                     TARGET_PAGE_BITS,
+                                     (block->offset + offset + size) >>
+                                     TARGET_PAGE_BITS);
+
+        qemu_put_be64(f, offset | RAM_SAVE_FLAG_MAPPED);
+        qemu_put_byte(f, strlen(block->idstr));
+        qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
+        qemu_put_be64(f, size);
+        pad = -(qemu_ftell_fast(f) + 8) & (RAM_MAPPED_ALIGN - 1);
+        qemu_put_be64(f, pad);
+        qemu_put_buffer(f, zeroes, pad);
+        qemu_put_buffer_async(f, ramblock_ptr(block, offset), size);
+
+        total_sent += 25 + strlen(block->idstr) + pad + size;
+        acct_info.norm_pages += size >> TARGET_PAGE_BITS;
+        mapped_next = block->offset + offset + size;
+
+        if (!last &&
+            (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - t0) / 1000000 >
+            MAX_WAIT) {
+            break;
+        }
+    }
+    return total_sent;
+}
+
 static int ram_save_setup(QEMUFile *f, void *opaque)
 {
     RAMBlock *block;
     int64_t ram_bitmap_pages; /* Size of bitmap in pages, including gaps */
 
-    mig_throttle_on = false;
     dirty_rate_high_cnt = 0;
     bitmap_sync_count = 0;
     migration_bitmap_sync_init();
@@ -824,16 +1030,24 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
     ram_bitmap_pages = last_ram_offset() >> TARGET_PAGE_BITS;
     migration_bitmap = bitmap_new(ram_bitmap_pages);
     bitmap_set(migration_bitmap, 0, ram_bitmap_pages);
+    migration_clear_bitmap_chunks =
+        DIV_ROUND_UP(ram_bitmap_pages, 1UL << MIGRATION_CLEAR_BITMAP_SHIFT);
+    migration_clear_bitmap = bitmap_new(migration_clear_bitmap_chunks);
 
     /*
      * Count the total number of pages used by ram blocks not including any
      * gaps due to alignment or unplugs.
      */
     migration_dirty_pages = 0;
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         uint64_t block_pages;
 
         block_pages = block->used_length >> TARGET_PAGE_BITS;
+        if (ramblock_is_ignored(block)) {
+            bitmap_clear(migration_bitmap,
+                         block->mr->ram_addr >> TARGET_PAGE_BITS, block_pages);
+            continue;
+        }
         migration_dirty_pages += block_pages;
     }
 
@@ -843,12 +1057,18 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 
     qemu_put_be64(f, ram_bytes_total() | RAM_SAVE_FLAG_MEM_SIZE);
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         qemu_put_byte(f, strlen(block->idstr));
         qemu_put_buffer(f, (uint8_t *)block->idstr, strlen(block->idstr));
         qemu_put_be64(f, block->used_length);
+        if (migrate_ignore_shared()) {
+            qemu_put_byte(f, ramblock_is_ignored(block));
+        }
     }
 
+    mapped_pending = migrate_mapped_ram();
+    mapped_next = 0;
+
     qemu_mutex_unlock_ramlist();
 
     ram_control_before_iterate(f, RAM_CONTROL_SETUP);
@@ -874,9 +1094,11 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 
     ram_control_before_iterate(f, RAM_CONTROL_ROUND);
 
+    total_sent = ram_save_mapped(f, false);
+
     t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
     i = 0;
-    while ((ret = qemu_file_rate_limit(f)) == 0) {
+    while (!mapped_pending && qemu_file_rate_limit(f) == 0) {
         int bytes_sent;
 
         bytes_sent = ram_find_and_save_block(f, false);
@@ -886,7 +1108,6 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         }
         total_sent += bytes_sent;
         acct_info.iterations++;
-        check_guest_throttling();
         /* we want to check in the 1st loop, just in case it was the 1st time
            and we had to sync the dirty bitmap.
            qemu_get_clock_ns() is a bit expensive, so we only check each some
@@ -935,6 +1156,8 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
 
     ram_control_before_iterate(f, RAM_CONTROL_FINISH);
 
+    bytes_transferred += ram_save_mapped(f, true);
+
     /* try transferring iterative blocks of memory */
 
     /* flush all remaining blocks regardless of rate limiting */
@@ -1008,6 +1231,9 @@ static int load_xbzrle(QEMUFile *f, ram_addr_t addr, void *host)
     return 0;
 }
 
+/* Must be called from within a rcu critical section.
+ * Returns a pointer from within the RCU-protected ram_list.
+ */
 static inline void *host_from_stream_offset(QEMUFile *f,
                                             ram_addr_t offset,
                                             int flags)
@@ -1029,7 +1255,7 @@ static inline void *host_from_stream_offset(QEMUFile *f,
     qemu_get_buffer(f, (uint8_t *)id, len);
     id[len] = 0;
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         if (!strncmp(id, block->idstr, sizeof(id)) &&
             block->max_length > offset) {
             return memory_region_get_ram_ptr(block->mr) + offset;
@@ -1051,6 +1277,72 @@ void ram_handle_compressed(void *host, uint8_t ch, uint64_t size)
     }
 }
 
+/*
+ * Set once mapping a record failed; the remaining records are read, since
+ * further mappings (e.g. beyond vm.max_map_count) would fail the same way.
+ */
+static bool ram_map_failed;
+
+/*
+ * Load a record written by ram_save_mapped.  If the stream is read from a
+ * file, map the range from it, so that the guest can start right away and
+ * pages are read as it touches them; otherwise read the range.
+ * Must be called from within a rcu critical section.
+ */
+static int ram_load_mapped(QEMUFile *f, ram_addr_t offset)
+{
+    RAMBlock *block;
+    uint8_t buf[256];
+    uint8_t len;
+    char id[256];
+    uint64_t size, pad;
+    int64_t file_offset;
+    int fd, n;
+
+    len = qemu_get_byte(f);
+    qemu_get_buffer(f, (uint8_t *)id, len);
+    id[len] = 0;
+    size = qemu_get_be64(f);
+    pad = qemu_get_be64(f);
+
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        if (!strncmp(id, block->idstr, sizeof(id))) {
+            break;
+        }
+    }
+    if (!block) {
+        error_report("Can't find block %s!", id);
+        return -EINVAL;
+    }
+    if (!size || size > RAM_MAPPED_CHUNK || offset >= block->used_length ||
+        size > block->used_length - offset || pad >= RAM_MAPPED_ALIGN) {
+        error_report("Bad mapped RAM record for block %s", id);
+        return -EINVAL;
+    }
+
+    while (pad) {
+        n = qemu_get_buffer(f, buf, MIN(pad, sizeof(buf)));
+        if (!n) {
+            return -EIO;
+        }
+        pad -= n;
+    }
+
+    fd = qemu_file_get_mapping(f, &file_offset);
+    if (fd >= 0 && !ram_map_failed) {
+        if (qemu_ram_map_file(block, offset, size, fd, file_offset) == 0) {
+            trace_ram_load_mapped(id, offset, size, file_offset);
+            return qemu_file_seek_forward(f, size);
+        }
+        ram_map_failed = true;
+    }
+
+    if (qemu_get_buffer(f, ramblock_ptr(block, offset), size) != size) {
+        return -EIO;
+    }
+    return 0;
+}
+
 static int ram_load(QEMUFile *f, void *opaque, int version_id)
 {
     int flags = 0, ret = 0;
@@ -1062,6 +1354,12 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         ret = -EINVAL;
     }
 
+    /* This RCU critical section can be very long running.
+     * When RCU reclaims in the code start to become numerous,
+     * it will be necessary to reduce the granularity of this
+     * critical section.
+     */
+    rcu_read_lock();
     while (!ret && !(flags & RAM_SAVE_FLAG_EOS)) {
         ram_addr_t addr, total_ram_bytes;
         void *host;
@@ -1075,20 +1373,27 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         case RAM_SAVE_FLAG_MEM_SIZE:
             /* Synchronize RAM block list */
             total_ram_bytes = addr;
+            ram_map_failed = false;
             while (!ret && total_ram_bytes) {
                 RAMBlock *block;
                 uint8_t len;
                 char id[256];
                 ram_addr_t length;
+                bool ignored;
 
                 len = qemu_get_byte(f);
                 qemu_get_buffer(f, (uint8_t *)id, len);
                 id[len] = 0;
                 length = qemu_get_be64(f);
+                ignored = migrate_ignore_shared() && qemu_get_byte(f);
 
-                QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+                QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
                     if (!strncmp(id, block->idstr, sizeof(id))) {
-                        if (length != block->used_length) {
+                        if (ignored != ramblock_is_ignored(block)) {
+                            error_report("RAM block \"%s\" must be shared "
+                                         "on both sides or on neither", id);
+                            ret = -EINVAL;
+                        } else if (length != block->used_length) {
                             Error *local_err = NULL;
 
                             ret = qemu_ram_resize(block->offset, length, &local_err);
@@ -1146,6 +1451,9 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 break;
             }
             break;
+        case RAM_SAVE_FLAG_MAPPED:
+            ret = ram_load_mapped(f, addr);
+            break;
         case RAM_SAVE_FLAG_EOS:
             /* normal exit */
             break;
@@ -1163,6 +1471,7 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         }
     }
 
+    rcu_read_unlock();
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
     return ret;
@@ -1383,51 +1692,51 @@ TargetInfo *qmp_query_target(Error **errp)
     return info;
 }
 
-/* Stub function that's gets run on the vcpu when its brought out of the
-   VM to run inside qemu via async_run_on_cpu()*/
-static void mig_sleep_cpu(void *opq)
-{
-    qemu_mutex_unlock_iothread();
-    g_usleep(30*1000);
-    qemu_mutex_lock_iothread();
-}
-
-/* To reduce the dirty rate explicitly disallow the VCPUs from spending
-   much time in the VM. The migration thread will try to catchup.
-   Workload will experience a performance drop.
-*/
-static void mig_throttle_guest_down(void)
-{
-    CPUState *cpu;
-
-    qemu_mutex_lock_iothread();
-    CPU_FOREACH(cpu) {
-        async_run_on_cpu(cpu, mig_sleep_cpu, NULL);
-    }
-    qemu_mutex_unlock_iothread();
-}
-
-static void check_guest_throttling(void)
+/* Reduce amount of guest cpu execution to hopefully slow down memory writes.
+ *
+ * The throttle is sized from the last sync period: the guest should dirty
+ * no more than half of what the migration stream managed to send.  The
+ * observed dirty rate was measured with the current throttle in place, so
+ * scale it back to what the guest would dirty unthrottled before working out
+ * how much of each timeslice it may still run.  The throttle then moves
+ * towards that target by at most cpu-throttle-increment points per period,
+ * which keeps a single noisy sample from stalling the guest.
+ */
+static void mig_throttle_guest_down(uint64_t bytes_dirty_period,
+                                    uint64_t bytes_xfer_period)
 {
-    static int64_t t0;
-    int64_t        t1;
-
-    if (!mig_throttle_on) {
-        return;
+    int pct_initial = migrate_cpu_throttle_initial();
+    int pct_increment = migrate_cpu_throttle_increment();
+    int pct_max = migrate_cpu_throttle_max();
+    int pct_now = cpu_throttle_get_percentage();
+    int pct_target;
+    double bytes_dirty_unthrottled;
+    double run_ratio;
+
+    if (!pct_now) {
+        /* First throttling pass: start from the configured floor */
+        pct_now = pct_initial;
+        pct_target = pct_initial;
+    } else if (!bytes_dirty_period) {
+        pct_target = 0;
+    } else {
+        bytes_dirty_unthrottled = (double)bytes_dirty_period * 100 /
+                                  (100 - pct_now);
+        run_ratio = (bytes_xfer_period / 2.0) / bytes_dirty_unthrottled;
+        pct_target = 100 - (int)(MIN(run_ratio, 1.0) * 100);
     }
 
-    if (!t0)  {
-        t0 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-        return;
+    if (pct_target > pct_now) {
+        pct_target = MIN(pct_target, pct_now + pct_increment);
+    } else {
+        pct_target = MAX(pct_target, pct_now - pct_increment);
     }
+    pct_target = MIN(pct_target, pct_max);
 
-    t1 = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
-
-    /* If it has been more than 40 ms since the last time the guest
-     * was throttled then do it again.
-     */
-    if (40 < (t1-t0)/1000000) {
-        mig_throttle_guest_down();
-        t0 = t1;
+    trace_migration_throttle(pct_target);
+    if (pct_target <= 0) {
+        cpu_throttle_stop();
+    } else {
+        cpu_throttle_set(pct_target);
     }
 }
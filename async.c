@@ -236,6 +236,7 @@ aio_ctx_finalize(GSource     *source)
     qemu_mutex_destroy(&ctx->bh_lock);
     g_array_free(ctx->pollfds, TRUE);
     timerlistgroup_deinit(&ctx->tlg);
+    aio_context_destroy(ctx);
 }
 
 static GSourceFuncs aio_source_funcs = {
@@ -296,8 +297,10 @@ AioContext *aio_context_new(Error **errp)
     int ret;
     AioContext *ctx;
     ctx = (AioContext *) g_source_new(&aio_source_funcs, sizeof(AioContext));
+    aio_context_setup(ctx);
     ret = event_notifier_init(&ctx->notifier, false);
     if (ret < 0) {
+        aio_context_destroy(ctx);
         g_source_destroy(&ctx->source);
         error_setg_errno(errp, -ret, "Failed to initialize event notifier");
         return NULL;
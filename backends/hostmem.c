@@ -19,6 +19,7 @@
 
 #ifdef CONFIG_NUMA
 #include <numaif.h>
+#include <numa.h>
 QEMU_BUILD_BUG_ON(HOST_MEM_POLICY_DEFAULT != MPOL_DEFAULT);
 QEMU_BUILD_BUG_ON(HOST_MEM_POLICY_PREFERRED != MPOL_PREFERRED);
 QEMU_BUILD_BUG_ON(HOST_MEM_POLICY_BIND != MPOL_BIND);
@@ -113,6 +114,97 @@ host_memory_backend_set_host_nodes(Object *obj, Visitor *v, void *opaque,
 #endif
 }
 
+static void
+host_memory_backend_get_prealloc_threads(Object *obj, Visitor *v,
+                                         void *opaque, const char *name,
+                                         Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+    uint32_t value = backend->prealloc_threads;
+
+    visit_type_uint32(v, &value, name, errp);
+}
+
+static void
+host_memory_backend_set_prealloc_threads(Object *obj, Visitor *v,
+                                         void *opaque, const char *name,
+                                         Error **errp)
+{
+    HostMemoryBackend *backend = MEMORY_BACKEND(obj);
+    Error *local_err = NULL;
+    uint32_t value;
+
+    visit_type_uint32(v, &value, name, &local_err);
+    if (local_err) {
+        goto out;
+    }
+    if (!value) {
+        error_setg(&local_err, "Property '%s.%s' doesn't take value '%"
+                   PRIu32 "'", object_get_typename(obj), name, value);
+        goto out;
+    }
+    backend->prealloc_threads = value;
+out:
+    error_propagate(errp, local_err);
+}
+
+#ifdef CONFIG_NUMA
+/* Fill @host_cpus with the CPUs of the backend's host nodes.  Returns
+ * false if there are none, e.g. because no host-nodes were given.
+ */
+static bool
+host_memory_backend_get_node_cpus(HostMemoryBackend *backend,
+                                  unsigned long *host_cpus)
+{
+    struct bitmask *mask;
+    unsigned long node, cpu;
+    bool found = false;
+
+    if (numa_available() < 0) {
+        return false;
+    }
+
+    bitmap_zero(host_cpus, MAX_HOST_CPUS);
+    mask = numa_allocate_cpumask();
+    for (node = find_first_bit(backend->host_nodes, MAX_NODES);
+         node < MAX_NODES;
+         node = find_next_bit(backend->host_nodes, MAX_NODES, node + 1)) {
+        if (numa_node_to_cpus(node, mask) < 0) {
+            continue;
+        }
+        for (cpu = 0; cpu < MAX_HOST_CPUS && cpu < mask->size; cpu++) {
+            if (numa_bitmask_isbitset(mask, cpu)) {
+                set_bit(cpu, host_cpus);
+                found = true;
+            }
+        }
+    }
+    numa_free_cpumask(mask);
+    return found;
+}
+#endif
+
+/* Preallocate the backend's memory, from threads running on its host
+ * nodes if it is bound to some.
+ */
+static void host_memory_backend_prealloc(HostMemoryBackend *backend)
+{
+    int fd = memory_region_get_fd(&backend->mr);
+    void *ptr = memory_region_get_ram_ptr(&backend->mr);
+    uint64_t sz = memory_region_size(&backend->mr);
+    unsigned long *host_cpus = NULL;
+#ifdef CONFIG_NUMA
+    DECLARE_BITMAP(node_cpus, MAX_HOST_CPUS);
+
+    if (backend->policy != MPOL_DEFAULT &&
+        host_memory_backend_get_node_cpus(backend, node_cpus)) {
+        host_cpus = node_cpus;
+    }
+#endif
+
+    os_mem_prealloc(fd, ptr, sz, backend->prealloc_threads, host_cpus);
+}
+
 static void
 host_memory_backend_get_policy(Object *obj, Visitor *v, void *opaque,
                                const char *name, Error **errp)
@@ -218,11 +310,7 @@ static void host_memory_backend_set_prealloc(Object *obj, bool value,
     }
 
     if (value && !backend->prealloc) {
-        int fd = memory_region_get_fd(&backend->mr);
-        void *ptr = memory_region_get_ram_ptr(&backend->mr);
-        uint64_t sz = memory_region_size(&backend->mr);
-
-        os_mem_prealloc(fd, ptr, sz);
+        host_memory_backend_prealloc(backend);
         backend->prealloc = true;
     }
 }
@@ -236,6 +324,7 @@ static void host_memory_backend_init(Object *obj)
     backend->dump = qemu_opt_get_bool(qemu_get_machine_opts(),
                                       "dump-guest-core", true);
     backend->prealloc = mem_prealloc;
+    backend->prealloc_threads = smp_cpus;
 
     object_property_add_bool(obj, "merge",
                         host_memory_backend_get_merge,
@@ -246,6 +335,10 @@ static void host_memory_backend_init(Object *obj)
     object_property_add_bool(obj, "prealloc",
                         host_memory_backend_get_prealloc,
                         host_memory_backend_set_prealloc, NULL);
+    object_property_add(obj, "prealloc-threads", "int",
+                        host_memory_backend_get_prealloc_threads,
+                        host_memory_backend_set_prealloc_threads,
+                        NULL, NULL, NULL);
     object_property_add(obj, "size", "int",
                         host_memory_backend_get_size,
                         host_memory_backend_set_size, NULL, NULL, NULL);
@@ -330,7 +423,7 @@ host_memory_backend_memory_complete(UserCreatable *uc, Error **errp)
          * specified NUMA policy in place.
          */
         if (backend->prealloc) {
-            os_mem_prealloc(memory_region_get_fd(&backend->mr), ptr, sz);
+            host_memory_backend_prealloc(backend);
         }
     }
 }
@@ -31,9 +31,12 @@
 #include "sysemu/kvm.h"
 #include "sysemu/sysemu.h"
 #include "hw/xen/xen.h"
+#include "hw/vfio/vfio.h"
 #include "qemu/timer.h"
 #include "qemu/config-file.h"
 #include "qemu/error-report.h"
+#include "qemu/main-loop.h"
+#include "qemu/rcu_queue.h"
 #include "exec/memory.h"
 #include "sysemu/dma.h"
 #include "exec/address-spaces.h"
@@ -58,7 +61,10 @@
 #if !defined(CONFIG_USER_ONLY)
 static bool in_migration;
 
-RAMList ram_list = { .blocks = QTAILQ_HEAD_INITIALIZER(ram_list.blocks) };
+/* ram_list is read under rcu_read_lock()/rcu_read_unlock().  Writes
+ * are protected by the ramlist lock.
+ */
+RAMList ram_list = { .blocks = QLIST_HEAD_INITIALIZER(ram_list.blocks) };
 
 static MemoryRegion *system_memory;
 static MemoryRegion *system_io;
@@ -127,6 +133,8 @@ struct AddressSpaceDispatch {
     /* This is a multi-level map on the physical address space.
      * The bottom level has pointers to MemoryRegionSections.
      */
+    struct rcu_head rcu;
+
     PhysPageEntry phys_map;
     PhysPageMap map;
     AddressSpace *as;
@@ -361,6 +369,7 @@ static inline bool memory_access_is_direct(MemoryRegion *mr, bool is_write)
     return false;
 }
 
+/* Called from RCU critical section, or with the BQL held */
 MemoryRegion *address_space_translate(AddressSpace *as, hwaddr addr,
                                       hwaddr *xlat, hwaddr *plen,
                                       bool is_write)
@@ -371,7 +380,8 @@ MemoryRegion *address_space_translate(AddressSpace *as, hwaddr addr,
     hwaddr len = *plen;
 
     for (;;) {
-        section = address_space_translate_internal(as->dispatch, addr, &addr, plen, true);
+        AddressSpaceDispatch *d = atomic_rcu_read(&as->dispatch);
+        section = address_space_translate_internal(d, addr, &addr, plen, true);
         mr = section->mr;
 
         if (!mr->iommu_ops) {
@@ -405,7 +415,9 @@ address_space_translate_for_iotlb(AddressSpace *as, hwaddr addr, hwaddr *xlat,
                                   hwaddr *plen)
 {
     MemoryRegionSection *section;
-    section = address_space_translate_internal(as->dispatch, addr, xlat, plen, false);
+    AddressSpaceDispatch *d = atomic_rcu_read(&as->dispatch);
+
+    section = address_space_translate_internal(d, addr, xlat, plen, false);
 
     assert(!section->mr->iommu_ops);
     return section;
@@ -795,25 +807,164 @@ void cpu_abort(CPUState *cpu, const char *fmt, ...)
 }
 
 #if !defined(CONFIG_USER_ONLY)
-static RAMBlock *qemu_get_ram_block(ram_addr_t addr)
+/* Sorted views of ram_list.blocks, so that lookups do not have to walk
+ * the list.  by_offset holds every block ordered by ram_addr_t, by_host
+ * holds the blocks that have a host mapping ordered by host address.
+ * The index is immutable: the updater builds a new one with the ramlist
+ * lock held whenever a block is added or removed, and publishes it with
+ * RCU.
+ */
+typedef struct RAMBlockIndex {
+    struct rcu_head rcu;
+    unsigned nr;
+    unsigned nr_host;
+    RAMBlock **by_offset;
+    RAMBlock **by_host;
+    RAMBlock *blocks[];
+} RAMBlockIndex;
+
+static RAMBlockIndex *ram_block_index;
+
+static int ram_block_cmp_offset(const void *a, const void *b)
 {
+    const RAMBlock *ba = *(RAMBlock * const *)a;
+    const RAMBlock *bb = *(RAMBlock * const *)b;
+
+    return ba->offset < bb->offset ? -1 : ba->offset > bb->offset;
+}
+
+static int ram_block_cmp_host(const void *a, const void *b)
+{
+    uintptr_t ha = (uintptr_t)(*(RAMBlock * const *)a)->host;
+    uintptr_t hb = (uintptr_t)(*(RAMBlock * const *)b)->host;
+
+    return ha < hb ? -1 : ha > hb;
+}
+
+static void ram_block_index_free(RAMBlockIndex *index)
+{
+    g_free(index);
+}
+
+/* Called with the ramlist lock held.  */
+static void ram_block_index_update(void)
+{
+    RAMBlockIndex *old = ram_block_index;
+    RAMBlockIndex *index;
     RAMBlock *block;
+    unsigned nr = 0;
 
-    /* The list is protected by the iothread lock here.  */
-    block = ram_list.mru_block;
-    if (block && addr - block->offset < block->max_length) {
-        goto found;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        nr++;
     }
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        if (addr - block->offset < block->max_length) {
-            goto found;
+
+    index = g_malloc0(sizeof(*index) + 2 * nr * sizeof(RAMBlock *));
+    index->by_offset = index->blocks;
+    index->by_host = index->blocks + nr;
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        index->by_offset[index->nr++] = block;
+        /* Xen maps guest RAM lazily, so block->host may still be NULL */
+        if (block->host) {
+            index->by_host[index->nr_host++] = block;
         }
     }
+    qsort(index->by_offset, index->nr, sizeof(RAMBlock *),
+          ram_block_cmp_offset);
+    qsort(index->by_host, index->nr_host, sizeof(RAMBlock *),
+          ram_block_cmp_host);
 
-    fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
-    abort();
+    atomic_rcu_set(&ram_block_index, index);
+    if (old) {
+        call_rcu(old, ram_block_index_free, rcu);
+    }
+}
 
-found:
+/* Called from RCU critical section.  Returns the block that contains
+ * addr, or NULL.
+ */
+static RAMBlock *ram_block_index_find(ram_addr_t addr)
+{
+    RAMBlockIndex *index = atomic_rcu_read(&ram_block_index);
+    RAMBlock *block;
+    unsigned lo = 0, hi;
+
+    if (!index) {
+        return NULL;
+    }
+
+    /* Find the last block that starts at or below addr */
+    hi = index->nr;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+
+        if (index->by_offset[mid]->offset <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return NULL;
+    }
+
+    block = index->by_offset[lo - 1];
+    return addr - block->offset < block->max_length ? block : NULL;
+}
+
+/* Called from RCU critical section.  Returns the block whose host
+ * mapping contains host, or NULL.
+ */
+static RAMBlock *ram_block_index_find_host(const uint8_t *host)
+{
+    RAMBlockIndex *index = atomic_rcu_read(&ram_block_index);
+    RAMBlock *block;
+    unsigned lo = 0, hi;
+
+    if (!index) {
+        return NULL;
+    }
+
+    hi = index->nr_host;
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+
+        if ((uintptr_t)index->by_host[mid]->host <= (uintptr_t)host) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo == 0) {
+        return NULL;
+    }
+
+    block = index->by_host[lo - 1];
+    return (uintptr_t)host - (uintptr_t)block->host < block->max_length ?
+           block : NULL;
+}
+
+/* Called from RCU critical section */
+static RAMBlock *qemu_get_ram_block(ram_addr_t addr)
+{
+    RAMBlock *block;
+
+    block = atomic_rcu_read(&ram_list.mru_block);
+    if (block && addr - block->offset < block->max_length) {
+        return block;
+    }
+
+    block = ram_block_index_find(addr);
+    if (!block) {
+        fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
+        abort();
+    }
+
+    /* This is only an extra copy of a pointer that was published when
+     * the block was put in the list, so atomic_rcu_set is not needed.
+     * If the block is being removed concurrently, this store may undo
+     * the updater's reset of mru_block; reclaim_ramblock_mru clears it
+     * again before the block is freed.
+     */
     ram_list.mru_block = block;
     return block;
 }
@@ -827,10 +978,12 @@ static void tlb_reset_dirty_range_all(ram_addr_t start, ram_addr_t length)
     end = TARGET_PAGE_ALIGN(start + length);
     start &= TARGET_PAGE_MASK;
 
+    rcu_read_lock();
     block = qemu_get_ram_block(start);
     assert(block == qemu_get_ram_block(end - 1));
     start1 = (uintptr_t)ramblock_ptr(block, start - block->offset);
     cpu_tlb_reset_dirty_all(start1, length);
+    rcu_read_unlock();
 }
 
 /* Note: start and end must be within the same ram block.  */
@@ -1080,6 +1233,7 @@ static void *file_ram_alloc(RAMBlock *block,
     char *c;
     void *area = NULL;
     int fd;
+    struct stat st;
     uint64_t hpagesize;
     Error *local_err = NULL;
 
@@ -1103,26 +1257,40 @@ static void *file_ram_alloc(RAMBlock *block,
         goto error;
     }
 
-    /* Make name safe to use with mkstemp by replacing '/' with '_'. */
-    sanitized_name = g_strdup(memory_region_name(block->mr));
-    for (c = sanitized_name; *c != '\0'; c++) {
-        if (*c == '/')
-            *c = '_';
+    /*
+     * An existing file is used as is, so that its contents survive and
+     * another QEMU process can map the same guest RAM.  A directory gets
+     * an unlinked temporary file.
+     */
+    fd = open(path, O_RDWR);
+    if (fd < 0 && errno != EISDIR) {
+        error_setg_errno(errp, errno,
+                         "unable to open backing store %s", path);
+        goto error;
     }
 
-    filename = g_strdup_printf("%s/qemu_back_mem.%s.XXXXXX", path,
-                               sanitized_name);
-    g_free(sanitized_name);
-
-    fd = mkstemp(filename);
     if (fd < 0) {
-        error_setg_errno(errp, errno,
-                         "unable to create backing store for hugepages");
+        /* Make name safe to use with mkstemp by replacing '/' with '_'. */
+        sanitized_name = g_strdup(memory_region_name(block->mr));
+        for (c = sanitized_name; *c != '\0'; c++) {
+            if (*c == '/')
+                *c = '_';
+        }
+
+        filename = g_strdup_printf("%s/qemu_back_mem.%s.XXXXXX", path,
+                                   sanitized_name);
+        g_free(sanitized_name);
+
+        fd = mkstemp(filename);
+        if (fd < 0) {
+            error_setg_errno(errp, errno,
+                             "unable to create backing store for hugepages");
+            g_free(filename);
+            goto error;
+        }
+        unlink(filename);
         g_free(filename);
-        goto error;
     }
-    unlink(filename);
-    g_free(filename);
 
     memory = (memory+hpagesize-1) & ~(hpagesize-1);
 
@@ -1131,9 +1299,14 @@ static void *file_ram_alloc(RAMBlock *block,
      * hosts, so don't bother bailing out on errors.
      * If anything goes wrong with it under other filesystems,
      * mmap will fail.
+     *
+     * An existing file may be larger than the block, e.g. when it holds
+     * the RAM of another process; only ever extend it.
      */
-    if (ftruncate(fd, memory)) {
-        perror("ftruncate");
+    if (fstat(fd, &st) < 0 || st.st_size < memory) {
+        if (ftruncate(fd, memory)) {
+            perror("ftruncate");
+        }
     }
 
     area = mmap(0, memory, PROT_READ | PROT_WRITE,
@@ -1147,7 +1320,7 @@ static void *file_ram_alloc(RAMBlock *block,
     }
 
     if (mem_prealloc) {
-        os_mem_prealloc(fd, area, memory);
+        os_mem_prealloc(fd, area, memory, smp_cpus, NULL);
     }
 
     block->fd = fd;
@@ -1162,6 +1335,7 @@ error:
 }
 #endif
 
+/* Called with the ramlist lock held.  */
 static ram_addr_t find_ram_offset(ram_addr_t size)
 {
     RAMBlock *block, *next_block;
@@ -1169,15 +1343,16 @@ static ram_addr_t find_ram_offset(ram_addr_t size)
 
     assert(size != 0); /* it would hand out same offset multiple times */
 
-    if (QTAILQ_EMPTY(&ram_list.blocks))
+    if (QLIST_EMPTY_RCU(&ram_list.blocks)) {
         return 0;
+    }
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         ram_addr_t end, next = RAM_ADDR_MAX;
 
         end = block->offset + block->max_length;
 
-        QTAILQ_FOREACH(next_block, &ram_list.blocks, next) {
+        QLIST_FOREACH_RCU(next_block, &ram_list.blocks, next) {
             if (next_block->offset >= end) {
                 next = MIN(next, next_block->offset);
             }
@@ -1202,9 +1377,11 @@ ram_addr_t last_ram_offset(void)
     RAMBlock *block;
     ram_addr_t last = 0;
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next)
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         last = MAX(last, block->offset + block->max_length);
-
+    }
+    rcu_read_unlock();
     return last;
 }
 
@@ -1224,24 +1401,26 @@ static void qemu_ram_setup_dump(void *addr, ram_addr_t size)
     }
 }
 
+/* Called within an RCU critical section, or while the ramlist lock
+ * is held.
+ */
 static RAMBlock *find_ram_block(ram_addr_t addr)
 {
-    RAMBlock *block;
+    RAMBlock *block = ram_block_index_find(addr);
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        if (block->offset == addr) {
-            return block;
-        }
+    if (block && block->offset == addr) {
+        return block;
     }
-
     return NULL;
 }
 
+/* Called with iothread lock held.  */
 void qemu_ram_set_idstr(ram_addr_t addr, const char *name, DeviceState *dev)
 {
-    RAMBlock *new_block = find_ram_block(addr);
-    RAMBlock *block;
+    RAMBlock *new_block, *block;
 
+    rcu_read_lock();
+    new_block = find_ram_block(addr);
     assert(new_block);
     assert(!new_block->idstr[0]);
 
@@ -1254,25 +1433,32 @@ void qemu_ram_set_idstr(ram_addr_t addr, const char *name, DeviceState *dev)
     }
     pstrcat(new_block->idstr, sizeof(new_block->idstr), name);
 
-    /* This assumes the iothread lock is taken here too.  */
-    qemu_mutex_lock_ramlist();
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         if (block != new_block && !strcmp(block->idstr, new_block->idstr)) {
             fprintf(stderr, "RAMBlock \"%s\" already registered, abort!\n",
                     new_block->idstr);
             abort();
         }
     }
-    qemu_mutex_unlock_ramlist();
+    rcu_read_unlock();
 }
 
+/* Called with iothread lock held.  */
 void qemu_ram_unset_idstr(ram_addr_t addr)
 {
-    RAMBlock *block = find_ram_block(addr);
+    RAMBlock *block;
 
+    /* FIXME: arch_init.c assumes that this is not called throughout
+     * migration.  Ignore the problem since hot-unplug during migration
+     * does not work anyway.
+     */
+
+    rcu_read_lock();
+    block = find_ram_block(addr);
     if (block) {
         memset(block->idstr, 0, sizeof(block->idstr));
     }
+    rcu_read_unlock();
 }
 
 static int memory_try_enable_merging(void *addr, size_t len)
@@ -1331,6 +1517,7 @@ int qemu_ram_resize(ram_addr_t base, ram_addr_t newsize, Error **errp)
 static ram_addr_t ram_block_add(RAMBlock *new_block, Error **errp)
 {
     RAMBlock *block;
+    RAMBlock *last_block = NULL;
     ram_addr_t old_ram_size, new_ram_size;
 
     old_ram_size = last_ram_offset() >> TARGET_PAGE_BITS;
@@ -1357,19 +1544,28 @@ static ram_addr_t ram_block_add(RAMBlock *new_block, Error **errp)
         }
     }
 
-    /* Keep the list sorted from biggest to smallest block.  */
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+    /* Keep the list sorted from biggest to smallest block.  Unlike QTAILQ,
+     * QLIST (which has an RCU-friendly variant) does not have insertion at
+     * tail, so save the last element in last_block.
+     */
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
+        last_block = block;
         if (block->max_length < new_block->max_length) {
             break;
         }
     }
     if (block) {
-        QTAILQ_INSERT_BEFORE(block, new_block, next);
-    } else {
-        QTAILQ_INSERT_TAIL(&ram_list.blocks, new_block, next);
+        QLIST_INSERT_BEFORE_RCU(block, new_block, next);
+    } else if (last_block) {
+        QLIST_INSERT_AFTER_RCU(last_block, new_block, next);
+    } else { /* list is empty */
+        QLIST_INSERT_HEAD_RCU(&ram_list.blocks, new_block, next);
     }
     ram_list.mru_block = NULL;
+    ram_block_index_update();
 
+    /* Write list before version */
+    smp_wmb();
     ram_list.version++;
     qemu_mutex_unlock_ramlist();
 
@@ -1503,18 +1699,60 @@ ram_addr_t qemu_ram_alloc_resizeable(ram_addr_t size, ram_addr_t maxsz,
     return qemu_ram_alloc_internal(size, maxsz, resized, NULL, true, mr, errp);
 }
 
+/* Called by RCU with the iothread lock held; the Xen map cache and the
+ * fd-backed unmap both rely on it.
+ */
+static void reclaim_ramblock(RAMBlock *block)
+{
+    assert(qemu_mutex_iothread_locked());
+    if (block->flags & RAM_PREALLOC) {
+        ;
+    } else if (xen_enabled()) {
+        xen_invalidate_map_cache_entry(block->host);
+#ifndef _WIN32
+    } else if (block->fd >= 0) {
+        munmap(block->host, block->max_length);
+        close(block->fd);
+#endif
+    } else {
+        qemu_anon_ram_free(block->host, block->max_length);
+    }
+    g_free(block);
+}
+
+/* A reader that found the block before it was unlinked may have put it
+ * back in mru_block after the updater cleared it.  All such readers are
+ * gone by now; clear it again, and free the block after one more grace
+ * period so that nobody still holds the pointer read from mru_block.
+ */
+static void reclaim_ramblock_mru(RAMBlock *block)
+{
+    (void)atomic_cmpxchg(&ram_list.mru_block, block, NULL);
+    call_rcu(block, reclaim_ramblock, rcu);
+}
+
+static void ram_block_remove(RAMBlock *block)
+{
+    QLIST_REMOVE_RCU(block, next);
+    ram_list.mru_block = NULL;
+    ram_block_index_update();
+    /* Write list before version */
+    smp_wmb();
+    ram_list.version++;
+}
+
 void qemu_ram_free_from_ptr(ram_addr_t addr)
 {
     RAMBlock *block;
 
     /* This assumes the iothread lock is taken here too.  */
     qemu_mutex_lock_ramlist();
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         if (addr == block->offset) {
-            QTAILQ_REMOVE(&ram_list.blocks, block, next);
-            ram_list.mru_block = NULL;
-            ram_list.version++;
-            g_free(block);
+            ram_block_remove(block);
+            /* The host memory belongs to the caller */
+            block->flags |= RAM_PREALLOC;
+            call_rcu(block, reclaim_ramblock_mru, rcu);
             break;
         }
     }
@@ -1527,29 +1765,14 @@ void qemu_ram_free(ram_addr_t addr)
 
     /* This assumes the iothread lock is taken here too.  */
     qemu_mutex_lock_ramlist();
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         if (addr == block->offset) {
-            QTAILQ_REMOVE(&ram_list.blocks, block, next);
-            ram_list.mru_block = NULL;
-            ram_list.version++;
-            if (block->flags & RAM_PREALLOC) {
-                ;
-            } else if (xen_enabled()) {
-                xen_invalidate_map_cache_entry(block->host);
-#ifndef _WIN32
-            } else if (block->fd >= 0) {
-                munmap(block->host, block->max_length);
-                close(block->fd);
-#endif
-            } else {
-                qemu_anon_ram_free(block->host, block->max_length);
-            }
-            g_free(block);
+            ram_block_remove(block);
+            call_rcu(block, reclaim_ramblock_mru, rcu);
             break;
         }
     }
     qemu_mutex_unlock_ramlist();
-
 }
 
 #ifndef _WIN32
@@ -1560,7 +1783,8 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
     int flags;
     void *area, *vaddr;
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         offset = addr - block->offset;
         if (offset < block->max_length) {
             vaddr = ramblock_ptr(block, offset);
@@ -1597,24 +1821,108 @@ void qemu_ram_remap(ram_addr_t addr, ram_addr_t length)
                 memory_try_enable_merging(vaddr, length);
                 qemu_ram_setup_dump(vaddr, length);
             }
-            return;
+            break;
         }
     }
+    rcu_read_unlock();
 }
 #endif /* !_WIN32 */
 
 int qemu_get_ram_fd(ram_addr_t addr)
 {
-    RAMBlock *block = qemu_get_ram_block(addr);
+    RAMBlock *block;
+    int fd;
+
+    rcu_read_lock();
+    block = qemu_get_ram_block(addr);
+    fd = block->fd;
+    rcu_read_unlock();
+    return fd;
+}
+
+bool qemu_ram_is_shared(RAMBlock *rb)
+{
+    return rb->flags & RAM_SHARED;
+}
+
+bool qemu_ram_addr_is_shared(ram_addr_t addr)
+{
+    bool shared;
+
+    rcu_read_lock();
+    shared = qemu_ram_is_shared(qemu_get_ram_block(addr));
+    rcu_read_unlock();
+    return shared;
+}
+
+/*
+ * Replace [@start, @start + @length) of @rb with a private, copy-on-write
+ * mapping of @fd at @offset, so that pages are read from the file as the
+ * guest touches them.  Only anonymous RAM that no device has pinned for
+ * DMA can be replaced.  Returns 0 on success or -err; on failure the range
+ * is still backed by anonymous memory, whose contents may have been lost.
+ */
+int qemu_ram_map_file(RAMBlock *rb, ram_addr_t start, ram_addr_t length,
+                      int fd, int64_t offset)
+{
+#ifndef _WIN32
+    void *vaddr, *area;
+    int ret;
+
+    if (rb->fd >= 0 || (rb->flags & RAM_PREALLOC) || xen_enabled() ||
+        phys_mem_alloc != qemu_anon_ram_alloc ||
+        (kvm_enabled() && !kvm_has_sync_mmu()) || vfio_has_containers()) {
+        return -ENOTSUP;
+    }
+    if ((start | length | offset) & (qemu_real_host_page_size - 1)) {
+        return -EINVAL;
+    }
 
-    return block->fd;
+    assert(start + length <= rb->used_length);
+    vaddr = ramblock_ptr(rb, start);
+    area = mmap(vaddr, length, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_FIXED, fd, offset);
+    if (area == MAP_FAILED) {
+        ret = -errno;
+        /*
+         * Most failures, e.g. EINVAL or ENOMEM from running out of
+         * mappings, are reported before the old range is unmapped.  Only
+         * put anonymous memory back if the range is really gone, which
+         * msync reports as ENOMEM.
+         */
+        if (msync(vaddr, length, MS_ASYNC) == 0) {
+            return ret;
+        }
+        area = mmap(vaddr, length, PROT_READ | PROT_WRITE,
+                    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0);
+        if (area != vaddr) {
+            fprintf(stderr, "Could not remap RAM block %s\n", rb->idstr);
+            exit(1);
+        }
+    } else {
+        ret = 0;
+    }
+    /* The advice given in ram_block_add() went away with the old mapping */
+    memory_try_enable_merging(area, length);
+    qemu_ram_setup_dump(area, length);
+    qemu_madvise(area, length, QEMU_MADV_HUGEPAGE);
+    qemu_madvise(area, length, QEMU_MADV_DONTFORK);
+    return ret;
+#else
+    return -ENOTSUP;
+#endif
 }
 
 void *qemu_get_ram_block_host_ptr(ram_addr_t addr)
 {
-    RAMBlock *block = qemu_get_ram_block(addr);
+    RAMBlock *block;
+    void *ptr;
 
-    return ramblock_ptr(block, 0);
+    rcu_read_lock();
+    block = qemu_get_ram_block(addr);
+    ptr = ramblock_ptr(block, 0);
+    rcu_read_unlock();
+    return ptr;
 }
 
 /* Return a host pointer to ram allocated with qemu_ram_alloc.
@@ -1624,10 +1932,20 @@ void *qemu_get_ram_block_host_ptr(ram_addr_t addr)
 
    It should not be used for general purpose DMA.
    Use cpu_physical_memory_map/cpu_physical_memory_rw instead.
+
+   By the time this function returns, the returned pointer is not protected
+   by RCU anymore.  If the caller is not within an RCU critical section and
+   does not hold the iothread lock, it must have other means of protecting the
+   pointer, such as a reference to the region that includes the incoming
+   ram_addr_t.
  */
 void *qemu_get_ram_ptr(ram_addr_t addr)
 {
-    RAMBlock *block = qemu_get_ram_block(addr);
+    RAMBlock *block;
+    void *ptr;
+
+    rcu_read_lock();
+    block = qemu_get_ram_block(addr);
 
     if (xen_enabled()) {
         /* We need to check if the requested address is in the RAM
@@ -1635,19 +1953,32 @@ void *qemu_get_ram_ptr(ram_addr_t addr)
          * In that case just map until the end of the page.
          */
         if (block->offset == 0) {
-            return xen_map_cache(addr, 0, 0);
+            ptr = xen_map_cache(addr, 0, 0);
+            goto done;
         } else if (block->host == NULL) {
             block->host =
                 xen_map_cache(block->offset, block->max_length, 1);
         }
     }
-    return ramblock_ptr(block, addr - block->offset);
+    ptr = ramblock_ptr(block, addr - block->offset);
+
+done:
+    rcu_read_unlock();
+    return ptr;
 }
 
 /* Return a host pointer to guest's ram. Similar to qemu_get_ram_ptr
- * but takes a size argument */
+ * but takes a size argument.
+ *
+ * By the time this function returns, the returned pointer is not protected
+ * by RCU anymore.  If the caller is not within an RCU critical section and
+ * does not hold the iothread lock, it must have other means of protecting the
+ * pointer, such as a reference to the region that includes the incoming
+ * ram_addr_t.
+ */
 static void *qemu_ram_ptr_length(ram_addr_t addr, hwaddr *size)
 {
+    void *ptr;
     if (*size == 0) {
         return NULL;
     }
@@ -1655,52 +1986,59 @@ static void *qemu_ram_ptr_length(ram_addr_t addr, hwaddr *size)
         return xen_map_cache(addr, *size, 1);
     } else {
         RAMBlock *block;
-
-        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-            if (addr - block->offset < block->max_length) {
-                if (addr - block->offset + *size > block->max_length)
-                    *size = block->max_length - addr + block->offset;
-                return ramblock_ptr(block, addr - block->offset);
-            }
+        rcu_read_lock();
+        block = qemu_get_ram_block(addr);
+        if (addr - block->offset + *size > block->max_length) {
+            *size = block->max_length - addr + block->offset;
         }
-
-        fprintf(stderr, "Bad ram offset %" PRIx64 "\n", (uint64_t)addr);
-        abort();
+        ptr = ramblock_ptr(block, addr - block->offset);
+        rcu_read_unlock();
+        return ptr;
     }
 }
 
 /* Some of the softmmu routines need to translate from a host pointer
-   (typically a TLB entry) back to a ram offset.  */
+ * (typically a TLB entry) back to a ram offset.
+ *
+ * By the time this function returns, the returned pointer is not protected
+ * by RCU anymore.  If the caller is not within an RCU critical section and
+ * does not hold the iothread lock, it must have other means of protecting the
+ * pointer, such as a reference to the region that includes the incoming
+ * ram_addr_t.
+ */
 MemoryRegion *qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr)
 {
     RAMBlock *block;
     uint8_t *host = ptr;
+    MemoryRegion *mr;
 
     if (xen_enabled()) {
+        rcu_read_lock();
         *ram_addr = xen_ram_addr_from_mapcache(ptr);
-        return qemu_get_ram_block(*ram_addr)->mr;
+        mr = qemu_get_ram_block(*ram_addr)->mr;
+        rcu_read_unlock();
+        return mr;
     }
 
-    block = ram_list.mru_block;
+    rcu_read_lock();
+    block = atomic_rcu_read(&ram_list.mru_block);
     if (block && block->host && host - block->host < block->max_length) {
         goto found;
     }
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        /* This case append when the block is not mapped. */
-        if (block->host == NULL) {
-            continue;
-        }
-        if (host - block->host < block->max_length) {
-            goto found;
-        }
+    block = ram_block_index_find_host(host);
+    if (block) {
+        goto found;
     }
 
+    rcu_read_unlock();
     return NULL;
 
 found:
     *ram_addr = block->offset + (host - block->host);
-    return block->mr;
+    mr = block->mr;
+    rcu_read_unlock();
+    return mr;
 }
 
 static void notdirty_mem_write(void *opaque, hwaddr ram_addr,
@@ -1997,6 +2335,15 @@ static void mem_begin(MemoryListener *listener)
     as->next_dispatch = d;
 }
 
+/* Called by RCU with the iothread lock held, which the unrefs in
+ * phys_sections_free need.
+ */
+static void address_space_dispatch_free(AddressSpaceDispatch *d)
+{
+    phys_sections_free(&d->map);
+    g_free(d);
+}
+
 static void mem_commit(MemoryListener *listener)
 {
     AddressSpace *as = container_of(listener, AddressSpace, dispatch_listener);
@@ -2005,11 +2352,10 @@ static void mem_commit(MemoryListener *listener)
 
     phys_page_compact_all(next, next->map.nodes_nb);
 
-    as->dispatch = next;
-
+    /* Lockless readers may still be walking the old table. */
+    atomic_rcu_set(&as->dispatch, next);
     if (cur) {
-        phys_sections_free(&cur->map);
-        g_free(cur);
+        call_rcu(cur, address_space_dispatch_free, rcu);
     }
 }
 
@@ -2068,8 +2414,10 @@ void address_space_destroy_dispatch(AddressSpace *as)
 {
     AddressSpaceDispatch *d = as->dispatch;
 
-    g_free(d);
-    as->dispatch = NULL;
+    atomic_rcu_set(&as->dispatch, NULL);
+    if (d) {
+        call_rcu(d, address_space_dispatch_free, rcu);
+    }
 }
 
 static void memory_map_init(void)
@@ -2152,6 +2500,24 @@ static void invalidate_and_set_dirty(hwaddr addr,
     xen_modified_memory(addr, length);
 }
 
+/* Called within RCU critical section.  Returns true if the caller must
+ * release the BQL once the access is done.
+ *
+ * RAM regions never clear global_locking.  Reads from RAM only need the
+ * RCU critical section and skip this function; writes still take the
+ * BQL because the dirty bitmaps are updated non-atomically and can be
+ * reallocated by ram_block_add.
+ */
+static bool prepare_mmio_access(MemoryRegion *mr)
+{
+    if ((mr->global_locking || mr->flush_coalesced_mmio) &&
+        !qemu_mutex_iothread_locked()) {
+        qemu_mutex_lock_iothread();
+        return true;
+    }
+    return false;
+}
+
 static int memory_access_size(MemoryRegion *mr, unsigned l, hwaddr addr)
 {
     unsigned access_size_max = mr->ops->valid.max_access_size;
@@ -2190,13 +2556,16 @@ bool address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
     hwaddr addr1;
     MemoryRegion *mr;
     bool error = false;
+    bool release_lock = false;
 
+    rcu_read_lock();
     while (len > 0) {
         l = len;
         mr = address_space_translate(as, addr, &addr1, &l, is_write);
 
         if (is_write) {
             if (!memory_access_is_direct(mr, is_write)) {
+                release_lock |= prepare_mmio_access(mr);
                 l = memory_access_size(mr, l, addr1);
                 /* XXX: could force current_cpu to NULL to avoid
                    potential bugs */
@@ -2225,6 +2594,7 @@ bool address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
                     abort();
                 }
             } else {
+                release_lock |= prepare_mmio_access(mr);
                 addr1 += memory_region_get_ram_addr(mr);
                 /* RAM case */
                 ptr = qemu_get_ram_ptr(addr1);
@@ -2234,6 +2604,7 @@ bool address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
         } else {
             if (!memory_access_is_direct(mr, is_write)) {
                 /* I/O case */
+                release_lock |= prepare_mmio_access(mr);
                 l = memory_access_size(mr, l, addr1);
                 switch (l) {
                 case 8:
@@ -2260,15 +2631,25 @@ bool address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
                     abort();
                 }
             } else {
-                /* RAM case */
+                /* RAM case; the Xen map cache is not thread-safe */
+                if (xen_enabled()) {
+                    release_lock |= prepare_mmio_access(mr);
+                }
                 ptr = qemu_get_ram_ptr(mr->ram_addr + addr1);
                 memcpy(buf, ptr, l);
             }
         }
+
+        if (release_lock) {
+            qemu_mutex_unlock_iothread();
+            release_lock = false;
+        }
+
         len -= l;
         buf += l;
         addr += l;
     }
+    rcu_read_unlock();
 
     return error;
 }
@@ -2304,6 +2685,7 @@ static inline void cpu_physical_memory_write_rom_internal(AddressSpace *as,
     hwaddr addr1;
     MemoryRegion *mr;
 
+    rcu_read_lock();
     while (len > 0) {
         l = len;
         mr = address_space_translate(as, addr, &addr1, &l, true);
@@ -2329,6 +2711,7 @@ static inline void cpu_physical_memory_write_rom_internal(AddressSpace *as,
         buf += l;
         addr += l;
     }
+    rcu_read_unlock();
 }
 
 /* used for ROM loading : can write in RAM and ROM */
@@ -2406,12 +2789,14 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
     MemoryRegion *mr;
     hwaddr l, xlat;
 
+    rcu_read_lock();
     while (len > 0) {
         l = len;
         mr = address_space_translate(as, addr, &xlat, &l, is_write);
         if (!memory_access_is_direct(mr, is_write)) {
             l = memory_access_size(mr, l, addr);
             if (!memory_region_access_valid(mr, xlat, l, is_write)) {
+                rcu_read_unlock();
                 return false;
             }
         }
@@ -2419,6 +2804,7 @@ bool address_space_access_valid(AddressSpace *as, hwaddr addr, int len, bool is_
         len -= l;
         addr += l;
     }
+    rcu_read_unlock();
     return true;
 }
 
@@ -2439,15 +2825,18 @@ void *address_space_map(AddressSpace *as,
     hwaddr l, xlat, base;
     MemoryRegion *mr, *this_mr;
     ram_addr_t raddr;
+    void *ptr;
 
     if (len == 0) {
         return NULL;
     }
 
     l = len;
+    rcu_read_lock();
     mr = address_space_translate(as, addr, &xlat, &l, is_write);
     if (!memory_access_is_direct(mr, is_write)) {
         if (bounce.buffer) {
+            rcu_read_unlock();
             return NULL;
         }
         /* Avoid unbounded allocations */
@@ -2458,6 +2847,7 @@ void *address_space_map(AddressSpace *as,
 
         memory_region_ref(mr);
         bounce.mr = mr;
+        rcu_read_unlock();
         if (!is_write) {
             address_space_read(as, addr, bounce.buffer, l);
         }
@@ -2486,7 +2876,10 @@ void *address_space_map(AddressSpace *as,
 
     memory_region_ref(mr);
     *plen = done;
-    return qemu_ram_ptr_length(raddr + base, plen);
+    ptr = qemu_ram_ptr_length(raddr + base, plen);
+    rcu_read_unlock();
+
+    return ptr;
 }
 
 /* Unmaps a memory region previously mapped by address_space_map().
@@ -2543,6 +2936,7 @@ static inline uint32_t ldl_phys_internal(AddressSpace *as, hwaddr addr,
     hwaddr l = 4;
     hwaddr addr1;
 
+    rcu_read_lock();
     mr = address_space_translate(as, addr, &addr1, &l, false);
     if (l < 4 || !memory_access_is_direct(mr, false)) {
         /* I/O case */
@@ -2573,6 +2967,7 @@ static inline uint32_t ldl_phys_internal(AddressSpace *as, hwaddr addr,
             break;
         }
     }
+    rcu_read_unlock();
     return val;
 }
 
@@ -2601,6 +2996,7 @@ static inline uint64_t ldq_phys_internal(AddressSpace *as, hwaddr addr,
     hwaddr l = 8;
     hwaddr addr1;
 
+    rcu_read_lock();
     mr = address_space_translate(as, addr, &addr1, &l,
                                  false);
     if (l < 8 || !memory_access_is_direct(mr, false)) {
@@ -2632,6 +3028,7 @@ static inline uint64_t ldq_phys_internal(AddressSpace *as, hwaddr addr,
             break;
         }
     }
+    rcu_read_unlock();
     return val;
 }
 
@@ -2668,6 +3065,7 @@ static inline uint32_t lduw_phys_internal(AddressSpace *as, hwaddr addr,
     hwaddr l = 2;
     hwaddr addr1;
 
+    rcu_read_lock();
     mr = address_space_translate(as, addr, &addr1, &l,
                                  false);
     if (l < 2 || !memory_access_is_direct(mr, false)) {
@@ -2699,6 +3097,7 @@ static inline uint32_t lduw_phys_internal(AddressSpace *as, hwaddr addr,
             break;
         }
     }
+    rcu_read_unlock();
     return val;
 }
 
@@ -2727,6 +3126,7 @@ void stl_phys_notdirty(AddressSpace *as, hwaddr addr, uint32_t val)
     hwaddr l = 4;
     hwaddr addr1;
 
+    rcu_read_lock();
     mr = address_space_translate(as, addr, &addr1, &l,
                                  true);
     if (l < 4 || !memory_access_is_direct(mr, true)) {
@@ -2745,6 +3145,7 @@ void stl_phys_notdirty(AddressSpace *as, hwaddr addr, uint32_t val)
             }
         }
     }
+    rcu_read_unlock();
 }
 
 /* warning: addr must be aligned */
@@ -2757,6 +3158,7 @@ static inline void stl_phys_internal(AddressSpace *as,
     hwaddr l = 4;
     hwaddr addr1;
 
+    rcu_read_lock();
     mr = address_space_translate(as, addr, &addr1, &l,
                                  true);
     if (l < 4 || !memory_access_is_direct(mr, true)) {
@@ -2787,6 +3189,7 @@ static inline void stl_phys_internal(AddressSpace *as,
         }
         invalidate_and_set_dirty(addr1, 4);
     }
+    rcu_read_unlock();
 }
 
 void stl_phys(AddressSpace *as, hwaddr addr, uint32_t val)
@@ -2821,6 +3224,7 @@ static inline void stw_phys_internal(AddressSpace *as,
     hwaddr l = 2;
     hwaddr addr1;
 
+    rcu_read_lock();
     mr = address_space_translate(as, addr, &addr1, &l, true);
     if (l < 2 || !memory_access_is_direct(mr, true)) {
 #if defined(TARGET_WORDS_BIGENDIAN)
@@ -2850,6 +3254,7 @@ static inline void stw_phys_internal(AddressSpace *as,
         }
         invalidate_and_set_dirty(addr1, 2);
     }
+    rcu_read_unlock();
 }
 
 void stw_phys(AddressSpace *as, hwaddr addr, uint32_t val)
@@ -2936,20 +3341,25 @@ bool cpu_physical_memory_is_io(hwaddr phys_addr)
 {
     MemoryRegion*mr;
     hwaddr l = 1;
+    bool res;
 
+    rcu_read_lock();
     mr = address_space_translate(&address_space_memory,
                                  phys_addr, &phys_addr, &l, false);
 
-    return !(memory_region_is_ram(mr) ||
-             memory_region_is_romd(mr));
+    res = !(memory_region_is_ram(mr) || memory_region_is_romd(mr));
+    rcu_read_unlock();
+    return res;
 }
 
 void qemu_ram_foreach_block(RAMBlockIterFunc func, void *opaque)
 {
     RAMBlock *block;
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+    rcu_read_lock();
+    QLIST_FOREACH_RCU(block, &ram_list.blocks, next) {
         func(block->host, block->offset, block->used_length, opaque);
     }
+    rcu_read_unlock();
 }
 #endif
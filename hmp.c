@@ -172,6 +172,10 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
             monitor_printf(mon, "setup: %" PRIu64 " milliseconds\n",
                            info->setup_time);
         }
+        if (info->has_cpu_throttle_percentage) {
+            monitor_printf(mon, "cpu throttle percentage: %" PRIu64 "\n",
+                           info->cpu_throttle_percentage);
+        }
     }
 
     if (info->has_ram) {
@@ -223,6 +227,25 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->overflow);
     }
 
+    if (info->has_section_stats) {
+        MigrationSectionStatsList *sec;
+
+        monitor_printf(mon, "section stats (bytes/microseconds): "
+                       "iterate complete load-iterate load-complete\n");
+        for (sec = info->section_stats; sec; sec = sec->next) {
+            MigrationSectionStats *st = sec->value;
+
+            monitor_printf(mon, "  %s.%" PRId64 ": %" PRId64 "/%" PRId64
+                           " %" PRId64 "/%" PRId64 " %" PRId64 "/%" PRId64
+                           " %" PRId64 "/%" PRId64 "\n",
+                           st->name, st->instance_id,
+                           st->iterate_bytes, st->iterate_time,
+                           st->complete_bytes, st->complete_time,
+                           st->load_iterate_bytes, st->load_iterate_time,
+                           st->load_complete_bytes, st->load_complete_time);
+        }
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -246,6 +269,29 @@ void hmp_info_migrate_capabilities(Monitor *mon, const QDict *qdict)
     qapi_free_MigrationCapabilityStatusList(caps);
 }
 
+void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
+{
+    MigrationParameters *params;
+
+    params = qmp_query_migrate_parameters(NULL);
+
+    if (params) {
+        monitor_printf(mon, "parameters:");
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_CPU_THROTTLE_INITIAL],
+            params->cpu_throttle_initial);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_CPU_THROTTLE_INCREMENT],
+            params->cpu_throttle_increment);
+        monitor_printf(mon, " %s: %" PRId64,
+            MigrationParameter_lookup[MIGRATION_PARAMETER_CPU_THROTTLE_MAX],
+            params->cpu_throttle_max);
+        monitor_printf(mon, "\n");
+    }
+
+    qapi_free_MigrationParameters(params);
+}
+
 void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
 {
     monitor_printf(mon, "xbzrel cache size: %" PRId64 " kbytes\n",
@@ -1140,6 +1186,48 @@ void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
+{
+    const char *param = qdict_get_str(qdict, "parameter");
+    int value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+    bool has_cpu_throttle_initial = false;
+    bool has_cpu_throttle_increment = false;
+    bool has_cpu_throttle_max = false;
+    int i;
+
+    for (i = 0; i < MIGRATION_PARAMETER_MAX; i++) {
+        if (strcmp(param, MigrationParameter_lookup[i]) == 0) {
+            switch (i) {
+            case MIGRATION_PARAMETER_CPU_THROTTLE_INITIAL:
+                has_cpu_throttle_initial = true;
+                break;
+            case MIGRATION_PARAMETER_CPU_THROTTLE_INCREMENT:
+                has_cpu_throttle_increment = true;
+                break;
+            case MIGRATION_PARAMETER_CPU_THROTTLE_MAX:
+                has_cpu_throttle_max = true;
+                break;
+            }
+            qmp_migrate_set_parameters(has_cpu_throttle_initial, value,
+                                       has_cpu_throttle_increment, value,
+                                       has_cpu_throttle_max, value,
+                                       &err);
+            break;
+        }
+    }
+
+    if (i == MIGRATION_PARAMETER_MAX) {
+        error_set(&err, QERR_INVALID_PARAMETER, param);
+    }
+
+    if (err) {
+        monitor_printf(mon, "migrate_set_parameter: %s\n",
+                       error_get_pretty(err));
+        error_free(err);
+    }
+}
+
 void hmp_set_password(Monitor *mon, const QDict *qdict)
 {
     const char *protocol  = qdict_get_str(qdict, "protocol");
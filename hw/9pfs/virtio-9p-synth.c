@@ -18,6 +18,7 @@
 #include "fsdev/qemu-fsdev.h"
 #include "virtio-9p-synth.h"
 #include "qemu/rcu.h"
+#include "qemu/rcu_queue.h"
 
 #include <sys/stat.h>
 
@@ -28,10 +28,30 @@
 #include "hw/virtio/virtio-bus.h"
 #include "hw/virtio/virtio-access.h"
 
-VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s)
+/* Fields after wce only exist when the feature that needs them is offered,
+ * so that single-queue devices keep the config size they always had.
+ */
+static VirtIOFeature feature_sizes[] = {
+    {.flags = 1 << VIRTIO_BLK_F_CONFIG_WCE,
+     .end = endof(struct virtio_blk_config, wce)},
+    {.flags = 1 << VIRTIO_BLK_F_MQ,
+     .end = endof(struct virtio_blk_config, num_queues)},
+    {}
+};
+
+static void virtio_blk_set_config_size(VirtIOBlock *s, uint32_t host_features)
+{
+    /* wce has always been present, whether or not it is writable */
+    host_features |= 1 << VIRTIO_BLK_F_CONFIG_WCE;
+    s->config_size = virtio_feature_get_config_size(feature_sizes,
+                                                    host_features);
+}
+
+VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s, VirtQueue *vq)
 {
     VirtIOBlockReq *req = g_slice_new(VirtIOBlockReq);
     req->dev = s;
+    req->vq = vq;
     req->qiov.size = 0;
     req->next = NULL;
     req->mr_next = NULL;
@@ -45,17 +65,93 @@ void virtio_blk_free_request(VirtIOBlockReq *req)
     }
 }
 
+static void virtio_blk_batch_notify(VirtIOBlock *s)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    unsigned i;
+
+    trace_virtio_blk_batch_notify(s, s->coalesced);
+
+    for (i = 0; i < s->conf.num_queues; i++) {
+        if (test_and_clear_bit(i, s->batch_notify)) {
+            virtio_notify(vdev, virtio_get_queue(vdev, i));
+        }
+    }
+    s->coalesced = 0;
+}
+
+static void virtio_blk_coalesce_timer_cb(void *opaque)
+{
+    virtio_blk_batch_notify(opaque);
+}
+
+/* Publish all completions filled in since the last run, then interrupt the
+ * guest either right away or, if a coalescing window is configured, once it
+ * expires or enough completions have accumulated.  virtio_notify() still
+ * applies EVENT_IDX suppression to each queue.
+ */
+static void virtio_blk_batch_flush(VirtIOBlock *s)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    unsigned i;
+
+    for (i = 0; i < s->conf.num_queues; i++) {
+        if (s->batch_pending[i]) {
+            virtqueue_flush(virtio_get_queue(vdev, i), s->batch_pending[i]);
+            s->coalesced += s->batch_pending[i];
+            s->batch_pending[i] = 0;
+            set_bit(i, s->batch_notify);
+        }
+    }
+
+    if (!s->coalesced) {
+        return;
+    }
+
+    if (!s->conf.coalesce_usecs ||
+        (s->conf.coalesce_max_completions &&
+         s->coalesced >= s->conf.coalesce_max_completions)) {
+        timer_del(s->coalesce_timer);
+        virtio_blk_batch_notify(s);
+    } else if (!timer_pending(s->coalesce_timer)) {
+        timer_mod(s->coalesce_timer,
+                  qemu_clock_get_us(QEMU_CLOCK_REALTIME) +
+                  s->conf.coalesce_usecs);
+    }
+}
+
+/* Flush and notify everything batched so far, ignoring the window */
+static void virtio_blk_batch_drain(VirtIOBlock *s)
+{
+    qemu_bh_cancel(s->batch_bh);
+    virtio_blk_batch_flush(s);
+    if (s->coalesced) {
+        timer_del(s->coalesce_timer);
+        virtio_blk_batch_notify(s);
+    }
+}
+
+static void virtio_blk_batch_bh(void *opaque)
+{
+    virtio_blk_batch_flush(opaque);
+}
+
+/* Completions that arrive during one pass of the event loop are only
+ * written to the used ring here; the used index is published and the
+ * guest notified once per pass from batch_bh.
+ */
 static void virtio_blk_complete_request(VirtIOBlockReq *req,
                                         unsigned char status)
 {
     VirtIOBlock *s = req->dev;
-    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+    uint16_t idx = virtio_get_queue_index(req->vq);
 
     trace_virtio_blk_req_complete(req, status);
 
     stb_p(&req->in->status, status);
-    virtqueue_push(s->vq, &req->elem, req->qiov.size + sizeof(*req->in));
-    virtio_notify(vdev, s->vq);
+    virtqueue_fill(req->vq, &req->elem, req->qiov.size + sizeof(*req->in),
+                   s->batch_pending[idx]++);
+    qemu_bh_schedule(s->batch_bh);
 }
 
 static void virtio_blk_req_complete(VirtIOBlockReq *req, unsigned char status)
@@ -178,11 +274,11 @@ out:
 
 #endif
 
-static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s)
+static VirtIOBlockReq *virtio_blk_get_request(VirtIOBlock *s, VirtQueue *vq)
 {
-    VirtIOBlockReq *req = virtio_blk_alloc_request(s);
+    VirtIOBlockReq *req = virtio_blk_alloc_request(s, vq);
 
-    if (!virtqueue_pop(s->vq, &req->elem)) {
+    if (!virtqueue_pop(vq, &req->elem)) {
         virtio_blk_free_request(req);
         return NULL;
     }
@@ -580,11 +676,13 @@ static void virtio_blk_handle_output(VirtIODevice *vdev, VirtQueue *vq)
      * dataplane here instead of waiting for .set_status().
      */
     if (s->dataplane) {
+        /* dataplane takes over the used ring from here on */
+        virtio_blk_batch_drain(s);
         virtio_blk_data_plane_start(s->dataplane);
         return;
     }
 
-    while ((req = virtio_blk_get_request(s))) {
+    while ((req = virtio_blk_get_request(s, vq))) {
         virtio_blk_handle_request(req, &mrb);
     }
 
@@ -651,6 +749,13 @@ static void virtio_blk_reset(VirtIODevice *vdev)
      */
     blk_drain_all();
     blk_set_enable_write_cache(s->blk, s->original_wce);
+
+    /* The virtqueues are about to be reset, drop batched completions */
+    qemu_bh_cancel(s->batch_bh);
+    timer_del(s->coalesce_timer);
+    memset(s->batch_pending, 0, s->conf.num_queues * sizeof(uint16_t));
+    bitmap_zero(s->batch_notify, s->conf.num_queues);
+    s->coalesced = 0;
 }
 
 /* coalesce internal state, copy to pci i/o region 0
@@ -692,7 +797,8 @@ static void virtio_blk_update_config(VirtIODevice *vdev, uint8_t *config)
     blkcfg.physical_block_exp = get_physical_block_exp(conf);
     blkcfg.alignment_offset = 0;
     blkcfg.wce = blk_enable_write_cache(s->blk);
-    memcpy(config, &blkcfg, sizeof(struct virtio_blk_config));
+    virtio_stw_p(vdev, &blkcfg.num_queues, s->conf.num_queues);
+    memcpy(config, &blkcfg, s->config_size);
 }
 
 static void virtio_blk_set_config(VirtIODevice *vdev, const uint8_t *config)
@@ -700,7 +806,7 @@ static void virtio_blk_set_config(VirtIODevice *vdev, const uint8_t *config)
     VirtIOBlock *s = VIRTIO_BLK(vdev);
     struct virtio_blk_config blkcfg;
 
-    memcpy(&blkcfg, config, sizeof(blkcfg));
+    memcpy(&blkcfg, config, s->config_size);
 
     aio_context_acquire(blk_get_aio_context(s->blk));
     blk_set_enable_write_cache(s->blk, blkcfg.wce != 0);
@@ -726,6 +832,9 @@ static uint32_t virtio_blk_get_features(VirtIODevice *vdev, uint32_t features)
     if (blk_is_read_only(s->blk)) {
         features |= 1 << VIRTIO_BLK_F_RO;
     }
+    if (s->conf.num_queues > 1) {
+        features |= 1 << VIRTIO_BLK_F_MQ;
+    }
 
     return features;
 }
@@ -771,7 +880,11 @@ static void virtio_blk_set_status(VirtIODevice *vdev, uint8_t status)
 
 static void virtio_blk_save(QEMUFile *f, void *opaque)
 {
-    VirtIODevice *vdev = VIRTIO_DEVICE(opaque);
+    VirtIOBlock *s = opaque;
+    VirtIODevice *vdev = VIRTIO_DEVICE(s);
+
+    /* Make batched completions visible in the used ring before it is sent */
+    virtio_blk_batch_drain(s);
 
     virtio_save(vdev, f);
 }
@@ -783,6 +896,9 @@ static void virtio_blk_save_device(VirtIODevice *vdev, QEMUFile *f)
 
     while (req) {
         qemu_put_sbyte(f, 1);
+        if (s->conf.num_queues > 1) {
+            qemu_put_be32(f, virtio_get_queue_index(req->vq));
+        }
         qemu_put_buffer(f, (unsigned char *)&req->elem,
                         sizeof(VirtQueueElement));
         req = req->next;
@@ -807,7 +923,19 @@ static int virtio_blk_load_device(VirtIODevice *vdev, QEMUFile *f,
     VirtIOBlock *s = VIRTIO_BLK(vdev);
 
     while (qemu_get_sbyte(f)) {
-        VirtIOBlockReq *req = virtio_blk_alloc_request(s);
+        unsigned nvq = 0;
+        VirtIOBlockReq *req;
+
+        if (s->conf.num_queues > 1) {
+            nvq = qemu_get_be32(f);
+            if (nvq >= s->conf.num_queues) {
+                error_report("Invalid virtqueue index in request list: %#x",
+                             nvq);
+                return -EINVAL;
+            }
+        }
+
+        req = virtio_blk_alloc_request(s, virtio_get_queue(vdev, nvq));
         qemu_get_buffer(f, (unsigned char *)&req->elem,
                         sizeof(VirtQueueElement));
         req->next = s->rq;
@@ -864,6 +992,15 @@ static void virtio_blk_migration_state_changed(Notifier *notifier, void *data)
     }
 }
 
+static void virtio_blk_batch_cleanup(VirtIOBlock *s)
+{
+    qemu_bh_delete(s->batch_bh);
+    timer_del(s->coalesce_timer);
+    timer_free(s->coalesce_timer);
+    g_free(s->batch_pending);
+    g_free(s->batch_notify);
+}
+
 static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
@@ -871,6 +1008,7 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
     VirtIOBlkConf *conf = &s->conf;
     Error *err = NULL;
     static int virtio_blk_id;
+    unsigned i;
 
     if (!conf->conf.blk) {
         error_setg(errp, "drive property not set");
@@ -880,6 +1018,25 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         error_setg(errp, "Device needs media, but drive is empty");
         return;
     }
+    if (!conf->num_queues || conf->num_queues > VIRTIO_PCI_QUEUE_MAX) {
+        error_setg(errp, "num-queues property must be between 1 and %d",
+                   VIRTIO_PCI_QUEUE_MAX);
+        return;
+    }
+    /* The dataplane completes requests on its own and would ignore them */
+    if ((conf->data_plane || conf->iothread) &&
+        (conf->coalesce_usecs || conf->coalesce_max_completions)) {
+        error_setg(errp, "coalesce-max-usecs and coalesce-max-completions "
+                   "are not supported with x-data-plane or iothread");
+        return;
+    }
+    /* The dataplane vring only knows the split layout */
+    if ((conf->data_plane || conf->iothread) &&
+        (vdev->host_features_hi & (1 << (VIRTIO_F_RING_PACKED - 32)))) {
+        error_setg(errp, "packed is not supported with x-data-plane "
+                   "or iothread");
+        return;
+    }
 
     blkconf_serial(&conf->conf, &conf->serial);
     s->original_wce = blk_enable_write_cache(conf->conf.blk);
@@ -889,18 +1046,27 @@ static void virtio_blk_device_realize(DeviceState *dev, Error **errp)
         return;
     }
 
-    virtio_init(vdev, "virtio-blk", VIRTIO_ID_BLOCK,
-                sizeof(struct virtio_blk_config));
+    virtio_blk_set_config_size(s, conf->num_queues > 1 ?
+                                  1 << VIRTIO_BLK_F_MQ : 0);
+    virtio_init(vdev, "virtio-blk", VIRTIO_ID_BLOCK, s->config_size);
 
     s->blk = conf->conf.blk;
     s->rq = NULL;
     s->sector_mask = (s->conf.conf.logical_block_size / BDRV_SECTOR_SIZE) - 1;
 
-    s->vq = virtio_add_queue(vdev, 128, virtio_blk_handle_output);
+    for (i = 0; i < conf->num_queues; i++) {
+        virtio_add_queue(vdev, 128, virtio_blk_handle_output);
+    }
     s->complete_request = virtio_blk_complete_request;
+    s->batch_bh = qemu_bh_new(virtio_blk_batch_bh, s);
+    s->coalesce_timer = timer_new_us(QEMU_CLOCK_REALTIME,
+                                     virtio_blk_coalesce_timer_cb, s);
+    s->batch_pending = g_new0(uint16_t, conf->num_queues);
+    s->batch_notify = bitmap_new(conf->num_queues);
     virtio_blk_data_plane_create(vdev, conf, &s->dataplane, &err);
     if (err != NULL) {
         error_propagate(errp, err);
+        virtio_blk_batch_cleanup(s);
         virtio_cleanup(vdev);
         return;
     }
@@ -927,6 +1093,7 @@ static void virtio_blk_device_unrealize(DeviceState *dev, Error **errp)
     qemu_del_vm_change_state_handler(s->change);
     unregister_savevm(dev, "virtio-blk", s);
     blockdev_mark_auto_del(s->blk);
+    virtio_blk_batch_cleanup(s);
     virtio_cleanup(vdev);
 }
 
@@ -954,6 +1121,12 @@ static Property virtio_blk_properties[] = {
     DEFINE_PROP_BIT("request-merging", VirtIOBlock, conf.request_merging, 0,
                     true),
     DEFINE_PROP_BIT("x-data-plane", VirtIOBlock, conf.data_plane, 0, false),
+    DEFINE_PROP_UINT16("num-queues", VirtIOBlock, conf.num_queues, 1),
+    DEFINE_PROP_UINT32("coalesce-max-usecs", VirtIOBlock,
+                       conf.coalesce_usecs, 0),
+    DEFINE_PROP_UINT32("coalesce-max-completions", VirtIOBlock,
+                       conf.coalesce_max_completions, 0),
+    DEFINE_VIRTIO_RING_PACKED_FEATURE(VirtIOBlock, parent_obj),
     DEFINE_PROP_END_OF_LIST(),
 };
 
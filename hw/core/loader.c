@@ -51,6 +51,7 @@
 #include "hw/nvram/fw_cfg.h"
 #include "exec/memory.h"
 #include "exec/address-spaces.h"
+#include "migration/migration.h"
 
 #include <zlib.h>
 
@@ -898,6 +899,44 @@ int rom_add_option(const char *file, int32_t bootindex)
     return rom_add_file(file, "genroms", 0, bootindex, true);
 }
 
+static bool rom_in_shared_ram(Rom *rom)
+{
+    MemoryRegionSection section;
+    bool shared;
+
+    if (rom->mr) {
+        return memory_region_is_shared(rom->mr);
+    }
+    section = memory_region_find(get_system_memory(), rom->addr, 1);
+    shared = int128_nz(section.size) && memory_region_is_ram(section.mr) &&
+             memory_region_is_shared(section.mr);
+    memory_region_unref(section.mr);
+    return shared;
+}
+
+static void rom_write(Rom *rom)
+{
+    if (rom->mr) {
+        void *host = memory_region_get_ram_ptr(rom->mr);
+        memcpy(host, rom->data, rom->datasize);
+    } else {
+        cpu_physical_memory_write_rom(&address_space_memory,
+                                      rom->addr, rom->data, rom->datasize);
+    }
+    if (rom->isrom) {
+        /* rom needs to be written only once */
+        g_free(rom->data);
+        rom->data = NULL;
+    }
+    /*
+     * The rom loader is really on the same level as firmware in the guest
+     * shadowing a ROM into RAM. Such a shadowing mechanism needs to ensure
+     * that the instruction cache for that new region is clear, so that the
+     * CPU definitely fetches its instructions from the just written data.
+     */
+    cpu_flush_icache_range(rom->addr, rom->datasize);
+}
+
 static void rom_reset(void *unused)
 {
     Rom *rom;
@@ -909,25 +948,36 @@ static void rom_reset(void *unused)
         if (rom->data == NULL) {
             continue;
         }
-        if (rom->mr) {
-            void *host = memory_region_get_ram_ptr(rom->mr);
-            memcpy(host, rom->data, rom->datasize);
-        } else {
-            cpu_physical_memory_write_rom(&address_space_memory,
-                                          rom->addr, rom->data, rom->datasize);
-        }
-        if (rom->isrom) {
-            /* rom needs to be written only once */
-            g_free(rom->data);
-            rom->data = NULL;
-        }
         /*
-         * The rom loader is really on the same level as firmware in the guest
-         * shadowing a ROM into RAM. Such a shadowing mechanism needs to ensure
-         * that the instruction cache for that new region is clear, so that the
-         * CPU definitely fetches its instructions from the just written data.
+         * With x-ignore-shared, the shared RAM of an incoming QEMU is
+         * already in use by the source.  The capability is only known once
+         * the migration starts, so hold such ROMs back until then.
          */
-        cpu_flush_icache_range(rom->addr, rom->datasize);
+        if (runstate_check(RUN_STATE_INMIGRATE) && rom_in_shared_ram(rom)) {
+            continue;
+        }
+        rom_write(rom);
+    }
+}
+
+/*
+ * Called when an incoming migration starts: write the ROMs that rom_reset
+ * held back, unless their RAM is left to the source by x-ignore-shared.
+ */
+void rom_reset_incoming(void)
+{
+    Rom *rom;
+
+    if (migrate_ignore_shared()) {
+        return;
+    }
+    QTAILQ_FOREACH(rom, &roms, next) {
+        if (rom->fw_file || rom->data == NULL) {
+            continue;
+        }
+        if (rom_in_shared_ram(rom)) {
+            rom_write(rom);
+        }
     }
 }
 
@@ -0,0 +1,632 @@
+/*
+ * Dedicated threads for virtio-net I/O processing
+ *
+ * Each queue pair is serviced by an IOThread that moves packets between the
+ * vrings and the tap file descriptor of that queue, without taking the QEMU
+ * global mutex.  This plays the role of vhost-net on hosts where the kernel
+ * module is not available.  Like vhost-net, it bypasses the receive filter
+ * and any other net clients between the NIC and the tap device.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "qemu/iov.h"
+#include "qemu/error-report.h"
+#include "hw/virtio/dataplane/vring.h"
+#include "hw/virtio/virtio-net.h"
+#include "hw/virtio/virtio-bus.h"
+#include "hw/virtio/virtio-access.h"
+#include "net/net.h"
+#include "net/tap.h"
+#include "net/vhost_net.h"
+#include "block/aio.h"
+#include "qom/object_interfaces.h"
+#include "virtio-net.h"
+
+typedef struct VirtIONetDataPlaneQueue {
+    VirtIONetDataPlane *s;
+    unsigned int index;             /* queue pair */
+
+    IOThread *iothread;
+    IOThread internal_iothread_obj;
+    AioContext *ctx;
+
+    NetClientState *peer;
+    int tap_fd;
+
+    VirtQueue *rx_vq;
+    VirtQueue *tx_vq;
+    Vring rx_vring;
+    Vring tx_vring;
+    EventNotifier *rx_guest_notifier;   /* irq */
+    EventNotifier *tx_guest_notifier;   /* irq */
+
+    /* Note that these EventNotifiers are assigned by value.  This is
+     * fine as long as you do not call event_notifier_cleanup on them
+     * (because you don't own the file descriptor or handle; you just
+     * use it).
+     */
+    EventNotifier rx_host_notifier;     /* doorbell */
+    EventNotifier tx_host_notifier;     /* doorbell */
+
+    /* A packet read from the tap device is copied into as many rx buffers
+     * as it needs.  The buffers are only published once the whole packet
+     * is in, so it can wait here for the guest to post more buffers.
+     */
+    uint8_t *rx_buf;
+    size_t rx_len;
+    size_t rx_offset;
+    unsigned int rx_nbufs;
+    VirtQueueElement rx_head;           /* first buffer, mapped until done */
+    size_t rx_head_len;
+    struct iovec rx_mhdr_sg[2];         /* num_buffers of the first buffer */
+    unsigned int rx_mhdr_cnt;
+    bool rx_waiting;                    /* out of rx buffers */
+
+    QEMUBH *tx_bh;                      /* continue after a full tx burst */
+    VirtQueueElement tx_elem;
+    bool tx_blocked;                    /* tx_elem waits for the tap fd */
+} VirtIONetDataPlaneQueue;
+
+struct VirtIONetDataPlane {
+    bool started;
+
+    VirtIODevice *vdev;
+    virtio_net_conf *conf;
+
+    unsigned int max_queues;
+    unsigned int num_queues;            /* queue pairs currently started */
+    VirtIONetDataPlaneQueue *queues;
+};
+
+/* Raise an interrupt to signal guest, if necessary */
+static void notify_guest(VirtIONetDataPlane *s, Vring *vring,
+                         EventNotifier *notifier)
+{
+    if (!vring_should_notify(s->vdev, vring)) {
+        return;
+    }
+
+    event_notifier_set(notifier);
+}
+
+static void handle_tap_read(void *opaque);
+static void handle_tap_write(void *opaque);
+
+static void update_tap_handler(VirtIONetDataPlaneQueue *q)
+{
+    aio_set_fd_handler(q->ctx, q->tap_fd,
+                       q->rx_waiting ? NULL : handle_tap_read,
+                       q->tx_blocked ? handle_tap_write : NULL,
+                       q);
+}
+
+/* Publish the rx buffers holding the current packet */
+static void rx_complete_packet(VirtIONetDataPlaneQueue *q)
+{
+    if (q->rx_nbufs) {
+        if (q->rx_mhdr_cnt) {
+            uint16_t num_buffers;
+
+            virtio_stw_p(q->s->vdev, &num_buffers, q->rx_nbufs);
+            iov_from_buf(q->rx_mhdr_sg, q->rx_mhdr_cnt, 0,
+                         &num_buffers, sizeof(num_buffers));
+        }
+        vring_fill(&q->rx_vring, &q->rx_head, q->rx_head_len, 0);
+        vring_flush(&q->rx_vring, q->rx_nbufs);
+    }
+
+    q->rx_len = q->rx_offset = 0;
+    q->rx_nbufs = q->rx_mhdr_cnt = 0;
+}
+
+/* Copy the pending packet into rx buffers.  Returns false if the guest ran
+ * out of buffers before the packet was complete.
+ */
+static bool rx_copy_packet(VirtIONetDataPlaneQueue *q)
+{
+    VirtIONet *n = VIRTIO_NET(q->s->vdev);
+    VirtQueueElement next, *elem;
+    size_t len;
+    int ret;
+
+    while (q->rx_offset < q->rx_len) {
+        /* The first buffer stays mapped until num_buffers is written */
+        elem = q->rx_nbufs ? &next : &q->rx_head;
+        ret = vring_pop(q->s->vdev, &q->rx_vring, elem);
+        if (ret == -EAGAIN) {
+            return false;
+        } else if (ret < 0) {
+            /* Fatal error, the vring stays broken until reset */
+            break;
+        }
+
+        if (elem->in_num < 1) {
+            error_report("virtio-net receive queue contains no in buffers");
+            vring_set_broken(&q->rx_vring);
+            vring_push(&q->rx_vring, elem, 0);
+            break;
+        }
+
+        if (q->rx_nbufs == 0 && n->mergeable_rx_bufs) {
+            q->rx_mhdr_cnt = iov_copy(q->rx_mhdr_sg,
+                                      ARRAY_SIZE(q->rx_mhdr_sg),
+                                      elem->in_sg, elem->in_num,
+                                      offsetof(struct virtio_net_hdr_mrg_rxbuf,
+                                               num_buffers),
+                                      sizeof(uint16_t));
+        }
+
+        len = iov_from_buf(elem->in_sg, elem->in_num, 0,
+                           q->rx_buf + q->rx_offset,
+                           q->rx_len - q->rx_offset);
+        q->rx_offset += len;
+
+        /* Without mergeable buffers the packet must fit in one buffer,
+         * anything beyond is dropped.
+         */
+        if (!n->mergeable_rx_bufs) {
+            q->rx_offset = q->rx_len;
+        }
+
+        if (q->rx_nbufs == 0) {
+            q->rx_head_len = len;
+        } else {
+            vring_fill(&q->rx_vring, elem, len, q->rx_nbufs);
+        }
+        q->rx_nbufs++;
+    }
+
+    rx_complete_packet(q);
+    return true;
+}
+
+static void handle_rx(VirtIONetDataPlaneQueue *q)
+{
+    VirtIONetDataPlane *s = q->s;
+    VirtIONet *n = VIRTIO_NET(s->vdev);
+    int packets = 0;
+
+    /* Bound the time spent here so that tx on the same IOThread gets a
+     * turn.  The tap fd stays readable and brings us back.
+     */
+    while (packets < MAX(n->rx_burst, 1)) {
+        if (!q->rx_len) {
+            ssize_t len;
+
+            do {
+                len = read(q->tap_fd, q->rx_buf, NET_BUFSIZE);
+            } while (len == -1 && errno == EINTR);
+
+            if (len <= 0) {
+                break;
+            }
+            q->rx_len = len;
+        }
+
+        if (!rx_copy_packet(q)) {
+            /* Stop reading from the tap device until the guest refills
+             * the ring.  If it has snuck in more buffers, keep going.
+             */
+            if (vring_enable_notification(s->vdev, &q->rx_vring)) {
+                q->rx_waiting = true;
+                update_tap_handler(q);
+                break;
+            }
+            vring_disable_notification(s->vdev, &q->rx_vring);
+            continue;
+        }
+        packets++;
+    }
+
+    notify_guest(s, &q->rx_vring, q->rx_guest_notifier);
+}
+
+static void handle_tap_read(void *opaque)
+{
+    handle_rx(opaque);
+}
+
+static void handle_rx_notify(EventNotifier *e)
+{
+    VirtIONetDataPlaneQueue *q = container_of(e, VirtIONetDataPlaneQueue,
+                                              rx_host_notifier);
+
+    event_notifier_test_and_clear(&q->rx_host_notifier);
+    if (!q->rx_waiting) {
+        return;
+    }
+
+    vring_disable_notification(q->s->vdev, &q->rx_vring);
+    q->rx_waiting = false;
+    update_tap_handler(q);
+    handle_rx(q);
+}
+
+/* Hand tx_elem to the tap device.  Returns false if the tap device cannot
+ * take it right now.
+ */
+static bool tx_send_elem(VirtIONetDataPlaneQueue *q)
+{
+    VirtQueueElement *elem = &q->tx_elem;
+    ssize_t ret;
+
+    if (elem->out_num < 1) {
+        error_report("virtio-net header not in first element");
+        vring_set_broken(&q->tx_vring);
+        vring_push(&q->tx_vring, elem, 0);
+        return true;
+    }
+
+    /* The guest and tap vnet header layouts match, see
+     * virtio_net_data_plane_start(), so the buffers go out as they are.
+     */
+    do {
+        ret = writev(q->tap_fd, elem->out_sg, elem->out_num);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1 && errno == EAGAIN) {
+        return false;
+    }
+
+    vring_push(&q->tx_vring, elem, 0);
+    return true;
+}
+
+static void handle_tx(VirtIONetDataPlaneQueue *q)
+{
+    VirtIONetDataPlane *s = q->s;
+    VirtIONet *n = VIRTIO_NET(s->vdev);
+    int packets = 0;
+    int ret;
+
+    if (q->tx_blocked) {
+        return;
+    }
+
+    for (;;) {
+        /* Disable guest->host notifies to avoid unnecessary vmexits */
+        vring_disable_notification(s->vdev, &q->tx_vring);
+
+        while ((ret = vring_pop(s->vdev, &q->tx_vring, &q->tx_elem)) >= 0) {
+            if (!tx_send_elem(q)) {
+                q->tx_blocked = true;
+                update_tap_handler(q);
+                goto out;
+            }
+
+            if (++packets >= n->tx_burst) {
+                qemu_bh_schedule(q->tx_bh);
+                goto out;
+            }
+        }
+
+        if (likely(ret == -EAGAIN)) { /* vring emptied */
+            /* Re-enable guest->host notifies and stop processing the vring.
+             * But if the guest has snuck in more descriptors, keep processing.
+             */
+            if (vring_enable_notification(s->vdev, &q->tx_vring)) {
+                break;
+            }
+        } else { /* fatal error */
+            break;
+        }
+    }
+
+out:
+    notify_guest(s, &q->tx_vring, q->tx_guest_notifier);
+}
+
+static void handle_tap_write(void *opaque)
+{
+    VirtIONetDataPlaneQueue *q = opaque;
+
+    if (!tx_send_elem(q)) {
+        return;
+    }
+
+    q->tx_blocked = false;
+    update_tap_handler(q);
+    handle_tx(q);
+}
+
+static void handle_tx_notify(EventNotifier *e)
+{
+    VirtIONetDataPlaneQueue *q = container_of(e, VirtIONetDataPlaneQueue,
+                                              tx_host_notifier);
+
+    event_notifier_test_and_clear(&q->tx_host_notifier);
+    handle_tx(q);
+}
+
+static void handle_tx_bh(void *opaque)
+{
+    handle_tx(opaque);
+}
+
+/* Context: QEMU global mutex held */
+void virtio_net_data_plane_create(VirtIODevice *vdev, virtio_net_conf *conf,
+                                  VirtIONetDataPlane **dataplane,
+                                  Error **errp)
+{
+    VirtIONet *n = VIRTIO_NET(vdev);
+    VirtIONetDataPlane *s;
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    unsigned int i;
+
+    *dataplane = NULL;
+
+    if (!conf->data_plane && !conf->iothread) {
+        return;
+    }
+
+    /* Don't try if transport does not support notifiers. */
+    if (!k->set_guest_notifiers || !k->set_host_notifier) {
+        error_setg(errp,
+                   "device is incompatible with x-data-plane "
+                   "(transport does not support notifiers)");
+        return;
+    }
+
+    for (i = 0; i < n->max_queues; i++) {
+        NetClientState *peer = qemu_get_subqueue(n->nic, i)->peer;
+
+        if (!peer || peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
+            error_setg(errp, "x-data-plane requires a tap netdev");
+            return;
+        }
+        if (get_vhost_net(peer)) {
+            error_setg(errp, "x-data-plane cannot be used with vhost=on");
+            return;
+        }
+    }
+
+    s = g_new0(VirtIONetDataPlane, 1);
+    s->vdev = vdev;
+    s->conf = conf;
+    s->max_queues = n->max_queues;
+    s->queues = g_new0(VirtIONetDataPlaneQueue, s->max_queues);
+
+    for (i = 0; i < s->max_queues; i++) {
+        VirtIONetDataPlaneQueue *q = &s->queues[i];
+
+        q->s = s;
+        q->index = i;
+        q->tap_fd = -1;
+
+        if (conf->iothread) {
+            q->iothread = conf->iothread;
+            object_ref(OBJECT(q->iothread));
+        } else {
+            /* One IOThread per queue pair so that throughput scales with
+             * the number of queues.
+             */
+            object_initialize(&q->internal_iothread_obj,
+                              sizeof(q->internal_iothread_obj),
+                              TYPE_IOTHREAD);
+            user_creatable_complete(OBJECT(&q->internal_iothread_obj),
+                                    &error_abort);
+            q->iothread = &q->internal_iothread_obj;
+        }
+        q->ctx = iothread_get_aio_context(q->iothread);
+        q->tx_bh = aio_bh_new(q->ctx, handle_tx_bh, q);
+        q->rx_buf = g_malloc(NET_BUFSIZE);
+    }
+
+    *dataplane = s;
+}
+
+/* Context: QEMU global mutex held */
+void virtio_net_data_plane_destroy(VirtIONetDataPlane *s)
+{
+    unsigned int i;
+
+    if (!s) {
+        return;
+    }
+
+    virtio_net_data_plane_stop(s);
+    for (i = 0; i < s->max_queues; i++) {
+        VirtIONetDataPlaneQueue *q = &s->queues[i];
+
+        qemu_bh_delete(q->tx_bh);
+        object_unref(OBJECT(q->iothread));
+        g_free(q->rx_buf);
+    }
+    g_free(s->queues);
+    g_free(s);
+}
+
+static bool queue_start(VirtIONetDataPlaneQueue *q)
+{
+    VirtIONetDataPlane *s = q->s;
+    VirtIONet *n = VIRTIO_NET(s->vdev);
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int rx = q->index * 2, tx = q->index * 2 + 1;
+    int r;
+
+    q->rx_vq = virtio_get_queue(s->vdev, rx);
+    q->tx_vq = virtio_get_queue(s->vdev, tx);
+
+    if (!vring_setup(&q->rx_vring, s->vdev, rx)) {
+        goto fail_rx_vring;
+    }
+    if (!vring_setup(&q->tx_vring, s->vdev, tx)) {
+        goto fail_tx_vring;
+    }
+
+    r = k->set_host_notifier(qbus->parent, rx, true);
+    if (r != 0) {
+        error_report("virtio-net failed to set host notifier (%d)", r);
+        goto fail_rx_notifier;
+    }
+    q->rx_host_notifier = *virtio_queue_get_host_notifier(q->rx_vq);
+
+    r = k->set_host_notifier(qbus->parent, tx, true);
+    if (r != 0) {
+        error_report("virtio-net failed to set host notifier (%d)", r);
+        goto fail_tx_notifier;
+    }
+    q->tx_host_notifier = *virtio_queue_get_host_notifier(q->tx_vq);
+
+    q->rx_guest_notifier = virtio_queue_get_guest_notifier(q->rx_vq);
+    q->tx_guest_notifier = virtio_queue_get_guest_notifier(q->tx_vq);
+
+    /* Take the tap device away from the main loop */
+    q->peer = qemu_get_subqueue(n->nic, q->index)->peer;
+    q->tap_fd = tap_get_fd(q->peer);
+    if (q->peer->info->poll) {
+        q->peer->info->poll(q->peer, false);
+    }
+
+    q->rx_len = q->rx_offset = 0;
+    q->rx_nbufs = q->rx_mhdr_cnt = 0;
+    q->rx_waiting = false;
+    q->tx_blocked = false;
+
+    /* rx buffers are only waited for when the ring runs dry */
+    vring_disable_notification(s->vdev, &q->rx_vring);
+
+    aio_context_acquire(q->ctx);
+    aio_set_event_notifier(q->ctx, &q->rx_host_notifier, handle_rx_notify);
+    aio_set_event_notifier(q->ctx, &q->tx_host_notifier, handle_tx_notify);
+    update_tap_handler(q);
+    aio_context_release(q->ctx);
+
+    /* Kick right away to begin processing requests already in vring */
+    event_notifier_set(virtio_queue_get_host_notifier(q->tx_vq));
+    return true;
+
+  fail_tx_notifier:
+    k->set_host_notifier(qbus->parent, rx, false);
+  fail_rx_notifier:
+    vring_teardown(&q->tx_vring, s->vdev, tx);
+  fail_tx_vring:
+    vring_teardown(&q->rx_vring, s->vdev, rx);
+  fail_rx_vring:
+    return false;
+}
+
+static void queue_stop(VirtIONetDataPlaneQueue *q)
+{
+    VirtIONetDataPlane *s = q->s;
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    int rx = q->index * 2, tx = q->index * 2 + 1;
+
+    aio_context_acquire(q->ctx);
+
+    /* Stop notifications for new packets from guest and tap device */
+    aio_set_event_notifier(q->ctx, &q->rx_host_notifier, NULL);
+    aio_set_event_notifier(q->ctx, &q->tx_host_notifier, NULL);
+    aio_set_fd_handler(q->ctx, q->tap_fd, NULL, NULL, NULL);
+    qemu_bh_cancel(q->tx_bh);
+
+    aio_context_release(q->ctx);
+
+    /* Give back buffers that are still in flight.  A partially received
+     * packet is dropped and its rx buffers are left to the next user of
+     * the ring; a blocked tx packet is dropped.
+     */
+    if (q->rx_nbufs) {
+        vring_unpop(&q->rx_vring, &q->rx_head, q->rx_nbufs);
+    }
+    q->rx_len = q->rx_offset = 0;
+    q->rx_nbufs = q->rx_mhdr_cnt = 0;
+    if (q->tx_blocked) {
+        vring_push(&q->tx_vring, &q->tx_elem, 0);
+        q->tx_blocked = false;
+        notify_guest(s, &q->tx_vring, q->tx_guest_notifier);
+    }
+
+    if (q->peer->info->poll) {
+        q->peer->info->poll(q->peer, true);
+    }
+    q->tap_fd = -1;
+
+    /* Sync vring state back to virtqueue so that non-dataplane packet
+     * processing can continue when we disable the host notifiers below.
+     */
+    vring_teardown(&q->rx_vring, s->vdev, rx);
+    vring_teardown(&q->tx_vring, s->vdev, tx);
+
+    k->set_host_notifier(qbus->parent, rx, false);
+    k->set_host_notifier(qbus->parent, tx, false);
+}
+
+/* Context: QEMU global mutex held */
+int virtio_net_data_plane_start(VirtIONetDataPlane *s, unsigned int queues)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIONet *n = VIRTIO_NET(s->vdev);
+    unsigned int i;
+    int r;
+
+    if (s->started) {
+        return 0;
+    }
+
+    /* Packets are passed between guest and tap device unmodified */
+    if (n->host_hdr_len != n->guest_hdr_len) {
+        error_report("virtio-net data plane needs a tap device with "
+                     "a %zu byte vnet header", n->guest_hdr_len);
+        return -ENOTSUP;
+    }
+
+    assert(queues <= s->max_queues);
+
+    /* Set up guest notifier (irq) */
+    r = k->set_guest_notifiers(qbus->parent, queues * 2, true);
+    if (r != 0) {
+        error_report("virtio-net failed to set guest notifier (%d), "
+                     "ensure -enable-kvm is set", r);
+        return r;
+    }
+
+    for (i = 0; i < queues; i++) {
+        if (!queue_start(&s->queues[i])) {
+            goto fail;
+        }
+    }
+
+    s->num_queues = queues;
+    s->started = true;
+    trace_virtio_net_data_plane_start(s, queues);
+    return 0;
+
+fail:
+    while (i--) {
+        queue_stop(&s->queues[i]);
+    }
+    k->set_guest_notifiers(qbus->parent, queues * 2, false);
+    return -EIO;
+}
+
+/* Context: QEMU global mutex held */
+void virtio_net_data_plane_stop(VirtIONetDataPlane *s)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    unsigned int i;
+
+    if (!s->started) {
+        return;
+    }
+    trace_virtio_net_data_plane_stop(s);
+
+    for (i = 0; i < s->num_queues; i++) {
+        queue_stop(&s->queues[i]);
+    }
+
+    /* Clean up guest notifier (irq) */
+    k->set_guest_notifiers(qbus->parent, s->num_queues * 2, false);
+
+    s->num_queues = 0;
+    s->started = false;
+}
@@ -0,0 +1,51 @@
+/*
+ * Dedicated threads for virtio-net I/O processing
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef HW_DATAPLANE_VIRTIO_NET_H
+#define HW_DATAPLANE_VIRTIO_NET_H
+
+#include "hw/virtio/virtio.h"
+#include "hw/virtio/virtio-net.h"
+
+typedef struct VirtIONetDataPlane VirtIONetDataPlane;
+
+#ifdef CONFIG_POSIX
+void virtio_net_data_plane_create(VirtIODevice *vdev, virtio_net_conf *conf,
+                                  VirtIONetDataPlane **dataplane,
+                                  Error **errp);
+void virtio_net_data_plane_destroy(VirtIONetDataPlane *s);
+int virtio_net_data_plane_start(VirtIONetDataPlane *s, unsigned int queues);
+void virtio_net_data_plane_stop(VirtIONetDataPlane *s);
+#else
+static inline void virtio_net_data_plane_create(VirtIODevice *vdev,
+                                                virtio_net_conf *conf,
+                                                VirtIONetDataPlane **dataplane,
+                                                Error **errp)
+{
+    *dataplane = NULL;
+    if (conf->data_plane || conf->iothread) {
+        error_setg(errp, "virtio-net data plane is not supported on this host");
+    }
+}
+
+static inline void virtio_net_data_plane_destroy(VirtIONetDataPlane *s)
+{
+}
+
+static inline int virtio_net_data_plane_start(VirtIONetDataPlane *s,
+                                              unsigned int queues)
+{
+    return -ENOSYS;
+}
+
+static inline void virtio_net_data_plane_stop(VirtIONetDataPlane *s)
+{
+}
+#endif
+
+#endif /* HW_DATAPLANE_VIRTIO_NET_H */
@@ -157,6 +157,13 @@ struct vhost_net *vhost_net_init(VhostNetOptions *options)
 
     net->dev.nvqs = 2;
     net->dev.vqs = net->vqs;
+    /* vhost-user queue pairs share one connection and need their vring
+     * offset from the start; vhost_net_start sets it again for kernel
+     * backends.
+     */
+    net->dev.vq_index = net->nc->queue_index * net->dev.nvqs;
+    net->dev.protocol_features = 0;
+    net->dev.max_queues = 1;
 
     r = vhost_dev_init(&net->dev, options->opaque,
                        options->backend_type, options->force);
@@ -189,6 +196,11 @@ bool vhost_net_query(VHostNetState *net, VirtIODevice *dev)
     return vhost_dev_query(&net->dev, dev);
 }
 
+uint64_t vhost_net_get_max_queues(VHostNetState *net)
+{
+    return net->dev.max_queues;
+}
+
 static void vhost_net_set_vq_index(struct vhost_net *net, int vq_index)
 {
     net->dev.vq_index = vq_index;
@@ -407,6 +419,11 @@ bool vhost_net_query(VHostNetState *net, VirtIODevice *dev)
     return false;
 }
 
+uint64_t vhost_net_get_max_queues(VHostNetState *net)
+{
+    return 1;
+}
+
 int vhost_net_start(VirtIODevice *dev,
                     NetClientState *ncs,
                     int total_queues)
@@ -24,24 +24,14 @@
 #include "qapi/qmp/qjson.h"
 #include "qapi-event.h"
 #include "hw/virtio/virtio-access.h"
+#include "migration/migration.h"
+#include "dataplane/virtio-net.h"
 
 #define VIRTIO_NET_VM_VERSION    11
 
 #define MAC_TABLE_ENTRIES    64
 #define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
 
-/*
- * Calculate the number of bytes up to and including the given 'field' of
- * 'container'.
- */
-#define endof(container, field) \
-    (offsetof(container, field) + sizeof(((container *)0)->field))
-
-typedef struct VirtIOFeature {
-    uint32_t flags;
-    size_t end;
-} VirtIOFeature;
-
 static VirtIOFeature feature_sizes[] = {
     {.flags = 1 << VIRTIO_NET_F_MAC,
      .end = endof(struct virtio_net_config, mac)},
@@ -110,6 +100,39 @@ static void virtio_net_announce_timer(void *opaque)
     virtio_notify_config(vdev);
 }
 
+/* Publish the rx buffers filled in since the last flush and notify once */
+static void virtio_net_rx_flush(VirtIONetQueue *q)
+{
+    VirtIODevice *vdev = VIRTIO_DEVICE(q->n);
+
+    if (q->rx_bh) {
+        qemu_bh_cancel(q->rx_bh);
+    }
+    if (!q->rx_pending) {
+        return;
+    }
+
+    virtqueue_flush(q->rx_vq, q->rx_pending);
+    q->rx_pending = 0;
+    virtio_notify(vdev, q->rx_vq);
+}
+
+static void virtio_net_rx_bh(void *opaque)
+{
+    virtio_net_rx_flush(opaque);
+}
+
+static void virtio_net_rx_flush_all(VirtIONet *n)
+{
+    int i;
+
+    for (i = 0; i < n->max_queues; i++) {
+        if (n->vqs[i].rx_vq) {
+            virtio_net_rx_flush(&n->vqs[i]);
+        }
+    }
+}
+
 static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
@@ -130,10 +153,18 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
         if (!vhost_net_query(get_vhost_net(nc->peer), vdev)) {
             return;
         }
+        if (virtio_has_ring_packed(vdev)) {
+            error_report("vhost net does not support packed virtqueues: "
+                         "falling back on userspace virtio");
+            return;
+        }
 
         /* Any packets outstanding? Purge them to avoid touching rings
-         * when vhost is running.
+         * when vhost is running.  Received packets that are already in the
+         * ring must be published first, vhost starts from the used index
+         * in guest memory.
          */
+        virtio_net_rx_flush_all(n);
         for (i = 0;  i < queues; i++) {
             NetClientState *qnc = qemu_get_subqueue(n->nic, i);
 
@@ -155,6 +186,45 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     }
 }
 
+static void virtio_net_data_plane_status(VirtIONet *n, uint8_t status)
+{
+    NetClientState *nc = qemu_get_queue(n->nic);
+    int queues = n->multiqueue ? n->max_queues : 1;
+    int i;
+
+    if (!n->dataplane) {
+        return;
+    }
+
+    if (!!n->dataplane_started ==
+        (virtio_net_started(n, status) && !nc->peer->link_down &&
+         !n->dataplane_disabled)) {
+        return;
+    }
+    if (!n->dataplane_started) {
+        /* Like for vhost, publish what the userspace path has received and
+         * purge outstanding packets before the rings change hands.
+         */
+        virtio_net_rx_flush_all(n);
+        for (i = 0;  i < queues; i++) {
+            NetClientState *qnc = qemu_get_subqueue(n->nic, i);
+
+            qemu_net_queue_purge(qnc->peer->incoming_queue, qnc);
+            qemu_net_queue_purge(qnc->incoming_queue, qnc->peer);
+        }
+
+        if (virtio_net_data_plane_start(n->dataplane, queues) < 0) {
+            error_report("unable to start virtio-net data plane: "
+                         "falling back on userspace virtio");
+            return;
+        }
+        n->dataplane_started = 1;
+    } else {
+        virtio_net_data_plane_stop(n->dataplane);
+        n->dataplane_started = 0;
+    }
+}
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -163,6 +233,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     uint8_t queue_status;
 
     virtio_net_vhost_status(n, status);
+    virtio_net_data_plane_status(n, status);
 
     for (i = 0; i < n->max_queues; i++) {
         q = &n->vqs[i];
@@ -177,7 +248,8 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             continue;
         }
 
-        if (virtio_net_started(n, queue_status) && !n->vhost_started) {
+        if (virtio_net_started(n, queue_status) && !n->vhost_started &&
+            !n->dataplane_started) {
             if (q->tx_timer) {
                 timer_mod(q->tx_timer,
                                qemu_clock_get_ns(QEMU_CLOCK_VIRTUAL) + n->tx_timeout);
@@ -322,6 +394,15 @@ static RxFilterInfo *virtio_net_query_rxfilter(NetClientState *nc)
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
+    int i;
+
+    /* The rings are about to be reset, drop batched rx buffers */
+    for (i = 0; i < n->max_queues; i++) {
+        if (n->vqs[i].rx_bh) {
+            qemu_bh_cancel(n->vqs[i].rx_bh);
+        }
+        n->vqs[i].rx_pending = 0;
+    }
 
     /* Reset back to compatibility mode */
     n->promisc = 1;
@@ -488,12 +569,26 @@ static uint32_t virtio_net_bad_features(VirtIODevice *vdev)
 
 static void virtio_net_apply_guest_offloads(VirtIONet *n)
 {
+    const uint64_t gro_offloads = (1ULL << VIRTIO_NET_F_GUEST_CSUM) |
+                                  (1ULL << VIRTIO_NET_F_GUEST_TSO4);
+    bool gro;
+    int i;
+
     qemu_set_offload(qemu_get_queue(n->nic)->peer,
             !!(n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_CSUM)),
             !!(n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_TSO4)),
             !!(n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_TSO6)),
             !!(n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_ECN)),
             !!(n->curr_guest_offloads & (1ULL << VIRTIO_NET_F_GUEST_UFO)));
+
+    /* Coalesce segments that the peer did not merge itself into frames
+     * that the guest can take as a single TSO buffer.
+     */
+    gro = n->net_conf.gro &&
+          (n->curr_guest_offloads & gro_offloads) == gro_offloads;
+    for (i = 0; i < n->max_queues; i++) {
+        qemu_set_gro(qemu_get_subqueue(n->nic, i), gro, n->host_hdr_len);
+    }
 }
 
 static uint64_t virtio_net_guest_offloads_by_features(uint32_t features)
@@ -1081,7 +1176,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, &elem, total, i++);
+        virtqueue_fill(q->rx_vq, &elem, total, q->rx_pending + i++);
     }
 
     if (mhdr_cnt) {
@@ -1091,8 +1186,12 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                      &mhdr.num_buffers, sizeof mhdr.num_buffers);
     }
 
-    virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
+    q->rx_pending += i;
+    if (n->rx_burst <= 1 || q->rx_pending >= n->rx_burst) {
+        virtio_net_rx_flush(q);
+    } else {
+        qemu_bh_schedule(q->rx_bh);
+    }
 
     return size;
 }
@@ -1169,8 +1268,12 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 
         len = n->guest_hdr_len;
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
+        /* The element stays mapped in q->async_tx until
+         * virtio_net_tx_complete(), so a queued packet need not be copied.
+         */
+        ret = qemu_sendv_packet_async_zerocopy(
+                  qemu_get_subqueue(n->nic, queue_index),
+                  out_sg, out_num, virtio_net_tx_complete);
         if (ret == 0) {
             virtio_queue_set_notification(q->tx_vq, 0);
             q->async_tx.elem = elem;
@@ -1306,12 +1409,17 @@ static void virtio_net_set_multiqueue(VirtIONet *n, int multiqueue)
 
     n->multiqueue = multiqueue;
 
+    virtio_net_rx_flush_all(n);
+
     for (i = 2; i <= n->max_queues * 2 + 1; i++) {
         virtio_del_queue(vdev, i);
     }
 
     for (i = 1; i < max; i++) {
         n->vqs[i].rx_vq = virtio_add_queue(vdev, 256, virtio_net_handle_rx);
+        if (!n->vqs[i].rx_bh) {
+            n->vqs[i].rx_bh = qemu_bh_new(virtio_net_rx_bh, &n->vqs[i]);
+        }
         if (n->vqs[i].tx_timer) {
             n->vqs[i].tx_vq =
                 virtio_add_queue(vdev, 256, virtio_net_handle_tx_timer);
@@ -1345,6 +1453,8 @@ static void virtio_net_save(QEMUFile *f, void *opaque)
     /* At this point, backend must be stopped, otherwise
      * it might keep writing to memory. */
     assert(!n->vhost_started);
+    assert(!n->dataplane_started);
+    virtio_net_rx_flush_all(n);
     virtio_save(vdev, f);
 }
 
@@ -1551,14 +1661,9 @@ static void virtio_net_guest_notifier_mask(VirtIODevice *vdev, int idx,
 
 void virtio_net_set_config_size(VirtIONet *n, uint32_t host_features)
 {
-    int i, config_size = 0;
     host_features |= (1 << VIRTIO_NET_F_MAC);
-    for (i = 0; feature_sizes[i].flags != 0; i++) {
-        if (host_features & feature_sizes[i].flags) {
-            config_size = MAX(feature_sizes[i].end, config_size);
-        }
-    }
-    n->config_size = config_size;
+    n->config_size = virtio_feature_get_config_size(feature_sizes,
+                                                    host_features);
 }
 
 void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
@@ -1575,18 +1680,50 @@ void virtio_net_set_netclient_name(VirtIONet *n, const char *name,
     n->netclient_type = g_strdup(type);
 }
 
+/* Disable dataplane threads during live migration since they do not
+ * update the dirty memory bitmap.
+ */
+static void virtio_net_migration_state_changed(Notifier *notifier, void *data)
+{
+    VirtIONet *n = container_of(notifier, VirtIONet, migration_state_notifier);
+    VirtIODevice *vdev = VIRTIO_DEVICE(n);
+    MigrationState *mig = data;
+
+    if (migration_in_setup(mig)) {
+        n->dataplane_disabled = true;
+    } else if (migration_has_finished(mig) ||
+               migration_has_failed(mig)) {
+        n->dataplane_disabled = false;
+    } else {
+        return;
+    }
+    virtio_net_data_plane_status(n, vdev->status);
+}
+
+static void virtio_net_device_unrealize(DeviceState *dev, Error **errp);
+
 static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtIONet *n = VIRTIO_NET(dev);
     NetClientState *nc;
+    Error *err = NULL;
     int i;
 
+    /* The dataplane vring only knows the split layout */
+    if ((n->net_conf.data_plane || n->net_conf.iothread) &&
+        (vdev->host_features_hi & (1 << (VIRTIO_F_RING_PACKED - 32)))) {
+        error_setg(errp, "packed is not supported with x-data-plane "
+                   "or iothread");
+        return;
+    }
+
     virtio_init(vdev, "virtio-net", VIRTIO_ID_NET, n->config_size);
 
     n->max_queues = MAX(n->nic_conf.peers.queues, 1);
     n->vqs = g_malloc0(sizeof(VirtIONetQueue) * n->max_queues);
     n->vqs[0].rx_vq = virtio_add_queue(vdev, 256, virtio_net_handle_rx);
+    n->vqs[0].rx_bh = qemu_bh_new(virtio_net_rx_bh, &n->vqs[0]);
     n->curr_queues = 1;
     n->vqs[0].n = n;
     n->tx_timeout = n->net_conf.txtimer;
@@ -1641,6 +1778,7 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
 
     n->vqs[0].tx_waiting = 0;
     n->tx_burst = n->net_conf.txburst;
+    n->rx_burst = n->net_conf.rxburst;
     virtio_net_set_mrg_rx_bufs(n, 0);
     n->promisc = 1; /* for compatibility */
 
@@ -1652,6 +1790,16 @@ static void virtio_net_device_realize(DeviceState *dev, Error **errp)
     nc->rxfilter_notify_enabled = 1;
 
     n->qdev = dev;
+
+    n->migration_state_notifier.notify = virtio_net_migration_state_changed;
+    add_migration_state_change_notifier(&n->migration_state_notifier);
+    virtio_net_data_plane_create(vdev, &n->net_conf, &n->dataplane, &err);
+    if (err != NULL) {
+        error_propagate(errp, err);
+        virtio_net_device_unrealize(dev, NULL);
+        return;
+    }
+
     register_savevm(dev, "virtio-net", -1, VIRTIO_NET_VM_VERSION,
                     virtio_net_save, virtio_net_load, n);
 }
@@ -1662,9 +1810,12 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
     VirtIONet *n = VIRTIO_NET(dev);
     int i;
 
-    /* This will stop vhost backend if appropriate. */
+    /* This will stop vhost backend or data plane if appropriate. */
     virtio_net_set_status(vdev, 0);
 
+    remove_migration_state_change_notifier(&n->migration_state_notifier);
+    virtio_net_data_plane_destroy(n->dataplane);
+    n->dataplane = NULL;
     unregister_savevm(dev, "virtio-net", n);
 
     g_free(n->netclient_name);
@@ -1681,6 +1832,9 @@ static void virtio_net_device_unrealize(DeviceState *dev, Error **errp)
 
         qemu_purge_queued_packets(nc);
 
+        if (q->rx_bh) {
+            qemu_bh_delete(q->rx_bh);
+        }
         if (q->tx_timer) {
             timer_del(q->tx_timer);
             timer_free(q->tx_timer);
@@ -1705,6 +1859,10 @@ static void virtio_net_instance_init(Object *obj)
      * Can be overriden with virtio_net_set_config_size.
      */
     n->config_size = sizeof(struct virtio_net_config);
+    object_property_add_link(obj, "iothread", TYPE_IOTHREAD,
+                             (Object **)&n->net_conf.iothread,
+                             qdev_prop_allow_set_link_before_realize,
+                             OBJ_PROP_LINK_UNREF_ON_RELEASE, NULL);
     device_add_bootindex_property(obj, &n->nic_conf.bootindex,
                                   "bootindex", "/ethernet-phy@0",
                                   DEVICE(n), NULL);
@@ -1715,7 +1873,11 @@ static Property virtio_net_properties[] = {
     DEFINE_PROP_UINT32("x-txtimer", VirtIONet, net_conf.txtimer,
                                                TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
+    DEFINE_PROP_INT32("x-rxburst", VirtIONet, net_conf.rxburst, RX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_BIT("x-data-plane", VirtIONet, net_conf.data_plane, 0, false),
+    DEFINE_PROP_BIT("x-gro", VirtIONet, net_conf.gro, 0, false),
+    DEFINE_VIRTIO_RING_PACKED_FEATURE(VirtIONet, parent_obj),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -267,6 +267,9 @@ typedef struct {
         bool rx_vlan_stripping;
         bool lro_supported;
 
+        /* Coalesce received TCP segments when LRO is enabled */
+        bool gro;
+
         uint8_t rxq_num;
 
         /* Network MTU */
@@ -1300,6 +1303,8 @@ static void vmxnet3_update_features(VMXNET3State *s)
                          s->lro_supported,
                          0,
                          0);
+        qemu_set_gro(qemu_get_queue(s->nic), s->gro && s->lro_supported,
+                     sizeof(struct virtio_net_hdr));
     }
 }
 
@@ -2397,6 +2402,11 @@ static int vmxnet3_post_load(void *opaque, int version_id)
     vmxnet3_validate_queues(s);
     vmxnet3_validate_interrupts(s);
 
+    if (s->peer_has_vhdr) {
+        qemu_set_gro(qemu_get_queue(s->nic), s->gro && s->lro_supported,
+                     sizeof(struct virtio_net_hdr));
+    }
+
     return 0;
 }
 
@@ -2493,6 +2503,7 @@ vmxnet3_write_config(PCIDevice *pci_dev, uint32_t addr, uint32_t val, int len)
 
 static Property vmxnet3_properties[] = {
     DEFINE_NIC_PROPERTIES(VMXNET3State, conf),
+    DEFINE_PROP_BOOL("x-gro", VMXNET3State, gro, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
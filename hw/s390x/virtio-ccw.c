@@ -373,6 +373,9 @@ static int virtio_ccw_cb(SubchDev *sch, CCW1 ccw)
                                        ccw.cda + sizeof(features.features));
             if (features.index < ARRAY_SIZE(dev->host_features)) {
                 features.features = dev->host_features[features.index];
+            } else if (features.index == 1) {
+                /* Bits 32-63 are offered by the device itself */
+                features.features = vdev->host_features_hi;
             } else {
                 /* Return zeroes if the guest supports more feature bits. */
                 features.features = 0;
@@ -402,6 +405,8 @@ static int virtio_ccw_cb(SubchDev *sch, CCW1 ccw)
             if (features.index < ARRAY_SIZE(dev->host_features)) {
                 virtio_bus_set_vdev_features(&dev->bus, features.features);
                 vdev->guest_features = features.features;
+            } else if (features.index == 1) {
+                virtio_set_features_hi(vdev, features.features);
             } else {
                 /*
                  * If the guest supports more feature bits, assert that it
@@ -909,6 +914,8 @@ static void virtio_ccw_balloon_instance_init(Object *obj)
                         balloon_ccw_stats_get_poll_interval,
                         balloon_ccw_stats_set_poll_interval,
                         NULL, dev, NULL);
+    object_property_add_alias(obj, "free-page-reporting", OBJECT(&dev->vdev),
+                              "free-page-reporting", &error_abort);
 }
 
 static int virtio_ccw_scsi_init(VirtioCcwDevice *ccw_dev)
@@ -32,6 +32,7 @@
 #include "hw/sysbus.h"
 #include "hw/timer/mc146818rtc.h"
 #include "hw/timer/i8254.h"
+#include "qemu/main-loop.h"
 
 //#define HPET_DEBUG
 #ifdef HPET_DEBUG
@@ -410,6 +411,11 @@ static uint32_t hpet_ram_readw(void *opaque, hwaddr addr)
 }
 #endif
 
+/*
+ * The region does not take the BQL.  Reads have no side effects and only
+ * load single fields, so a guest racing them against a write on another
+ * vCPU sees either value; writes take the BQL below.
+ */
 static uint64_t hpet_ram_read(void *opaque, hwaddr addr,
                               unsigned size)
 {
@@ -482,8 +488,8 @@ static uint64_t hpet_ram_read(void *opaque, hwaddr addr,
     return 0;
 }
 
-static void hpet_ram_write(void *opaque, hwaddr addr,
-                           uint64_t value, unsigned size)
+static void hpet_ram_write_locked(void *opaque, hwaddr addr,
+                                  uint64_t value, unsigned size)
 {
     int i;
     HPETState *s = opaque;
@@ -650,6 +656,21 @@ static void hpet_ram_write(void *opaque, hwaddr addr,
     }
 }
 
+static void hpet_ram_write(void *opaque, hwaddr addr,
+                           uint64_t value, unsigned size)
+{
+    bool locked = qemu_mutex_iothread_locked();
+
+    /* Writes reprogram timers and raise interrupts */
+    if (!locked) {
+        qemu_mutex_lock_iothread();
+    }
+    hpet_ram_write_locked(opaque, addr, value, size);
+    if (!locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
 static const MemoryRegionOps hpet_ram_ops = {
     .read = hpet_ram_read,
     .write = hpet_ram_write,
@@ -715,6 +736,7 @@ static void hpet_init(Object *obj)
 
     /* HPET Area */
     memory_region_init_io(&s->iomem, obj, &hpet_ram_ops, s, "hpet", 0x400);
+    memory_region_clear_global_locking(&s->iomem);
     sysbus_init_mmio(sbd, &s->iomem);
 }
 
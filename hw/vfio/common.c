@@ -782,6 +782,19 @@ static void vfio_disconnect_container(VFIOGroup *group)
     }
 }
 
+/* True if some guest memory may be pinned for device DMA */
+bool vfio_has_containers(void)
+{
+    VFIOAddressSpace *space;
+
+    QLIST_FOREACH(space, &vfio_address_spaces, list) {
+        if (!QLIST_EMPTY(&space->containers)) {
+            return true;
+        }
+    }
+    return false;
+}
+
 VFIOGroup *vfio_get_group(int groupid, AddressSpace *as)
 {
     VFIOGroup *group;
@@ -405,13 +405,15 @@ out:
 
 /* After we've used one of their buffers, we tell them about it.
  *
- * Stolen from linux/drivers/vhost/vhost.c.
+ * The used ring entry is written @idx entries past the current used index
+ * but is not made visible to the guest until vring_flush() is called, so
+ * that several buffers can be completed as one unit.
  */
-void vring_push(Vring *vring, VirtQueueElement *elem, int len)
+void vring_fill(Vring *vring, VirtQueueElement *elem, int len,
+                unsigned int idx)
 {
     struct vring_used_elem *used;
     unsigned int head = elem->index;
-    uint16_t new;
 
     vring_unmap_element(elem);
 
@@ -422,15 +424,49 @@ void vring_push(Vring *vring, VirtQueueElement *elem, int len)
 
     /* The virtqueue contains a ring of used buffers.  Get a pointer to the
      * next entry in that used ring. */
-    used = &vring->vr.used->ring[vring->last_used_idx % vring->vr.num];
+    used = &vring->vr.used->ring[(vring->last_used_idx + idx) % vring->vr.num];
     used->id = head;
     used->len = len;
+}
+
+/* Undo the last @count vring_pop() calls, whose buffers have not been
+ * published with vring_flush(), so that they are popped again later.
+ * @elem is the one of them that is still mapped; the others must have
+ * gone through vring_fill() already.
+ */
+void vring_unpop(Vring *vring, VirtQueueElement *elem, unsigned int count)
+{
+    vring_unmap_element(elem);
+    vring->last_avail_idx -= count;
+}
+
+/* Publish @count used ring entries written with vring_fill() */
+void vring_flush(Vring *vring, unsigned int count)
+{
+    uint16_t old, new;
+
+    /* Don't touch vring if a fatal error occurred */
+    if (vring->broken) {
+        return;
+    }
 
     /* Make sure buffer is written before we update index. */
     smp_wmb();
 
-    new = vring->vr.used->idx = ++vring->last_used_idx;
-    if (unlikely((int16_t)(new - vring->signalled_used) < (uint16_t)1)) {
+    old = vring->last_used_idx;
+    new = vring->vr.used->idx = vring->last_used_idx = old + count;
+    if (unlikely((int16_t)(new - vring->signalled_used) <
+                 (uint16_t)(new - old))) {
         vring->signalled_used_valid = false;
     }
 }
+
+/* Complete a single buffer and publish it right away.
+ *
+ * Stolen from linux/drivers/vhost/vhost.c.
+ */
+void vring_push(Vring *vring, VirtQueueElement *elem, int len)
+{
+    vring_fill(vring, elem, len, 0);
+    vring_flush(vring, 1);
+}
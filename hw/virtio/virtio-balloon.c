@@ -25,6 +25,8 @@
 #include "exec/address-spaces.h"
 #include "qapi/visitor.h"
 #include "qapi-event.h"
+#include "migration/migration.h"
+#include "trace.h"
 
 #if defined(__linux__)
 #include <sys/mman.h>
@@ -235,6 +237,70 @@ static void virtio_balloon_handle_output(VirtIODevice *vdev, VirtQueue *vq)
     }
 }
 
+/* The guest does not care about the contents of [pa, pa + len) any more:
+ * give the memory back to the host and don't migrate it until the guest
+ * writes to it again.
+ */
+static void balloon_free_page_range(hwaddr pa, hwaddr len)
+{
+    while (len) {
+        MemoryRegionSection section;
+        hwaddr skip, size;
+
+        /* FIXME: remove get_system_memory(), but how? */
+        section = memory_region_find(get_system_memory(), pa, len);
+        if (!int128_nz(section.size)) {
+            break;
+        }
+
+        skip = section.offset_within_address_space - pa;
+        size = int128_get64(section.size);
+        if (memory_region_is_ram(section.mr)) {
+            ram_addr_t offset = section.offset_within_region;
+            uint8_t *host = memory_region_get_ram_ptr(section.mr) + offset;
+            uintptr_t start = ROUND_UP((uintptr_t)host, getpagesize());
+            uintptr_t end = ((uintptr_t)host + size) & -getpagesize();
+
+            trace_virtio_balloon_free_page_range(pa + skip, size);
+            migration_bitmap_skip_free_range(
+                memory_region_get_ram_addr(section.mr) + offset, size);
+#if defined(__linux__)
+            /* Only anonymous memory is actually freed by MADV_DONTNEED */
+            if (start < end && memory_region_get_fd(section.mr) < 0 &&
+                (!kvm_enabled() || kvm_has_sync_mmu())) {
+                qemu_madvise((void *)start, end - start, QEMU_MADV_DONTNEED);
+            }
+#endif
+        }
+        memory_region_unref(section.mr);
+
+        if (skip + size >= len) {
+            break;
+        }
+        pa += skip + size;
+        len -= skip + size;
+    }
+}
+
+static void virtio_balloon_handle_report(VirtIODevice *vdev, VirtQueue *vq)
+{
+    VirtQueueElement elem;
+
+    /* The guest keeps the pages isolated until we return the buffer, so
+     * it cannot write to them while we process the report.
+     */
+    while (virtqueue_pop(vq, &elem)) {
+        unsigned int i;
+
+        for (i = 0; i < elem.in_num; i++) {
+            balloon_free_page_range(elem.in_addr[i], elem.in_sg[i].iov_len);
+        }
+
+        virtqueue_push(vq, &elem, 0);
+        virtio_notify(vdev, vq);
+    }
+}
+
 static void virtio_balloon_receive_stats(VirtIODevice *vdev, VirtQueue *vq)
 {
     VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
@@ -305,6 +371,9 @@ static void virtio_balloon_set_config(VirtIODevice *vdev,
 
 static uint32_t virtio_balloon_get_features(VirtIODevice *vdev, uint32_t f)
 {
+    VirtIOBalloon *s = VIRTIO_BALLOON(vdev);
+
+    f |= s->host_features;
     f |= (1 << VIRTIO_BALLOON_F_STATS_VQ);
     return f;
 }
@@ -382,6 +451,9 @@ static void virtio_balloon_device_realize(DeviceState *dev, Error **errp)
     s->ivq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->dvq = virtio_add_queue(vdev, 128, virtio_balloon_handle_output);
     s->svq = virtio_add_queue(vdev, 128, virtio_balloon_receive_stats);
+    if (s->host_features & (1 << VIRTIO_BALLOON_F_REPORTING)) {
+        s->rvq = virtio_add_queue(vdev, 32, virtio_balloon_handle_report);
+    }
 
     reset_stats(s);
 
@@ -409,6 +481,8 @@ static void virtio_balloon_device_unrealize(DeviceState *dev, Error **errp)
 }
 
 static Property virtio_balloon_properties[] = {
+    DEFINE_PROP_BIT("free-page-reporting", VirtIOBalloon, host_features,
+                    VIRTIO_BALLOON_F_REPORTING, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
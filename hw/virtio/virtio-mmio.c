@@ -144,7 +144,9 @@ static uint64_t virtio_mmio_read(void *opaque, hwaddr offset, unsigned size)
     case VIRTIO_MMIO_VENDORID:
         return VIRT_VENDOR;
     case VIRTIO_MMIO_HOSTFEATURES:
-        if (proxy->host_features_sel) {
+        if (proxy->host_features_sel == 1) {
+            return vdev->host_features_hi;
+        } else if (proxy->host_features_sel) {
             return 0;
         }
         return proxy->host_features;
@@ -223,6 +225,8 @@ static void virtio_mmio_write(void *opaque, hwaddr offset, uint64_t value,
     case VIRTIO_MMIO_GUESTFEATURES:
         if (!proxy->guest_features_sel) {
             virtio_set_features(vdev, value);
+        } else if (proxy->guest_features_sel == 1) {
+            virtio_set_features_hi(vdev, value);
         }
         break;
     case VIRTIO_MMIO_GUESTFEATURESSEL:
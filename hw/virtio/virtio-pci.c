@@ -1327,6 +1327,8 @@ static void virtio_balloon_pci_instance_init(Object *obj)
                         balloon_pci_stats_get_poll_interval,
                         balloon_pci_stats_set_poll_interval,
                         NULL, dev, NULL);
+    object_property_add_alias(obj, "free-page-reporting", OBJECT(&dev->vdev),
+                              "free-page-reporting", &error_abort);
 }
 
 static const TypeInfo virtio_balloon_pci_info = {
@@ -1463,6 +1465,8 @@ static void virtio_net_pci_instance_init(Object *obj)
                                 TYPE_VIRTIO_NET);
     object_property_add_alias(obj, "bootindex", OBJECT(&dev->vdev),
                               "bootindex", &error_abort);
+    object_property_add_alias(obj, "iothread", OBJECT(&dev->vdev), "iothread",
+                              &error_abort);
 }
 
 static const TypeInfo virtio_net_pci_info = {
@@ -21,6 +21,7 @@
 #include "hw/virtio/virtio-bus.h"
 #include "migration/migration.h"
 #include "hw/virtio/virtio-access.h"
+#include "hw/xen/xen.h"
 
 /*
  * The alignment to use between consumer and producer parts of vring.
@@ -57,6 +58,22 @@ typedef struct VRingUsed
     VRingUsedElem ring[0];
 } VRingUsed;
 
+/* Packed ring descriptor; the device overwrites it with the used entry */
+typedef struct VRingPackedDesc
+{
+    uint64_t addr;
+    uint32_t len;
+    uint16_t id;
+    uint16_t flags;
+} VRingPackedDesc;
+
+/* Packed ring driver/device event suppression area */
+typedef struct VRingPackedDescEvent
+{
+    uint16_t off_wrap;
+    uint16_t flags;
+} VRingPackedDescEvent;
+
 typedef struct VRing
 {
     unsigned int num;
@@ -66,17 +83,45 @@ typedef struct VRing
     hwaddr used;
 } VRing;
 
+/*
+ * Host mapping of one part of a vring.  @host is NULL when the ring is not
+ * contiguous guest RAM; accesses then go through the address space.
+ */
+typedef struct VRingRegion
+{
+    MemoryRegion *mr;
+    hwaddr offset;
+    uint8_t *host;
+} VRingRegion;
+
 struct VirtQueue
 {
     VRing vring;
+    VRingRegion desc_region;
+    VRingRegion avail_region;
+    VRingRegion used_region;
     hwaddr pa;
     uint16_t last_avail_idx;
+    /* Last avail_idx read from the guest */
+    uint16_t shadow_avail_idx;
+    /* Our copy of used_idx; only the device writes it */
+    uint16_t used_idx;
     /* Last used index value we have signalled on */
     uint16_t signalled_used;
 
     /* Last used index value we have signalled on */
     bool signalled_used_valid;
 
+    /* Packed ring: wrap counters of last_avail_idx and used_idx */
+    bool last_avail_wrap_counter;
+    bool used_wrap_counter;
+    /* Packed ring: ring slots taken by each buffer in flight, by id */
+    uint16_t *ndescs;
+    /* Packed ring: slots filled since the last flush, and the flags
+     * for the first of them, which virtqueue_flush() writes last */
+    unsigned int fill_ndescs;
+    uint16_t fill_head_flags;
+
     /* Notification enabled? */
     bool notification;
 
@@ -91,68 +136,271 @@ struct VirtQueue
     EventNotifier host_notifier;
 };
 
+static void vring_region_unmap(VRingRegion *r)
+{
+    if (r->mr) {
+        memory_region_unref(r->mr);
+    }
+    r->mr = NULL;
+    r->host = NULL;
+}
+
+static void vring_region_map(VRingRegion *r, hwaddr pa, hwaddr size,
+                             bool is_write)
+{
+    MemoryRegion *mr;
+    hwaddr xlat, len = size;
+
+    vring_region_unmap(r);
+    if (!pa || xen_enabled()) {
+        return;
+    }
+
+    mr = address_space_translate(&address_space_memory, pa, &xlat, &len,
+                                 is_write);
+    if (!memory_region_is_ram(mr) || (is_write && mr->readonly) ||
+        len < size) {
+        return;
+    }
+
+    memory_region_ref(mr);
+    r->mr = mr;
+    r->offset = xlat;
+    r->host = (uint8_t *)memory_region_get_ram_ptr(mr) + xlat;
+}
+
+static void virtqueue_release_regions(VirtQueue *vq)
+{
+    vring_region_unmap(&vq->desc_region);
+    vring_region_unmap(&vq->avail_region);
+    vring_region_unmap(&vq->used_region);
+}
+
+/* (Re)map the rings of @vq; called whenever their location may change. */
+static void virtqueue_update_regions(VirtQueue *vq)
+{
+    unsigned int num = vq->vring.num;
+
+    if (!num) {
+        virtqueue_release_regions(vq);
+        return;
+    }
+    if (virtio_has_ring_packed(vq->vdev)) {
+        /* Used entries are written back into the descriptor ring */
+        vring_region_map(&vq->desc_region, vq->vring.desc,
+                         num * sizeof(VRingPackedDesc), true);
+        vring_region_map(&vq->avail_region, vq->vring.avail,
+                         sizeof(VRingPackedDescEvent), false);
+        vring_region_map(&vq->used_region, vq->vring.used,
+                         sizeof(VRingPackedDescEvent), true);
+        return;
+    }
+    vring_region_map(&vq->desc_region, vq->vring.desc,
+                     num * sizeof(VRingDesc), false);
+    vring_region_map(&vq->avail_region, vq->vring.avail,
+                     offsetof(VRingAvail, ring[num]) + sizeof(uint16_t),
+                     false);
+    vring_region_map(&vq->used_region, vq->vring.used,
+                     offsetof(VRingUsed, ring[num]) + sizeof(uint16_t),
+                     true);
+}
+
 /* virt queue functions */
 static void virtqueue_init(VirtQueue *vq)
 {
     hwaddr pa = vq->pa;
 
     vq->vring.desc = pa;
-    vq->vring.avail = pa + vq->vring.num * sizeof(VRingDesc);
-    vq->vring.used = vring_align(vq->vring.avail +
-                                 offsetof(VRingAvail, ring[vq->vring.num]),
-                                 vq->vring.align);
+    if (virtio_has_ring_packed(vq->vdev)) {
+        /*
+         * There is a single queue address, so the driver event area
+         * follows the descriptor ring and the device event area follows
+         * that.
+         */
+        vq->vring.avail = pa + vq->vring.num * sizeof(VRingPackedDesc);
+        vq->vring.used = vq->vring.avail + sizeof(VRingPackedDescEvent);
+    } else {
+        vq->vring.avail = pa + vq->vring.num * sizeof(VRingDesc);
+        vq->vring.used = vring_align(vq->vring.avail +
+                                     offsetof(VRingAvail, ring[vq->vring.num]),
+                                     vq->vring.align);
+    }
+    virtqueue_update_regions(vq);
 }
 
-static inline uint64_t vring_desc_addr(VirtIODevice *vdev, hwaddr desc_pa,
-                                       int i)
+static inline uint16_t vring_lduw(VirtIODevice *vdev, VRingRegion *r,
+                                  hwaddr pa, hwaddr off)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, addr);
-    return virtio_ldq_phys(vdev, pa);
+    if (likely(r->host)) {
+        return virtio_lduw_p(vdev, r->host + off);
+    }
+    return virtio_lduw_phys(vdev, pa + off);
 }
 
-static inline uint32_t vring_desc_len(VirtIODevice *vdev, hwaddr desc_pa, int i)
+static inline void vring_stw(VirtIODevice *vdev, VRingRegion *r,
+                             hwaddr pa, hwaddr off, uint16_t val)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, len);
-    return virtio_ldl_phys(vdev, pa);
+    if (likely(r->host)) {
+        virtio_stw_p(vdev, r->host + off, val);
+        memory_region_set_dirty(r->mr, r->offset + off, sizeof(val));
+    } else {
+        virtio_stw_phys(vdev, pa + off, val);
+    }
 }
 
-static inline uint16_t vring_desc_flags(VirtIODevice *vdev, hwaddr desc_pa,
-                                        int i)
+static inline void vring_stl(VirtIODevice *vdev, VRingRegion *r,
+                             hwaddr pa, hwaddr off, uint32_t val)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, flags);
-    return virtio_lduw_phys(vdev, pa);
+    if (likely(r->host)) {
+        virtio_stl_p(vdev, r->host + off, val);
+        memory_region_set_dirty(r->mr, r->offset + off, sizeof(val));
+    } else {
+        virtio_stl_phys(vdev, pa + off, val);
+    }
 }
 
-static inline uint16_t vring_desc_next(VirtIODevice *vdev, hwaddr desc_pa,
-                                       int i)
+/*
+ * Read descriptor @i of the table at @desc_pa.  @r is the table's mapping,
+ * or NULL for indirect tables, which are read through the address space.
+ */
+static void vring_desc_read(VirtIODevice *vdev, VRingDesc *desc,
+                            VRingRegion *r, hwaddr desc_pa, unsigned int i)
 {
-    hwaddr pa;
-    pa = desc_pa + sizeof(VRingDesc) * i + offsetof(VRingDesc, next);
-    return virtio_lduw_phys(vdev, pa);
+    if (r && likely(r->host)) {
+        memcpy(desc, r->host + i * sizeof(VRingDesc), sizeof(VRingDesc));
+    } else {
+        address_space_read(&address_space_memory,
+                           desc_pa + i * sizeof(VRingDesc),
+                           (uint8_t *)desc, sizeof(VRingDesc));
+    }
+    virtio_tswap64s(vdev, &desc->addr);
+    virtio_tswap32s(vdev, &desc->len);
+    virtio_tswap16s(vdev, &desc->flags);
+    virtio_tswap16s(vdev, &desc->next);
+}
+
+/* The packed layout is little endian whatever the device endianness */
+static inline uint16_t vring_lduw_le(VRingRegion *r, hwaddr pa, hwaddr off)
+{
+    if (likely(r->host)) {
+        return lduw_le_p(r->host + off);
+    }
+    return lduw_le_phys(&address_space_memory, pa + off);
+}
+
+static inline void vring_stw_le(VRingRegion *r, hwaddr pa, hwaddr off,
+                                uint16_t val)
+{
+    if (likely(r->host)) {
+        stw_le_p(r->host + off, val);
+        memory_region_set_dirty(r->mr, r->offset + off, sizeof(val));
+    } else {
+        stw_le_phys(&address_space_memory, pa + off, val);
+    }
+}
+
+static inline void vring_stl_le(VRingRegion *r, hwaddr pa, hwaddr off,
+                                uint32_t val)
+{
+    if (likely(r->host)) {
+        stl_le_p(r->host + off, val);
+        memory_region_set_dirty(r->mr, r->offset + off, sizeof(val));
+    } else {
+        stl_le_phys(&address_space_memory, pa + off, val);
+    }
+}
+
+/* Like vring_desc_read(), for the packed layout. */
+static void vring_packed_desc_read(VRingPackedDesc *desc, VRingRegion *r,
+                                   hwaddr desc_pa, unsigned int i)
+{
+    if (r && likely(r->host)) {
+        memcpy(desc, r->host + i * sizeof(VRingPackedDesc),
+               sizeof(VRingPackedDesc));
+    } else {
+        address_space_read(&address_space_memory,
+                           desc_pa + i * sizeof(VRingPackedDesc),
+                           (uint8_t *)desc, sizeof(VRingPackedDesc));
+    }
+    desc->addr = le64_to_cpu(desc->addr);
+    desc->len = le32_to_cpu(desc->len);
+    desc->id = le16_to_cpu(desc->id);
+    desc->flags = le16_to_cpu(desc->flags);
+}
+
+static inline uint16_t vring_packed_desc_flags(VirtQueue *vq, unsigned int i)
+{
+    return vring_lduw_le(&vq->desc_region, vq->vring.desc,
+                         i * sizeof(VRingPackedDesc) +
+                         offsetof(VRingPackedDesc, flags));
+}
+
+static inline void vring_packed_desc_set_flags(VirtQueue *vq, unsigned int i,
+                                               uint16_t flags)
+{
+    vring_stw_le(&vq->desc_region, vq->vring.desc,
+                 i * sizeof(VRingPackedDesc) +
+                 offsetof(VRingPackedDesc, flags), flags);
+}
+
+/* Write the used entry for buffer @id into slot @i, all but its flags */
+static void vring_packed_desc_set_used(VirtQueue *vq, unsigned int i,
+                                       uint16_t id, uint32_t len)
+{
+    hwaddr off = i * sizeof(VRingPackedDesc);
+
+    vring_stw_le(&vq->desc_region, vq->vring.desc,
+                 off + offsetof(VRingPackedDesc, id), id);
+    vring_stl_le(&vq->desc_region, vq->vring.desc,
+                 off + offsetof(VRingPackedDesc, len), len);
+}
+
+static inline bool vring_packed_desc_is_avail(uint16_t flags, bool wrap)
+{
+    bool avail = flags & (1 << VRING_PACKED_DESC_F_AVAIL);
+    bool used = flags & (1 << VRING_PACKED_DESC_F_USED);
+
+    return avail != used && avail == wrap;
+}
+
+static inline uint16_t vring_packed_used_flags(bool wrap)
+{
+    return wrap ? (1 << VRING_PACKED_DESC_F_AVAIL) |
+                  (1 << VRING_PACKED_DESC_F_USED) : 0;
+}
+
+/* Tell the driver when to kick us; the device area is ours to write. */
+static void vring_packed_device_event_set(VirtQueue *vq, uint16_t flags)
+{
+    if (flags == VRING_PACKED_EVENT_FLAG_DESC) {
+        vring_stw_le(&vq->used_region, vq->vring.used,
+                     offsetof(VRingPackedDescEvent, off_wrap),
+                     vq->last_avail_idx | vq->last_avail_wrap_counter << 15);
+        /* Expose the offset before the flags that make it valid */
+        smp_wmb();
+    }
+    vring_stw_le(&vq->used_region, vq->vring.used,
+                 offsetof(VRingPackedDescEvent, flags), flags);
 }
 
 static inline uint16_t vring_avail_flags(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, flags);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_lduw(vq->vdev, &vq->avail_region, vq->vring.avail,
+                      offsetof(VRingAvail, flags));
 }
 
 static inline uint16_t vring_avail_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    vq->shadow_avail_idx = vring_lduw(vq->vdev, &vq->avail_region,
+                                      vq->vring.avail,
+                                      offsetof(VRingAvail, idx));
+    return vq->shadow_avail_idx;
 }
 
 static inline uint16_t vring_avail_ring(VirtQueue *vq, int i)
 {
-    hwaddr pa;
-    pa = vq->vring.avail + offsetof(VRingAvail, ring[i]);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_lduw(vq->vdev, &vq->avail_region, vq->vring.avail,
+                      offsetof(VRingAvail, ring[i]));
 }
 
 static inline uint16_t vring_used_event(VirtQueue *vq)
@@ -162,62 +410,68 @@ static inline uint16_t vring_used_event(VirtQueue *vq)
 
 static inline void vring_used_ring_id(VirtQueue *vq, int i, uint32_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].id);
-    virtio_stl_phys(vq->vdev, pa, val);
+    vring_stl(vq->vdev, &vq->used_region, vq->vring.used,
+              offsetof(VRingUsed, ring[i].id), val);
 }
 
 static inline void vring_used_ring_len(VirtQueue *vq, int i, uint32_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, ring[i].len);
-    virtio_stl_phys(vq->vdev, pa, val);
+    vring_stl(vq->vdev, &vq->used_region, vq->vring.used,
+              offsetof(VRingUsed, ring[i].len), val);
 }
 
 static uint16_t vring_used_idx(VirtQueue *vq)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    return virtio_lduw_phys(vq->vdev, pa);
+    return vring_lduw(vq->vdev, &vq->used_region, vq->vring.used,
+                      offsetof(VRingUsed, idx));
 }
 
 static inline void vring_used_idx_set(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, idx);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_stw(vq->vdev, &vq->used_region, vq->vring.used,
+              offsetof(VRingUsed, idx), val);
+    vq->used_idx = val;
 }
 
 static inline void vring_used_flags_set_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) | mask);
+    hwaddr off = offsetof(VRingUsed, flags);
+    uint16_t flags;
+
+    flags = vring_lduw(vq->vdev, &vq->used_region, vq->vring.used, off);
+    vring_stw(vq->vdev, &vq->used_region, vq->vring.used, off, flags | mask);
 }
 
 static inline void vring_used_flags_unset_bit(VirtQueue *vq, int mask)
 {
-    VirtIODevice *vdev = vq->vdev;
-    hwaddr pa;
-    pa = vq->vring.used + offsetof(VRingUsed, flags);
-    virtio_stw_phys(vdev, pa, virtio_lduw_phys(vdev, pa) & ~mask);
+    hwaddr off = offsetof(VRingUsed, flags);
+    uint16_t flags;
+
+    flags = vring_lduw(vq->vdev, &vq->used_region, vq->vring.used, off);
+    vring_stw(vq->vdev, &vq->used_region, vq->vring.used, off, flags & ~mask);
 }
 
 static inline void vring_avail_event(VirtQueue *vq, uint16_t val)
 {
-    hwaddr pa;
     if (!vq->notification) {
         return;
     }
-    pa = vq->vring.used + offsetof(VRingUsed, ring[vq->vring.num]);
-    virtio_stw_phys(vq->vdev, pa, val);
+    vring_stw(vq->vdev, &vq->used_region, vq->vring.used,
+              offsetof(VRingUsed, ring[vq->vring.num]), val);
 }
 
 void virtio_queue_set_notification(VirtQueue *vq, int enable)
 {
     vq->notification = enable;
-    if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+    if (virtio_has_ring_packed(vq->vdev)) {
+        if (!enable) {
+            vring_packed_device_event_set(vq, VRING_PACKED_EVENT_FLAG_DISABLE);
+        } else if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
+            vring_packed_device_event_set(vq, VRING_PACKED_EVENT_FLAG_DESC);
+        } else {
+            vring_packed_device_event_set(vq, VRING_PACKED_EVENT_FLAG_ENABLE);
+        }
+    } else if (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX)) {
         vring_avail_event(vq, vring_avail_idx(vq));
     } else if (enable) {
         vring_used_flags_unset_bit(vq, VRING_USED_F_NO_NOTIFY);
@@ -235,11 +489,61 @@ int virtio_queue_ready(VirtQueue *vq)
     return vq->vring.avail != 0;
 }
 
+static int virtio_queue_packed_empty(VirtQueue *vq)
+{
+    uint16_t flags = vring_packed_desc_flags(vq, vq->last_avail_idx);
+
+    return !vring_packed_desc_is_avail(flags, vq->last_avail_wrap_counter);
+}
+
 int virtio_queue_empty(VirtQueue *vq)
 {
+    if (virtio_has_ring_packed(vq->vdev)) {
+        return virtio_queue_packed_empty(vq);
+    }
+    /* Don't touch the ring while we know of unconsumed entries */
+    if (vq->shadow_avail_idx != vq->last_avail_idx) {
+        return 0;
+    }
     return vring_avail_idx(vq) == vq->last_avail_idx;
 }
 
+/*
+ * Elements of a batch are filled in order.  All but the first are made
+ * visible right away; the driver won't look past the first until
+ * virtqueue_flush() publishes it.
+ */
+static void virtqueue_packed_fill(VirtQueue *vq, const VirtQueueElement *elem,
+                                  unsigned int len, unsigned int idx)
+{
+    unsigned int head;
+    bool wrap = vq->used_wrap_counter;
+    uint16_t flags;
+
+    if (!idx) {
+        vq->fill_ndescs = 0;
+    }
+    head = vq->used_idx + vq->fill_ndescs;
+    if (head >= vq->vring.num) {
+        head -= vq->vring.num;
+        wrap = !wrap;
+    }
+
+    flags = vring_packed_used_flags(wrap);
+    if (elem->in_num) {
+        flags |= VRING_DESC_F_WRITE;
+    }
+
+    vring_packed_desc_set_used(vq, head, elem->index, len);
+    if (idx) {
+        smp_wmb();
+        vring_packed_desc_set_flags(vq, head, flags);
+    } else {
+        vq->fill_head_flags = flags;
+    }
+    vq->fill_ndescs += vq->ndescs[elem->index];
+}
+
 void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                     unsigned int len, unsigned int idx)
 {
@@ -264,20 +568,49 @@ void virtqueue_fill(VirtQueue *vq, const VirtQueueElement *elem,
                                   elem->out_sg[i].iov_len,
                                   0, elem->out_sg[i].iov_len);
 
-    idx = (idx + vring_used_idx(vq)) % vq->vring.num;
+    if (virtio_has_ring_packed(vq->vdev)) {
+        virtqueue_packed_fill(vq, elem, len, idx);
+        return;
+    }
+
+    idx = (idx + vq->used_idx) % vq->vring.num;
 
     /* Get a pointer to the next entry in the used ring. */
     vring_used_ring_id(vq, idx, elem->index);
     vring_used_ring_len(vq, idx, len);
 }
 
+static void virtqueue_packed_flush(VirtQueue *vq, unsigned int count)
+{
+    if (!count) {
+        return;
+    }
+    /* Make sure the rest of the batch is written before its head. */
+    smp_wmb();
+    trace_virtqueue_flush(vq, count);
+    vring_packed_desc_set_flags(vq, vq->used_idx, vq->fill_head_flags);
+    vq->used_idx += vq->fill_ndescs;
+    if (vq->used_idx >= vq->vring.num) {
+        vq->used_idx -= vq->vring.num;
+        vq->used_wrap_counter = !vq->used_wrap_counter;
+        vq->signalled_used_valid = false;
+    }
+    vq->fill_ndescs = 0;
+    vq->inuse -= count;
+}
+
 void virtqueue_flush(VirtQueue *vq, unsigned int count)
 {
     uint16_t old, new;
+
+    if (virtio_has_ring_packed(vq->vdev)) {
+        virtqueue_packed_flush(vq, count);
+        return;
+    }
     /* Make sure buffer is written before we update index. */
     smp_wmb();
     trace_virtqueue_flush(vq, count);
-    old = vring_used_idx(vq);
+    old = vq->used_idx;
     new = old + count;
     vring_used_idx_set(vq, new);
     vq->inuse -= count;
@@ -294,12 +627,21 @@ void virtqueue_push(VirtQueue *vq, const VirtQueueElement *elem,
 
 static int virtqueue_num_heads(VirtQueue *vq, unsigned int idx)
 {
-    uint16_t num_heads = vring_avail_idx(vq) - idx;
+    uint16_t avail_idx, num_heads;
+
+    /* The cached avail_idx is enough as long as it is ahead of us; the
+     * barrier below was issued when it was read. */
+    if (idx != vq->shadow_avail_idx) {
+        avail_idx = vq->shadow_avail_idx;
+    } else {
+        avail_idx = vring_avail_idx(vq);
+    }
+    num_heads = avail_idx - idx;
 
     /* Check it isn't doing very strange things with descriptor numbers. */
     if (num_heads > vq->vring.num) {
         error_report("Guest moved used index from %u to %u",
-                     idx, vring_avail_idx(vq));
+                     idx, avail_idx);
         exit(1);
     }
     /* On success, callers read a descriptor at vq->last_avail_idx.
@@ -328,20 +670,17 @@ static unsigned int virtqueue_get_head(VirtQueue *vq, unsigned int idx)
     return head;
 }
 
-static unsigned virtqueue_next_desc(VirtIODevice *vdev, hwaddr desc_pa,
-                                    unsigned int i, unsigned int max)
+static unsigned virtqueue_next_desc(VRingDesc *desc, unsigned int max)
 {
     unsigned int next;
 
     /* If this descriptor says it doesn't chain, we're done. */
-    if (!(vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_NEXT)) {
+    if (!(desc->flags & VRING_DESC_F_NEXT)) {
         return max;
     }
 
     /* Check they're not leading us off end of descriptors. */
-    next = vring_desc_next(vdev, desc_pa, i);
-    /* Make sure compiler knows to grab that: we don't want it changing! */
-    smp_wmb();
+    next = desc->next;
 
     if (next >= max) {
         error_report("Desc next is %u", next);
@@ -351,6 +690,76 @@ static unsigned virtqueue_next_desc(VirtIODevice *vdev, hwaddr desc_pa,
     return next;
 }
 
+/*
+ * Every slot of a packed chain carries its own avail flag, so the slots
+ * can be added up one at a time until the first one the driver hasn't
+ * made available.
+ */
+static void virtqueue_packed_get_avail_bytes(VirtQueue *vq,
+                                             unsigned int *in_bytes,
+                                             unsigned int *out_bytes,
+                                             unsigned max_in_bytes,
+                                             unsigned max_out_bytes)
+{
+    unsigned int idx = vq->last_avail_idx;
+    bool wrap = vq->last_avail_wrap_counter;
+    unsigned int in_total = 0, out_total = 0, slots = 0;
+    VRingPackedDesc desc;
+
+    while (slots++ < vq->vring.num &&
+           vring_packed_desc_is_avail(vring_packed_desc_flags(vq, idx),
+                                      wrap)) {
+        unsigned int i, max = 1;
+        VRingRegion *desc_region = &vq->desc_region;
+        hwaddr desc_pa = vq->vring.desc;
+
+        /* Read the descriptor only after seeing its avail flag. */
+        smp_rmb();
+        i = idx;
+        vring_packed_desc_read(&desc, desc_region, desc_pa, i);
+
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.len % sizeof(VRingPackedDesc)) {
+                error_report("Invalid size for indirect buffer table");
+                exit(1);
+            }
+            max = desc.len / sizeof(VRingPackedDesc);
+            desc_pa = desc.addr;
+            desc_region = NULL;
+            i = 0;
+            if (max) {
+                vring_packed_desc_read(&desc, desc_region, desc_pa, i);
+            }
+        }
+
+        while (max--) {
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
+            } else {
+                out_total += desc.len;
+            }
+            if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
+                goto done;
+            }
+            if (max) {
+                vring_packed_desc_read(&desc, desc_region, desc_pa, ++i);
+            }
+        }
+
+        if (++idx == vq->vring.num) {
+            idx = 0;
+            wrap = !wrap;
+        }
+    }
+done:
+    if (in_bytes) {
+        *in_bytes = in_total;
+    }
+    if (out_bytes) {
+        *out_bytes = out_total;
+    }
+}
+
 void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                                unsigned int *out_bytes,
                                unsigned max_in_bytes, unsigned max_out_bytes)
@@ -358,12 +767,20 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
     unsigned int idx;
     unsigned int total_bufs, in_total, out_total;
 
+    if (virtio_has_ring_packed(vq->vdev)) {
+        virtqueue_packed_get_avail_bytes(vq, in_bytes, out_bytes,
+                                         max_in_bytes, max_out_bytes);
+        return;
+    }
+
     idx = vq->last_avail_idx;
 
     total_bufs = in_total = out_total = 0;
     while (virtqueue_num_heads(vq, idx)) {
         VirtIODevice *vdev = vq->vdev;
         unsigned int max, num_bufs, indirect = 0;
+        VRingRegion *desc_region;
+        VRingDesc desc;
         hwaddr desc_pa;
         int i;
 
@@ -371,9 +788,11 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
         num_bufs = total_bufs;
         i = virtqueue_get_head(vq, idx++);
         desc_pa = vq->vring.desc;
+        desc_region = &vq->desc_region;
+        vring_desc_read(vdev, &desc, desc_region, desc_pa, i);
 
-        if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_INDIRECT) {
-            if (vring_desc_len(vdev, desc_pa, i) % sizeof(VRingDesc)) {
+        if (desc.flags & VRING_DESC_F_INDIRECT) {
+            if (desc.len % sizeof(VRingDesc)) {
                 error_report("Invalid size for indirect buffer table");
                 exit(1);
             }
@@ -386,9 +805,11 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
 
             /* loop over the indirect descriptor table */
             indirect = 1;
-            max = vring_desc_len(vdev, desc_pa, i) / sizeof(VRingDesc);
-            desc_pa = vring_desc_addr(vdev, desc_pa, i);
+            max = desc.len / sizeof(VRingDesc);
+            desc_pa = desc.addr;
+            desc_region = NULL;
             num_bufs = i = 0;
+            vring_desc_read(vdev, &desc, desc_region, desc_pa, i);
         }
 
         do {
@@ -398,15 +819,20 @@ void virtqueue_get_avail_bytes(VirtQueue *vq, unsigned int *in_bytes,
                 exit(1);
             }
 
-            if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_WRITE) {
-                in_total += vring_desc_len(vdev, desc_pa, i);
+            if (desc.flags & VRING_DESC_F_WRITE) {
+                in_total += desc.len;
             } else {
-                out_total += vring_desc_len(vdev, desc_pa, i);
+                out_total += desc.len;
             }
             if (in_total >= max_in_bytes && out_total >= max_out_bytes) {
                 goto done;
             }
-        } while ((i = virtqueue_next_desc(vdev, desc_pa, i, max)) != max);
+
+            i = virtqueue_next_desc(&desc, max);
+            if (i != max) {
+                vring_desc_read(vdev, &desc, desc_region, desc_pa, i);
+            }
+        } while (i != max);
 
         if (!indirect)
             total_bufs = num_bufs;
@@ -453,11 +879,135 @@ void virtqueue_map_sg(struct iovec *sg, hwaddr *addr,
     }
 }
 
+static void virtqueue_elem_add(VirtQueueElement *elem, hwaddr addr,
+                               uint32_t len, bool is_write)
+{
+    struct iovec *sg;
+
+    if (is_write) {
+        if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
+            error_report("Too many write descriptors in indirect table");
+            exit(1);
+        }
+        elem->in_addr[elem->in_num] = addr;
+        sg = &elem->in_sg[elem->in_num++];
+    } else {
+        if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
+            error_report("Too many read descriptors in indirect table");
+            exit(1);
+        }
+        elem->out_addr[elem->out_num] = addr;
+        sg = &elem->out_sg[elem->out_num++];
+    }
+
+    sg->iov_len = len;
+}
+
+static int virtqueue_packed_pop(VirtQueue *vq, VirtQueueElement *elem)
+{
+    unsigned int i, max, ndescs;
+    hwaddr desc_pa = vq->vring.desc;
+    VRingRegion *desc_region = &vq->desc_region;
+    VRingPackedDesc desc;
+    bool indirect = false;
+    uint16_t id;
+
+    if (virtio_queue_packed_empty(vq)) {
+        return 0;
+    }
+    /* Read the descriptor only after seeing its avail flag. */
+    smp_rmb();
+
+    /* When we start there are none of either input nor output. */
+    elem->out_num = elem->in_num = 0;
+
+    max = vq->vring.num;
+
+    i = vq->last_avail_idx;
+    vring_packed_desc_read(&desc, desc_region, desc_pa, i);
+    id = desc.id;
+    if (id >= vq->vring.num) {
+        error_report("Guest says buffer id %u is available", id);
+        exit(1);
+    }
+
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (!desc.len || desc.len % sizeof(VRingPackedDesc)) {
+            error_report("Invalid size for indirect buffer table");
+            exit(1);
+        }
+
+        /* the table is read in order, it doesn't chain */
+        indirect = true;
+        max = desc.len / sizeof(VRingPackedDesc);
+        desc_pa = desc.addr;
+        desc_region = NULL;
+        i = 0;
+        vring_packed_desc_read(&desc, desc_region, desc_pa, i);
+    }
+
+    /* Collect all the descriptors */
+    for (;;) {
+        virtqueue_elem_add(elem, desc.addr, desc.len,
+                           desc.flags & VRING_DESC_F_WRITE);
+
+        /* If we've got too many, that implies a descriptor loop. */
+        if ((elem->in_num + elem->out_num) > max) {
+            error_report("Looped descriptor");
+            exit(1);
+        }
+
+        if (indirect) {
+            if (++i == max) {
+                break;
+            }
+        } else {
+            /* a chain takes consecutive slots of the ring */
+            if (!(desc.flags & VRING_DESC_F_NEXT)) {
+                break;
+            }
+            if (++i == max) {
+                i = 0;
+            }
+        }
+        vring_packed_desc_read(&desc, desc_region, desc_pa, i);
+    }
+
+    /* Now map what we have collected */
+    virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
+    virtqueue_map_sg(elem->out_sg, elem->out_addr, elem->out_num, 0);
+
+    elem->index = id;
+
+    ndescs = indirect ? 1 : elem->in_num + elem->out_num;
+    vq->ndescs[id] = ndescs;
+    vq->last_avail_idx += ndescs;
+    if (vq->last_avail_idx >= vq->vring.num) {
+        vq->last_avail_idx -= vq->vring.num;
+        vq->last_avail_wrap_counter = !vq->last_avail_wrap_counter;
+    }
+    if (vq->notification &&
+        (vq->vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+        vring_packed_device_event_set(vq, VRING_PACKED_EVENT_FLAG_DESC);
+    }
+
+    vq->inuse++;
+
+    trace_virtqueue_pop(vq, elem, elem->in_num, elem->out_num);
+    return elem->in_num + elem->out_num;
+}
+
 int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
 {
     unsigned int i, head, max;
     hwaddr desc_pa = vq->vring.desc;
+    VRingRegion *desc_region = &vq->desc_region;
     VirtIODevice *vdev = vq->vdev;
+    VRingDesc desc;
+
+    if (virtio_has_ring_packed(vdev)) {
+        return virtqueue_packed_pop(vq, elem);
+    }
 
     if (!virtqueue_num_heads(vq, vq->last_avail_idx))
         return 0;
@@ -472,46 +1022,37 @@ int virtqueue_pop(VirtQueue *vq, VirtQueueElement *elem)
         vring_avail_event(vq, vq->last_avail_idx);
     }
 
-    if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_INDIRECT) {
-        if (vring_desc_len(vdev, desc_pa, i) % sizeof(VRingDesc)) {
+    vring_desc_read(vdev, &desc, desc_region, desc_pa, i);
+    if (desc.flags & VRING_DESC_F_INDIRECT) {
+        if (desc.len % sizeof(VRingDesc)) {
             error_report("Invalid size for indirect buffer table");
             exit(1);
         }
 
         /* loop over the indirect descriptor table */
-        max = vring_desc_len(vdev, desc_pa, i) / sizeof(VRingDesc);
-        desc_pa = vring_desc_addr(vdev, desc_pa, i);
+        max = desc.len / sizeof(VRingDesc);
+        desc_pa = desc.addr;
+        desc_region = NULL;
         i = 0;
+        vring_desc_read(vdev, &desc, desc_region, desc_pa, i);
     }
 
     /* Collect all the descriptors */
     do {
-        struct iovec *sg;
-
-        if (vring_desc_flags(vdev, desc_pa, i) & VRING_DESC_F_WRITE) {
-            if (elem->in_num >= ARRAY_SIZE(elem->in_sg)) {
-                error_report("Too many write descriptors in indirect table");
-                exit(1);
-            }
-            elem->in_addr[elem->in_num] = vring_desc_addr(vdev, desc_pa, i);
-            sg = &elem->in_sg[elem->in_num++];
-        } else {
-            if (elem->out_num >= ARRAY_SIZE(elem->out_sg)) {
-                error_report("Too many read descriptors in indirect table");
-                exit(1);
-            }
-            elem->out_addr[elem->out_num] = vring_desc_addr(vdev, desc_pa, i);
-            sg = &elem->out_sg[elem->out_num++];
-        }
-
-        sg->iov_len = vring_desc_len(vdev, desc_pa, i);
+        virtqueue_elem_add(elem, desc.addr, desc.len,
+                           desc.flags & VRING_DESC_F_WRITE);
 
         /* If we've got too many, that implies a descriptor loop. */
         if ((elem->in_num + elem->out_num) > max) {
             error_report("Looped descriptor");
             exit(1);
         }
-    } while ((i = virtqueue_next_desc(vdev, desc_pa, i, max)) != max);
+
+        i = virtqueue_next_desc(&desc, max);
+        if (i != max) {
+            vring_desc_read(vdev, &desc, desc_region, desc_pa, i);
+        }
+    } while (i != max);
 
     /* Now map what we have collected */
     virtqueue_map_sg(elem->in_sg, elem->in_addr, elem->in_num, 1);
@@ -593,6 +1134,7 @@ void virtio_reset(void *opaque)
     }
 
     vdev->guest_features = 0;
+    vdev->guest_features_hi = 0;
     vdev->queue_sel = 0;
     vdev->status = 0;
     vdev->isr = 0;
@@ -603,12 +1145,18 @@ void virtio_reset(void *opaque)
         vdev->vq[i].vring.desc = 0;
         vdev->vq[i].vring.avail = 0;
         vdev->vq[i].vring.used = 0;
+        virtqueue_release_regions(&vdev->vq[i]);
         vdev->vq[i].last_avail_idx = 0;
+        vdev->vq[i].shadow_avail_idx = 0;
+        vdev->vq[i].used_idx = 0;
         vdev->vq[i].pa = 0;
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].signalled_used = 0;
         vdev->vq[i].signalled_used_valid = false;
         vdev->vq[i].notification = true;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
+        vdev->vq[i].fill_ndescs = 0;
     }
 }
 
@@ -799,6 +1347,7 @@ VirtQueue *virtio_add_queue(VirtIODevice *vdev, int queue_size,
     vdev->vq[i].vring.num = queue_size;
     vdev->vq[i].vring.align = VIRTIO_PCI_VRING_ALIGN;
     vdev->vq[i].handle_output = handle_output;
+    vdev->vq[i].ndescs = g_new0(uint16_t, VIRTQUEUE_MAX_SIZE);
 
     return &vdev->vq[i];
 }
@@ -810,6 +1359,9 @@ void virtio_del_queue(VirtIODevice *vdev, int n)
     }
 
     vdev->vq[n].vring.num = 0;
+    virtqueue_release_regions(&vdev->vq[n]);
+    g_free(vdev->vq[n].ndescs);
+    vdev->vq[n].ndescs = NULL;
 }
 
 void virtio_irq(VirtQueue *vq)
@@ -832,10 +1384,61 @@ static inline int vring_need_event(uint16_t event, uint16_t new, uint16_t old)
 	return (uint16_t)(new - event - 1) < (uint16_t)(new - old);
 }
 
+/* The event offset is relative to the wrap of the used index. */
+static bool vring_packed_need_event(VirtQueue *vq, uint16_t off_wrap,
+                                    uint16_t new, uint16_t old)
+{
+    int off = off_wrap & ~(1 << 15);
+
+    if (vq->used_wrap_counter != off_wrap >> 15) {
+        off -= vq->vring.num;
+    }
+    return vring_need_event(off, new, old);
+}
+
+static bool vring_packed_notify(VirtIODevice *vdev, VirtQueue *vq)
+{
+    uint16_t old, new, off_wrap, flags;
+    bool v;
+
+    /* We need to expose used entries before checking the driver event. */
+    smp_mb();
+    if ((vdev->guest_features & (1 << VIRTIO_F_NOTIFY_ON_EMPTY)) &&
+        !vq->inuse && virtio_queue_packed_empty(vq)) {
+        return true;
+    }
+
+    off_wrap = vring_lduw_le(&vq->avail_region, vq->vring.avail,
+                             offsetof(VRingPackedDescEvent, off_wrap));
+    /* The flags validate the offset, read them last. */
+    smp_rmb();
+    flags = vring_lduw_le(&vq->avail_region, vq->vring.avail,
+                          offsetof(VRingPackedDescEvent, flags));
+
+    v = vq->signalled_used_valid;
+    vq->signalled_used_valid = true;
+    old = vq->signalled_used;
+    new = vq->signalled_used = vq->used_idx;
+
+    if (flags == VRING_PACKED_EVENT_FLAG_DISABLE) {
+        return false;
+    }
+    if (flags != VRING_PACKED_EVENT_FLAG_DESC ||
+        !(vdev->guest_features & (1 << VIRTIO_RING_F_EVENT_IDX))) {
+        return true;
+    }
+    return !v || vring_packed_need_event(vq, off_wrap, new, old);
+}
+
 static bool vring_notify(VirtIODevice *vdev, VirtQueue *vq)
 {
     uint16_t old, new;
     bool v;
+
+    if (virtio_has_ring_packed(vdev)) {
+        return vring_packed_notify(vdev, vq);
+    }
+
     /* We need to expose used array entries before checking used event. */
     smp_mb();
     /* Always notify when queue is empty (when feature acknowledge) */
@@ -851,7 +1454,7 @@ static bool vring_notify(VirtIODevice *vdev, VirtQueue *vq)
     v = vq->signalled_used_valid;
     vq->signalled_used_valid = true;
     old = vq->signalled_used;
-    new = vq->signalled_used = vring_used_idx(vq);
+    new = vq->signalled_used = vq->used_idx;
     return !v || vring_need_event(vring_used_event(vq), new, old);
 }
 
@@ -893,6 +1496,71 @@ static const VMStateDescription vmstate_virtio_device_endian = {
     }
 };
 
+static bool virtio_64bit_features_needed(void *opaque)
+{
+    VirtIODevice *vdev = opaque;
+
+    return vdev->guest_features_hi != 0;
+}
+
+static int virtio_64bit_features_post_load(void *opaque, int version_id)
+{
+    VirtIODevice *vdev = opaque;
+
+    if (vdev->guest_features_hi & ~vdev->host_features_hi) {
+        error_report("Features 0x%x (bits 32-63) unsupported. "
+                     "Allowed features: 0x%x",
+                     vdev->guest_features_hi, vdev->host_features_hi);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+static const VMStateDescription vmstate_virtio_64bit_features = {
+    .name = "virtio/64bit_features",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .post_load = virtio_64bit_features_post_load,
+    .fields = (VMStateField[]) {
+        VMSTATE_UINT32(guest_features_hi, VirtIODevice),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static bool virtio_packed_virtqueues_needed(void *opaque)
+{
+    return virtio_has_ring_packed(opaque);
+}
+
+/* last_avail_idx is in the main section; used_idx can't be read back */
+static const VMStateDescription vmstate_packed_virtqueue = {
+    .name = "packed_virtqueue_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_BOOL(last_avail_wrap_counter, VirtQueue),
+        VMSTATE_UINT16(used_idx, VirtQueue),
+        VMSTATE_BOOL(used_wrap_counter, VirtQueue),
+        VMSTATE_INT32(inuse, VirtQueue),
+        VMSTATE_VARRAY_UINT32(ndescs, VirtQueue, vring.num, 0,
+                              vmstate_info_uint16, uint16_t),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
+static const VMStateDescription vmstate_virtio_packed_virtqueues = {
+    .name = "virtio/packed_virtqueues",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .fields = (VMStateField[]) {
+        VMSTATE_STRUCT_VARRAY_POINTER_KNOWN(vq, VirtIODevice,
+                                            VIRTIO_PCI_QUEUE_MAX, 0,
+                                            vmstate_packed_virtqueue,
+                                            VirtQueue),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_virtio = {
     .name = "virtio",
     .version_id = 1,
@@ -905,6 +1573,12 @@ static const VMStateDescription vmstate_virtio = {
         {
             .vmsd = &vmstate_virtio_device_endian,
             .needed = &virtio_device_endian_needed
+        }, {
+            .vmsd = &vmstate_virtio_64bit_features,
+            .needed = &virtio_64bit_features_needed
+        }, {
+            .vmsd = &vmstate_virtio_packed_virtqueues,
+            .needed = &virtio_packed_virtqueues_needed
         },
         { 0 }
     }
@@ -974,6 +1648,25 @@ int virtio_set_features(VirtIODevice *vdev, uint32_t val)
     return bad ? -1 : 0;
 }
 
+/* Feature bits 32-63, from transports that can select them */
+int virtio_set_features_hi(VirtIODevice *vdev, uint32_t val)
+{
+    bool bad = (val & ~vdev->host_features_hi) != 0;
+    bool packed = virtio_has_ring_packed(vdev);
+    int i;
+
+    vdev->guest_features_hi = val & vdev->host_features_hi;
+    if (virtio_has_ring_packed(vdev) != packed) {
+        /* The ring layout changed under queues that are already set up */
+        for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+            if (vdev->vq[i].pa) {
+                virtqueue_init(&vdev->vq[i]);
+            }
+        }
+    }
+    return bad ? -1 : 0;
+}
+
 int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
 {
     int i, ret;
@@ -1077,7 +1770,19 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
     }
 
     for (i = 0; i < num; i++) {
-        if (vdev->vq[i].pa) {
+        if (vdev->vq[i].pa && virtio_has_ring_packed(vdev)) {
+            /* The queues were laid out before the features were known */
+            virtqueue_init(&vdev->vq[i]);
+            vdev->vq[i].shadow_avail_idx = vdev->vq[i].last_avail_idx;
+            if (vdev->vq[i].last_avail_idx >= vdev->vq[i].vring.num ||
+                vdev->vq[i].used_idx >= vdev->vq[i].vring.num) {
+                error_report("VQ %d size 0x%x inconsistent with packed "
+                             "indexes 0x%x/0x%x", i, vdev->vq[i].vring.num,
+                             vdev->vq[i].last_avail_idx,
+                             vdev->vq[i].used_idx);
+                return -1;
+            }
+        } else if (vdev->vq[i].pa) {
             uint16_t nheads;
             nheads = vring_avail_idx(&vdev->vq[i]) - vdev->vq[i].last_avail_idx;
             /* Check it isn't doing strange things with descriptor numbers. */
@@ -1089,6 +1794,7 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
                              vdev->vq[i].last_avail_idx, nheads);
                 return -1;
             }
+            vdev->vq[i].used_idx = vring_used_idx(&vdev->vq[i]);
         }
     }
 
@@ -1097,7 +1803,12 @@ int virtio_load(VirtIODevice *vdev, QEMUFile *f, int version_id)
 
 void virtio_cleanup(VirtIODevice *vdev)
 {
+    int i;
+
     qemu_del_vm_change_state_handler(vdev->vmstate);
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        g_free(vdev->vq[i].ndescs);
+    }
     g_free(vdev->config);
     g_free(vdev->vq);
 }
@@ -1134,6 +1845,21 @@ void virtio_instance_init_common(Object *proxy_obj, void *data,
     qdev_alias_all_properties(vdev, proxy_obj);
 }
 
+size_t virtio_feature_get_config_size(VirtIOFeature *feature_sizes,
+                                      uint32_t host_features)
+{
+    size_t config_size = 0;
+    int i;
+
+    for (i = 0; feature_sizes[i].flags != 0; i++) {
+        if (host_features & feature_sizes[i].flags) {
+            config_size = MAX(feature_sizes[i].end, config_size);
+        }
+    }
+
+    return config_size;
+}
+
 void virtio_init(VirtIODevice *vdev, const char *name,
                  uint16_t device_id, size_t config_size)
 {
@@ -1149,6 +1875,8 @@ void virtio_init(VirtIODevice *vdev, const char *name,
         vdev->vq[i].vector = VIRTIO_NO_VECTOR;
         vdev->vq[i].vdev = vdev;
         vdev->vq[i].queue_index = i;
+        vdev->vq[i].last_avail_wrap_counter = true;
+        vdev->vq[i].used_wrap_counter = true;
     }
 
     vdev->name = name;
@@ -1213,7 +1941,30 @@ uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n)
 
 void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx)
 {
-    vdev->vq[n].last_avail_idx = idx;
+    VirtQueue *vq = &vdev->vq[n];
+
+    /* Whoever owned the ring may have moved the indexes; reload them */
+    vq->last_avail_idx = idx;
+    vq->shadow_avail_idx = idx;
+    if (vq->vring.desc) {
+        vq->used_idx = vring_used_idx(vq);
+    }
+}
+
+/*
+ * The backend that owned the ring went away without handing back its
+ * position.  Requests it consumed but never completed are lost; resume
+ * from the last completed one so the guest sees them again.
+ */
+void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n)
+{
+    VirtQueue *vq = &vdev->vq[n];
+
+    if (vq->vring.desc) {
+        vq->used_idx = vring_used_idx(vq);
+        vq->last_avail_idx = vq->used_idx;
+        vq->shadow_avail_idx = vq->used_idx;
+    }
 }
 
 void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n)
@@ -1295,6 +2046,19 @@ void virtio_device_set_child_bus_name(VirtIODevice *vdev, char *bus_name)
     vdev->bus_name = g_strdup(bus_name);
 }
 
+/* Guest memory may have moved under the rings, map them again */
+static void virtio_memory_listener_commit(MemoryListener *listener)
+{
+    VirtIODevice *vdev = container_of(listener, VirtIODevice, listener);
+    int i;
+
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        if (vdev->vq[i].vring.desc) {
+            virtqueue_update_regions(&vdev->vq[i]);
+        }
+    }
+}
+
 static void virtio_device_realize(DeviceState *dev, Error **errp)
 {
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
@@ -1309,6 +2073,9 @@ static void virtio_device_realize(DeviceState *dev, Error **errp)
         }
     }
     virtio_bus_device_plugged(vdev);
+
+    vdev->listener.commit = virtio_memory_listener_commit;
+    memory_listener_register(&vdev->listener, &address_space_memory);
 }
 
 static void virtio_device_unrealize(DeviceState *dev, Error **errp)
@@ -1316,6 +2083,12 @@ static void virtio_device_unrealize(DeviceState *dev, Error **errp)
     VirtIODevice *vdev = VIRTIO_DEVICE(dev);
     VirtioDeviceClass *vdc = VIRTIO_DEVICE_GET_CLASS(dev);
     Error *err = NULL;
+    int i;
+
+    memory_listener_unregister(&vdev->listener);
+    for (i = 0; i < VIRTIO_PCI_QUEUE_MAX; i++) {
+        virtqueue_release_regions(&vdev->vq[i]);
+    }
 
     virtio_bus_device_unplugged(vdev);
 
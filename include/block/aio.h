@@ -90,6 +90,15 @@ struct AioContext {
 
     /* TimerLists for calling timers - one per clock type */
     QEMUTimerListGroup tlg;
+
+#ifdef CONFIG_EPOLL_CREATE1
+    /* epoll(7) state used when the AioContext has many file descriptors;
+     * only accessed from aio_poll and aio_set_fd_handler.
+     */
+    int epollfd;
+    bool epoll_enabled;
+    bool epoll_available;
+#endif
 };
 
 /* Used internally to synchronize aio_poll against qemu_bh_schedule.  */
@@ -104,6 +113,17 @@ void aio_set_dispatching(AioContext *ctx, bool dispatching);
  */
 AioContext *aio_context_new(Error **errp);
 
+/**
+ * aio_context_setup:
+ * @ctx: the aio context
+ *
+ * Initialize the backend-specific state of the aio context.  Called
+ * by aio_context_new; aio_context_destroy releases it when the context
+ * is finalized.
+ */
+void aio_context_setup(AioContext *ctx);
+void aio_context_destroy(AioContext *ctx);
+
 /**
  * aio_context_ref:
  * @ctx: The AioContext to operate on.
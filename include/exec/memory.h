@@ -158,12 +158,15 @@ struct MemoryRegion {
     bool rom_device;
     bool warning_printed; /* For reservations */
     bool flush_coalesced_mmio;
+    bool global_locking;
     MemoryRegion *alias;
     hwaddr alias_offset;
     int32_t priority;
     bool may_overlap;
     QTAILQ_HEAD(subregions, MemoryRegion) subregions;
     QTAILQ_ENTRY(MemoryRegion) subregions_link;
+    QTAILQ_HEAD(aliases, MemoryRegion) aliases;
+    QTAILQ_ENTRY(MemoryRegion) aliases_link;
     QTAILQ_HEAD(coalesced_ranges, CoalescedMemoryRange) coalesced;
     const char *name;
     uint8_t dirty_log_mask;
@@ -187,6 +190,7 @@ struct MemoryListener {
     void (*log_start)(MemoryListener *listener, MemoryRegionSection *section);
     void (*log_stop)(MemoryListener *listener, MemoryRegionSection *section);
     void (*log_sync)(MemoryListener *listener, MemoryRegionSection *section);
+    void (*log_clear)(MemoryListener *listener, MemoryRegionSection *section);
     void (*log_global_start)(MemoryListener *listener);
     void (*log_global_stop)(MemoryListener *listener);
     void (*eventfd_add)(MemoryListener *listener, MemoryRegionSection *section,
@@ -215,6 +219,11 @@ struct AddressSpace {
     /* Accessed via RCU.  */
     struct FlatView *current_map;
 
+    /* Parts of current_map that the pending transaction may change.  */
+    struct AddrRange *dirty_ranges;
+    unsigned dirty_nb;
+    bool dirty_all;
+
     int ioeventfd_nb;
     struct MemoryRegionIoeventfd *ioeventfds;
     struct AddressSpaceDispatch *dispatch;
@@ -594,6 +603,15 @@ bool memory_region_is_rom(MemoryRegion *mr);
  */
 int memory_region_get_fd(MemoryRegion *mr);
 
+/**
+ * memory_region_is_shared: check whether a RAM memory region is mapped shared
+ *
+ * Returns %true if the RAM backing the region was allocated with share=on.
+ *
+ * @mr: the RAM or alias memory region being queried.
+ */
+bool memory_region_is_shared(MemoryRegion *mr);
+
 /**
  * memory_region_get_ram_ptr: Get a pointer into a RAM memory region.
  *
@@ -675,6 +693,23 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
  */
 void memory_region_sync_dirty_bitmap(MemoryRegion *mr);
 
+/**
+ * memory_region_clear_dirty_bitmap: Re-arm dirty tracking in accelerators
+ *                                   (e.g. kvm) for a range of a region.
+ *
+ * Accelerators that hand out their dirty log without write-protecting the
+ * reported pages keep reporting them until told otherwise.  Callers that
+ * have consumed the dirty information for a range, and are about to read
+ * it, use this to restart tracking for that range only.  Listeners may
+ * round the range out to their own granularity.
+ *
+ * @mr: the region being cleared.
+ * @start: the start of the range, relative to the start of the region.
+ * @len: the length of the range.
+ */
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len);
+
 /**
  * memory_region_reset_dirty: Mark a range of pages as clean, for a specified
  *                            client.
@@ -777,6 +812,32 @@ void memory_region_set_flush_coalesced(MemoryRegion *mr);
  */
 void memory_region_clear_flush_coalesced(MemoryRegion *mr);
 
+/**
+ * memory_region_set_global_locking: Declares the access processing requires
+ *                                   QEMU's global lock.
+ *
+ * When this is invoked, accesses to the memory region will be processed while
+ * holding the global lock of QEMU.  This is the default behavior of memory
+ * regions.
+ *
+ * @mr: the memory region to be updated.
+ */
+void memory_region_set_global_locking(MemoryRegion *mr);
+
+/**
+ * memory_region_clear_global_locking: Declares that access processing does
+ *                                     not depend on the QEMU global lock.
+ *
+ * By clearing this property, accesses to the memory region will be processed
+ * outside of QEMU's global lock (unless the lock is held on when issuing the
+ * access request).  In this case, the device model implementing the access
+ * handlers is responsible for synchronization of concurrency.  Regions that
+ * flush coalesced MMIO before accesses still take the global lock.
+ *
+ * @mr: the memory region to be updated.
+ */
+void memory_region_clear_global_locking(MemoryRegion *mr);
+
 /**
  * memory_region_add_eventfd: Request an eventfd to be triggered when a word
  *                            is written to a location.
@@ -34,6 +34,10 @@ ram_addr_t qemu_ram_alloc_resizeable(ram_addr_t size, ram_addr_t max_size,
                                                      void *host),
                                      MemoryRegion *mr, Error **errp);
 int qemu_get_ram_fd(ram_addr_t addr);
+bool qemu_ram_is_shared(RAMBlock *rb);
+bool qemu_ram_addr_is_shared(ram_addr_t addr);
+int qemu_ram_map_file(RAMBlock *rb, ram_addr_t start, ram_addr_t length,
+                      int fd, int64_t offset);
 void *qemu_get_ram_block_host_ptr(ram_addr_t addr);
 void *qemu_get_ram_ptr(ram_addr_t addr);
 void qemu_ram_free(ram_addr_t addr);
@@ -54,6 +54,10 @@ void vring_disable_notification(VirtIODevice *vdev, Vring *vring);
 bool vring_enable_notification(VirtIODevice *vdev, Vring *vring);
 bool vring_should_notify(VirtIODevice *vdev, Vring *vring);
 int vring_pop(VirtIODevice *vdev, Vring *vring, VirtQueueElement *elem);
+void vring_fill(Vring *vring, VirtQueueElement *elem, int len,
+                unsigned int idx);
+void vring_flush(Vring *vring, unsigned int count);
+void vring_unpop(Vring *vring, VirtQueueElement *elem, unsigned int count);
 void vring_push(Vring *vring, VirtQueueElement *elem, int len);
 
 #endif /* VRING_H */
@@ -40,6 +40,7 @@
 #define VIRTIO_BLK_F_WCE        9       /* write cache enabled */
 #define VIRTIO_BLK_F_TOPOLOGY   10      /* Topology information is available */
 #define VIRTIO_BLK_F_CONFIG_WCE 11      /* write cache configurable */
+#define VIRTIO_BLK_F_MQ         12      /* support more than one vq */
 
 #define VIRTIO_BLK_ID_BYTES     20      /* ID string length */
 
@@ -57,6 +58,8 @@ struct virtio_blk_config
     uint16_t min_io_size;
     uint32_t opt_io_size;
     uint8_t wce;
+    uint8_t unused;
+    uint16_t num_queues;
 } QEMU_PACKED;
 
 /* These two define direction. */
@@ -114,6 +117,9 @@ struct VirtIOBlkConf
     uint32_t config_wce;
     uint32_t data_plane;
     uint32_t request_merging;
+    uint16_t num_queues;
+    uint32_t coalesce_usecs;
+    uint32_t coalesce_max_completions;
 };
 
 struct VirtIOBlockDataPlane;
@@ -122,10 +128,10 @@ struct VirtIOBlockReq;
 typedef struct VirtIOBlock {
     VirtIODevice parent_obj;
     BlockBackend *blk;
-    VirtQueue *vq;
     void *rq;
     QEMUBH *bh;
     VirtIOBlkConf conf;
+    size_t config_size;
     unsigned short sector_mask;
     bool original_wce;
     VMChangeStateEntry *change;
@@ -133,11 +139,19 @@ typedef struct VirtIOBlock {
     void (*complete_request)(struct VirtIOBlockReq *req, unsigned char status);
     Notifier migration_state_notifier;
     struct VirtIOBlockDataPlane *dataplane;
+
+    /* Completion batching, see virtio_blk_complete_request() */
+    QEMUBH *batch_bh;
+    QEMUTimer *coalesce_timer;
+    uint16_t *batch_pending;        /* filled but not flushed, per vq */
+    unsigned long *batch_notify;    /* vqs flushed but not yet notified */
+    unsigned coalesced;             /* completions since last notify */
 } VirtIOBlock;
 
 typedef struct VirtIOBlockReq {
     int64_t sector_num;
     VirtIOBlock *dev;
+    VirtQueue *vq;
     VirtQueueElement elem;
     struct virtio_blk_inhdr *in;
     struct virtio_blk_outhdr out;
@@ -155,7 +169,7 @@ typedef struct MultiReqBuffer {
     bool is_write;
 } MultiReqBuffer;
 
-VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s);
+VirtIOBlockReq *virtio_blk_alloc_request(VirtIOBlock *s, VirtQueue *vq);
 
 void virtio_blk_free_request(VirtIOBlockReq *req);
 
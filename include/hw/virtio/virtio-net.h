@@ -16,6 +16,7 @@
 
 #include "hw/virtio/virtio.h"
 #include "hw/pci/pci.h"
+#include "sysemu/iothread.h"
 
 #define TYPE_VIRTIO_NET "virtio-net-device"
 #define VIRTIO_NET(obj) \
@@ -67,11 +68,21 @@
  * and latency. */
 #define TX_BURST 256
 
+/* Received packets are written to the rx ring as they arrive, but the used
+ * index is published and the guest notified only once per main loop pass,
+ * or as soon as this many packets have been filled in.  A value of 1 gives
+ * back the old behaviour of one notification per packet. */
+#define RX_BURST 64
+
 typedef struct virtio_net_conf
 {
     uint32_t txtimer;
     int32_t txburst;
+    int32_t rxburst;
     char *tx;
+    IOThread *iothread;
+    uint32_t data_plane;
+    uint32_t gro;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
@@ -148,6 +159,8 @@ typedef struct VirtIONetQueue {
     VirtQueue *tx_vq;
     QEMUTimer *tx_timer;
     QEMUBH *tx_bh;
+    QEMUBH *rx_bh;
+    unsigned rx_pending;
     int tx_waiting;
     struct {
         VirtQueueElement elem;
@@ -165,6 +178,7 @@ typedef struct VirtIONet {
     NICState *nic;
     uint32_t tx_timeout;
     int32_t tx_burst;
+    int32_t rx_burst;
     uint32_t has_vnet_hdr;
     size_t host_hdr_len;
     size_t guest_hdr_len;
@@ -197,6 +211,10 @@ typedef struct VirtIONet {
     uint64_t curr_guest_offloads;
     QEMUTimer *announce_timer;
     int announce_counter;
+    struct VirtIONetDataPlane *dataplane;
+    uint8_t dataplane_started;
+    bool dataplane_disabled;            /* during live migration */
+    Notifier migration_state_notifier;
 } VirtIONet;
 
 #define VIRTIO_NET_CTRL_MAC    1
@@ -284,6 +302,7 @@ struct virtio_net_ctrl_mq {
 #define DEFINE_VIRTIO_NET_PROPERTIES(_state, _field)                           \
     DEFINE_PROP_UINT32("x-txtimer", _state, _field.txtimer, TX_TIMER_INTERVAL),\
     DEFINE_PROP_INT32("x-txburst", _state, _field.txburst, TX_BURST),          \
+    DEFINE_PROP_INT32("x-rxburst", _state, _field.rxburst, RX_BURST),          \
     DEFINE_PROP_STRING("tx", _state, _field.tx)
 
 void virtio_net_set_config_size(VirtIONet *n, uint32_t host_features);
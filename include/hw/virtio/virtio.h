@@ -15,6 +15,7 @@
 #define _QEMU_VIRTIO_H
 
 #include "hw/hw.h"
+#include "exec/memory.h"
 #include "net/net.h"
 #include "hw/qdev.h"
 #include "sysemu/sysemu.h"
@@ -55,6 +56,11 @@
 /* A guest should never accept this.  It implies negotiation is broken. */
 #define VIRTIO_F_BAD_FEATURE		30
 
+/* Feature bits from 32 on live in host_features_hi/guest_features_hi and
+ * only reach transports that have a feature select (mmio, ccw). */
+/* The driver and device use the packed virtqueue layout */
+#define VIRTIO_F_RING_PACKED            34
+
 /* from Linux's linux/virtio_ring.h */
 
 /* This marks a buffer as continuing via the next field. */
@@ -69,6 +75,16 @@
 /* This means don't interrupt guest when buffer consumed. */
 #define VRING_AVAIL_F_NO_INTERRUPT      1
 
+/* Packed ring: bit numbers of the avail and used wrap flags of a descriptor */
+#define VRING_PACKED_DESC_F_AVAIL       7
+#define VRING_PACKED_DESC_F_USED        15
+
+/* Packed ring: event suppression flags */
+#define VRING_PACKED_EVENT_FLAG_ENABLE  0x0
+#define VRING_PACKED_EVENT_FLAG_DISABLE 0x1
+/* Only with VIRTIO_RING_F_EVENT_IDX: notify at the given descriptor */
+#define VRING_PACKED_EVENT_FLAG_DESC    0x2
+
 struct VirtQueue;
 
 static inline hwaddr vring_align(hwaddr addr,
@@ -96,6 +112,22 @@ typedef struct VirtQueueElement
 
 #define VIRTIO_NO_VECTOR 0xffff
 
+/*
+ * Calculate the number of bytes up to and including the given 'field' of
+ * 'container'.
+ */
+#define endof(container, field) \
+    (offsetof(container, field) + sizeof(((container *)0)->field))
+
+/* Config space up to @end is present when any feature in @flags is offered */
+typedef struct VirtIOFeature {
+    uint32_t flags;
+    size_t end;
+} VirtIOFeature;
+
+size_t virtio_feature_get_config_size(VirtIOFeature *features,
+                                      uint32_t host_features);
+
 #define TYPE_VIRTIO_DEVICE "virtio-device"
 #define VIRTIO_DEVICE_GET_CLASS(obj) \
         OBJECT_GET_CLASS(VirtioDeviceClass, obj, TYPE_VIRTIO_DEVICE)
@@ -118,6 +150,9 @@ struct VirtIODevice
     uint8_t isr;
     uint16_t queue_sel;
     uint32_t guest_features;
+    /* Feature bits 32-63 */
+    uint32_t host_features_hi;
+    uint32_t guest_features_hi;
     size_t config_len;
     void *config;
     uint16_t config_vector;
@@ -128,6 +163,7 @@ struct VirtIODevice
     VMChangeStateEntry *vmstate;
     char *bus_name;
     uint8_t device_endian;
+    MemoryListener listener;
 };
 
 typedef struct VirtioDeviceClass {
@@ -226,6 +262,7 @@ void virtio_set_status(VirtIODevice *vdev, uint8_t val);
 void virtio_reset(void *opaque);
 void virtio_update_irq(VirtIODevice *vdev);
 int virtio_set_features(VirtIODevice *vdev, uint32_t val);
+int virtio_set_features_hi(VirtIODevice *vdev, uint32_t val);
 
 /* Base devices.  */
 typedef struct VirtIOBlkConf VirtIOBlkConf;
@@ -240,6 +277,11 @@ typedef struct VirtIORNGConf VirtIORNGConf;
 	DEFINE_PROP_BIT("event_idx", _state, _field, \
 			VIRTIO_RING_F_EVENT_IDX, true)
 
+/* Offer the packed virtqueue layout; @_vdev is the VirtIODevice member */
+#define DEFINE_VIRTIO_RING_PACKED_FEATURE(_state, _vdev) \
+    DEFINE_PROP_BIT("packed", _state, _vdev.host_features_hi, \
+                    VIRTIO_F_RING_PACKED - 32, false)
+
 hwaddr virtio_queue_get_desc_addr(VirtIODevice *vdev, int n);
 hwaddr virtio_queue_get_avail_addr(VirtIODevice *vdev, int n);
 hwaddr virtio_queue_get_used_addr(VirtIODevice *vdev, int n);
@@ -250,6 +292,7 @@ hwaddr virtio_queue_get_used_size(VirtIODevice *vdev, int n);
 hwaddr virtio_queue_get_ring_size(VirtIODevice *vdev, int n);
 uint16_t virtio_queue_get_last_avail_idx(VirtIODevice *vdev, int n);
 void virtio_queue_set_last_avail_idx(VirtIODevice *vdev, int n, uint16_t idx);
+void virtio_queue_restore_last_avail_idx(VirtIODevice *vdev, int n);
 void virtio_queue_invalidate_signalled_used(VirtIODevice *vdev, int n);
 VirtQueue *virtio_get_queue(VirtIODevice *vdev, int n);
 uint16_t virtio_get_queue_index(VirtQueue *vq);
@@ -263,6 +306,11 @@ void virtio_queue_set_host_notifier_fd_handler(VirtQueue *vq, bool assign,
 void virtio_queue_notify_vq(VirtQueue *vq);
 void virtio_irq(VirtQueue *vq);
 
+static inline bool virtio_has_ring_packed(VirtIODevice *vdev)
+{
+    return vdev->guest_features_hi & (1 << (VIRTIO_F_RING_PACKED - 32));
+}
+
 static inline bool virtio_is_big_endian(VirtIODevice *vdev)
 {
     assert(vdev->device_endian != VIRTIO_DEVICE_ENDIAN_UNKNOWN);
@@ -60,6 +60,30 @@ typedef int (QEMUFileGetFD)(void *opaque);
 typedef ssize_t (QEMUFileWritevBufferFunc)(void *opaque, struct iovec *iov,
                                            int iovcnt, int64_t pos);
 
+/*
+ * Like QEMUFileWritevBufferFunc, but the entries whose bit is set in
+ * @zerocopy may be handed to the transport without copying them.  Those
+ * buffers must stay mapped until the file is closed; the others can be
+ * reused as soon as the function returns.  @iov may be modified.
+ */
+typedef ssize_t (QEMUFileWritevZerocopyFunc)(void *opaque, struct iovec *iov,
+                                             int iovcnt,
+                                             const unsigned long *zerocopy,
+                                             int64_t pos);
+
+/*
+ * Enable or disable zero-copy sends on the underlying transport.
+ * Returns 0 on success, -err if the transport cannot do it.
+ */
+typedef int (QEMUFileSetZerocopyFunc)(void *opaque, bool enable);
+
+/*
+ * Reposition the underlying file descriptor of a file opened for reading,
+ * with the same arguments as lseek.  Returns the new offset in the
+ * underlying file, or -err if it cannot be seeked (e.g. a pipe).
+ */
+typedef int64_t (QEMUFileSeekFunc)(void *opaque, int64_t offset, int whence);
+
 /*
  * This function provides hooks around different
  * stages of RAM migration.
@@ -103,6 +127,9 @@ typedef struct QEMUFileOps {
     QEMURamHookFunc *hook_ram_load;
     QEMURamSaveFunc *save_page;
     QEMUFileShutdownFunc *shut_down;
+    QEMUFileWritevZerocopyFunc *writev_buffer_zerocopy;
+    QEMUFileSetZerocopyFunc *set_zerocopy;
+    QEMUFileSeekFunc *seek;
 } QEMUFileOps;
 
 struct QEMUSizedBuffer {
@@ -127,10 +154,16 @@ void qemu_put_byte(QEMUFile *f, int v);
 /*
  * put_buffer without copying the buffer.
  * The buffer should be available till it is sent asynchronously.
+ * If zero-copy is enabled on the file, it must stay mapped until the
+ * file is closed, and the contents on the wire are those at the time
+ * the transport reads them.
  */
 void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size);
 bool qemu_file_mode_is_not_valid(const char *mode);
 bool qemu_file_is_writable(QEMUFile *f);
+int qemu_file_set_zerocopy(QEMUFile *f, bool enable);
+int qemu_file_get_mapping(QEMUFile *f, int64_t *offset);
+int qemu_file_seek_forward(QEMUFile *f, int64_t size);
 
 QEMUSizedBuffer *qsb_create(const uint8_t *buffer, size_t len);
 QEMUSizedBuffer *qsb_clone(const QEMUSizedBuffer *);
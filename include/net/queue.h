@@ -33,6 +33,10 @@ typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
+/* The sender keeps the packet buffers valid until its sent callback runs,
+ * so the packet may be queued by reference instead of being copied.
+ */
+#define QEMU_NET_PACKET_FLAG_ZEROCOPY  (1<<1)
 
 NetQueue *qemu_new_net_queue(void *opaque);
 
@@ -58,6 +58,12 @@ bool qemu_thread_is_self(QemuThread *thread);
 void qemu_thread_exit(void *retval);
 void qemu_thread_naming(bool enable);
 
+/* Highest host CPU number plus one that can be used in an affinity mask */
+#define MAX_HOST_CPUS 1024
+
+int qemu_thread_set_affinity(QemuThread *thread,
+                             const unsigned long *host_cpus);
+
 struct Notifier;
 void qemu_thread_atexit_add(struct Notifier *notifier);
 void qemu_thread_atexit_remove(struct Notifier *notifier);
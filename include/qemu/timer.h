@@ -67,7 +67,8 @@ struct QEMUTimer {
     QEMUTimerList *timer_list;
     QEMUTimerCB *cb;
     void *opaque;
-    QEMUTimer *next;
+    unsigned heap_index;        /* position in the timer list's heap */
+    uint64_t seq;               /* arming order, for equal expire times */
     int scale;
 };
 
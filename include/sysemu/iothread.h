@@ -16,6 +16,7 @@
 
 #include "block/aio.h"
 #include "qemu/thread.h"
+#include "qemu/bitmap.h"
 
 #define TYPE_IOTHREAD "iothread"
 
@@ -28,6 +29,10 @@ typedef struct {
     QemuCond init_done_cond;    /* is thread initialization done? */
     bool stopping;
     int thread_id;
+
+    /* Host CPUs the thread is restricted to, set with host-cpus= */
+    DECLARE_BITMAP(host_cpus, MAX_HOST_CPUS);
+    bool has_host_cpus;
 } IOThread;
 
 #define IOTHREAD(obj) \
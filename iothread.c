@@ -18,6 +18,9 @@
 #include "sysemu/iothread.h"
 #include "qmp-commands.h"
 #include "qemu/error-report.h"
+#include "qemu/rcu.h"
+#include "qapi/visitor.h"
+#include "qapi-visit.h"
 
 #define IOTHREADS_PATH "/objects"
 
@@ -33,6 +36,23 @@ static void *iothread_run(void *opaque)
     IOThread *iothread = opaque;
     bool blocking;
 
+    rcu_register_thread();
+
+    /* Pin before anything is allocated, so that the AioContext's
+     * requests and bounce buffers come from the local host node.
+     */
+    if (iothread->has_host_cpus) {
+        QemuThread self;
+        int ret;
+
+        qemu_thread_get_self(&self);
+        ret = qemu_thread_set_affinity(&self, iothread->host_cpus);
+        if (ret < 0) {
+            error_report("Failed to set host CPU affinity of iothread: %s",
+                         strerror(-ret));
+        }
+    }
+
     qemu_mutex_lock(&iothread->init_done_lock);
     iothread->thread_id = qemu_get_thread_id();
     qemu_cond_signal(&iothread->init_done_cond);
@@ -47,6 +67,8 @@ static void *iothread_run(void *opaque)
         }
         aio_context_release(iothread->ctx);
     }
+
+    rcu_unregister_thread();
     return NULL;
 }
 
@@ -81,8 +103,8 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
     qemu_mutex_init(&iothread->init_done_lock);
     qemu_cond_init(&iothread->init_done_cond);
 
-    /* This assumes we are called from a thread with useful CPU affinity for us
-     * to inherit.
+    /* Unless host-cpus is set, this assumes we are called from a thread
+     * with useful CPU affinity for us to inherit.
      */
     qemu_thread_create(&iothread->thread, "iothread", iothread_run,
                        iothread, QEMU_THREAD_JOINABLE);
@@ -96,6 +118,71 @@ static void iothread_complete(UserCreatable *obj, Error **errp)
     qemu_mutex_unlock(&iothread->init_done_lock);
 }
 
+static void iothread_get_host_cpus(Object *obj, Visitor *v, void *opaque,
+                                   const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    uint16List *host_cpus = NULL;
+    uint16List **cpu = &host_cpus;
+    unsigned long value;
+
+    for (value = find_first_bit(iothread->host_cpus, MAX_HOST_CPUS);
+         value < MAX_HOST_CPUS;
+         value = find_next_bit(iothread->host_cpus, MAX_HOST_CPUS, value + 1)) {
+        *cpu = g_malloc0(sizeof(**cpu));
+        (*cpu)->value = value;
+        cpu = &(*cpu)->next;
+    }
+
+    visit_type_uint16List(v, &host_cpus, name, errp);
+    qapi_free_uint16List(host_cpus);
+}
+
+static void iothread_set_host_cpus(Object *obj, Visitor *v, void *opaque,
+                                   const char *name, Error **errp)
+{
+    IOThread *iothread = IOTHREAD(obj);
+    Error *local_err = NULL;
+    uint16List *host_cpus = NULL;
+    uint16List *l;
+
+    if (iothread->ctx) {
+        error_setg(errp, "host-cpus cannot be changed after the iothread "
+                   "has started");
+        return;
+    }
+
+    visit_type_uint16List(v, &host_cpus, name, &local_err);
+    if (local_err) {
+        error_propagate(errp, local_err);
+        return;
+    }
+
+    for (l = host_cpus; l; l = l->next) {
+        if (l->value >= MAX_HOST_CPUS) {
+            error_setg(errp, "Host CPU number %" PRIu16 " is bigger than %d",
+                       l->value, MAX_HOST_CPUS - 1);
+            goto out;
+        }
+    }
+
+    bitmap_zero(iothread->host_cpus, MAX_HOST_CPUS);
+    for (l = host_cpus; l; l = l->next) {
+        bitmap_set(iothread->host_cpus, l->value, 1);
+    }
+    iothread->has_host_cpus = host_cpus != NULL;
+
+out:
+    qapi_free_uint16List(host_cpus);
+}
+
+static void iothread_instance_init(Object *obj)
+{
+    object_property_add(obj, "host-cpus", "int",
+                        iothread_get_host_cpus,
+                        iothread_set_host_cpus, NULL, NULL, NULL);
+}
+
 static void iothread_class_init(ObjectClass *klass, void *class_data)
 {
     UserCreatableClass *ucc = USER_CREATABLE_CLASS(klass);
@@ -107,6 +194,7 @@ static const TypeInfo iothread_info = {
     .parent = TYPE_OBJECT,
     .class_init = iothread_class_init,
     .instance_size = sizeof(IOThread),
+    .instance_init = iothread_instance_init,
     .instance_finalize = iothread_instance_finalize,
     .interfaces = (InterfaceInfo[]) {
         {TYPE_USER_CREATABLE},
@@ -36,6 +36,8 @@
 #include "exec/ram_addr.h"
 #include "exec/address-spaces.h"
 #include "qemu/event_notifier.h"
+#include "qemu/bitmap.h"
+#include "qemu/thread.h"
 #include "trace.h"
 
 #include "hw/boards.h"
@@ -67,6 +69,9 @@ typedef struct KVMSlot
     void *ram;
     int slot;
     int flags;
+    /* Pages reported by KVM_GET_DIRTY_LOG and not yet cleared in the
+     * kernel, only used with manual dirty log protection */
+    unsigned long *dirty_bmap;
 } KVMSlot;
 
 typedef struct kvm_dirty_log KVMDirtyLog;
@@ -77,6 +82,10 @@ struct KVMState
 
     KVMSlot *slots;
     int nr_slots;
+    /* Protects the slot array against the migration thread, which clears
+     * the dirty log without holding the iothread lock */
+    QemuMutex slots_lock;
+    bool manual_dirty_log_protect;
     int fd;
     int vmfd;
     int coalesced_mmio;
@@ -347,8 +356,10 @@ static void kvm_log_start(MemoryListener *listener,
 {
     int r;
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     r = kvm_dirty_pages_log_change(section->offset_within_address_space,
                                    int128_get64(section->size), true);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     if (r < 0) {
         abort();
     }
@@ -359,8 +370,10 @@ static void kvm_log_stop(MemoryListener *listener,
 {
     int r;
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     r = kvm_dirty_pages_log_change(section->offset_within_address_space,
                                    int128_get64(section->size), false);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     if (r < 0) {
         abort();
     }
@@ -410,6 +423,11 @@ static int kvm_get_dirty_pages_log_range(MemoryRegionSection *section,
  * memory_region_set_dirty().  This means all bits are set
  * to dirty.
  *
+ * With manual dirty log protection the kernel neither clears nor
+ * write-protects what it reports here, so fetching the log is cheap even
+ * for huge slots.  The reported bits are kept in the slot until
+ * kvm_log_clear() re-arms tracking for them, one chunk at a time.
+ *
  * @start_add: start of logged region.
  * @end_addr: end of logged region.
  */
@@ -417,13 +435,13 @@ static int kvm_physical_sync_dirty_bitmap(MemoryRegionSection *section)
 {
     KVMState *s = kvm_state;
     unsigned long size, allocated_size = 0;
+    unsigned long *bitmap = NULL;
     KVMDirtyLog d = {};
     KVMSlot *mem;
     int ret = 0;
     hwaddr start_addr = section->offset_within_address_space;
     hwaddr end_addr = start_addr + int128_get64(section->size);
 
-    d.dirty_bitmap = NULL;
     while (start_addr < end_addr) {
         mem = kvm_lookup_overlapping_slot(s, start_addr, end_addr);
         if (mem == NULL) {
@@ -444,13 +462,21 @@ static int kvm_physical_sync_dirty_bitmap(MemoryRegionSection *section)
          */
         size = ALIGN(((mem->memory_size) >> TARGET_PAGE_BITS),
                      /*HOST_LONG_BITS*/ 64) / 8;
-        if (!d.dirty_bitmap) {
-            d.dirty_bitmap = g_malloc(size);
-        } else if (size > allocated_size) {
-            d.dirty_bitmap = g_realloc(d.dirty_bitmap, size);
+        if (s->manual_dirty_log_protect) {
+            if (!mem->dirty_bmap) {
+                mem->dirty_bmap = g_malloc0(size);
+            }
+            d.dirty_bitmap = mem->dirty_bmap;
+        } else {
+            if (!bitmap) {
+                bitmap = g_malloc(size);
+            } else if (size > allocated_size) {
+                bitmap = g_realloc(bitmap, size);
+            }
+            allocated_size = size;
+            memset(bitmap, 0, allocated_size);
+            d.dirty_bitmap = bitmap;
         }
-        allocated_size = size;
-        memset(d.dirty_bitmap, 0, allocated_size);
 
         d.slot = mem->slot;
 
@@ -463,11 +489,87 @@ static int kvm_physical_sync_dirty_bitmap(MemoryRegionSection *section)
         kvm_get_dirty_pages_log_range(section, d.dirty_bitmap);
         start_addr = mem->start_addr + mem->memory_size;
     }
-    g_free(d.dirty_bitmap);
+    g_free(bitmap);
 
     return ret;
 }
 
+/*
+ * kvm_log_clear_one_slot - Re-arm dirty tracking for part of a slot
+ *
+ * Only pages that KVM_GET_DIRTY_LOG has reported since the last clear are
+ * passed down: clearing a bit the kernel set after that fetch would lose
+ * a write that QEMU has not seen yet.  The kernel wants the range aligned
+ * to 64 pages, so round it out; the extra pages were reported dirty as
+ * well and will be sent again anyway.
+ */
+static int kvm_log_clear_one_slot(KVMSlot *mem, hwaddr start, hwaddr end)
+{
+    KVMState *s = kvm_state;
+    struct kvm_clear_dirty_log d;
+    uint64_t slot_pages = mem->memory_size >> TARGET_PAGE_BITS;
+    uint64_t first_page, last_page;
+    int ret;
+
+    if (!mem->dirty_bmap) {
+        /* Nothing fetched yet, so nothing to re-arm either */
+        return 0;
+    }
+
+    first_page = (MAX(start, mem->start_addr) - mem->start_addr)
+                 >> TARGET_PAGE_BITS;
+    last_page = (MIN(end, mem->start_addr + mem->memory_size) -
+                 mem->start_addr) >> TARGET_PAGE_BITS;
+    first_page &= ~(uint64_t)63;
+    last_page = MIN(ALIGN(last_page, 64), slot_pages);
+    if (first_page >= last_page) {
+        return 0;
+    }
+
+    d.slot = mem->slot;
+    d.first_page = first_page;
+    d.num_pages = last_page - first_page;
+    d.dirty_bitmap = mem->dirty_bmap + BIT_WORD(first_page);
+
+    trace_kvm_clear_dirty_log(mem->slot, first_page, d.num_pages);
+    ret = kvm_vm_ioctl(s, KVM_CLEAR_DIRTY_LOG, &d);
+    if (ret < 0) {
+        DPRINTF("KVM_CLEAR_DIRTY_LOG failed %d\n", -ret);
+        return ret;
+    }
+    bitmap_clear(mem->dirty_bmap, first_page, d.num_pages);
+    return 0;
+}
+
+static void kvm_log_clear(MemoryListener *listener,
+                          MemoryRegionSection *section)
+{
+    KVMState *s = kvm_state;
+    hwaddr start = section->offset_within_address_space;
+    hwaddr end = start + int128_get64(section->size);
+    int i, r;
+
+    if (!s->manual_dirty_log_protect) {
+        return;
+    }
+
+    qemu_mutex_lock(&s->slots_lock);
+    for (i = 0; i < s->nr_slots; i++) {
+        KVMSlot *mem = &s->slots[i];
+
+        if (!mem->memory_size ||
+            mem->start_addr >= end ||
+            start >= mem->start_addr + mem->memory_size) {
+            continue;
+        }
+        r = kvm_log_clear_one_slot(mem, start, end);
+        if (r < 0) {
+            abort();
+        }
+    }
+    qemu_mutex_unlock(&s->slots_lock);
+}
+
 static void kvm_coalesce_mmio_region(MemoryListener *listener,
                                      MemoryRegionSection *secion,
                                      hwaddr start, hwaddr size)
@@ -699,6 +801,8 @@ static void kvm_set_phys_mem(MemoryRegionSection *section, bool add)
         }
 
         /* unregister the overlapping slot */
+        g_free(mem->dirty_bmap);
+        mem->dirty_bmap = NULL;
         mem->memory_size = 0;
         err = kvm_set_user_memory_region(s, mem);
         if (err) {
@@ -802,13 +906,17 @@ static void kvm_region_add(MemoryListener *listener,
                            MemoryRegionSection *section)
 {
     memory_region_ref(section->mr);
+    qemu_mutex_lock(&kvm_state->slots_lock);
     kvm_set_phys_mem(section, true);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
 }
 
 static void kvm_region_del(MemoryListener *listener,
                            MemoryRegionSection *section)
 {
+    qemu_mutex_lock(&kvm_state->slots_lock);
     kvm_set_phys_mem(section, false);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     memory_region_unref(section->mr);
 }
 
@@ -817,7 +925,9 @@ static void kvm_log_sync(MemoryListener *listener,
 {
     int r;
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     r = kvm_physical_sync_dirty_bitmap(section);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     if (r < 0) {
         abort();
     }
@@ -827,7 +937,9 @@ static void kvm_log_global_start(struct MemoryListener *listener)
 {
     int r;
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     r = kvm_set_migration_log(1);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     assert(r >= 0);
 }
 
@@ -835,7 +947,9 @@ static void kvm_log_global_stop(struct MemoryListener *listener)
 {
     int r;
 
+    qemu_mutex_lock(&kvm_state->slots_lock);
     r = kvm_set_migration_log(0);
+    qemu_mutex_unlock(&kvm_state->slots_lock);
     assert(r >= 0);
 }
 
@@ -914,6 +1028,7 @@ static MemoryListener kvm_memory_listener = {
     .log_start = kvm_log_start,
     .log_stop = kvm_log_stop,
     .log_sync = kvm_log_sync,
+    .log_clear = kvm_log_clear,
     .log_global_start = kvm_log_global_start,
     .log_global_stop = kvm_log_global_stop,
     .eventfd_add = kvm_mem_ioeventfd_add,
@@ -1428,6 +1543,7 @@ static int kvm_init(MachineState *ms)
     int soft_vcpus_limit, hard_vcpus_limit;
     KVMState *s;
     const KVMCapabilityInfo *missing_cap;
+    uint64_t dirty_log_manual_caps;
     int ret;
     int i, type = 0;
     const char *kvm_type;
@@ -1479,6 +1595,7 @@ static int kvm_init(MachineState *ms)
     }
 
     s->slots = g_malloc0(s->nr_slots * sizeof(KVMSlot));
+    qemu_mutex_init(&s->slots_lock);
 
     for (i = 0; i < s->nr_slots; i++) {
         s->slots[i].slot = i;
@@ -1544,6 +1661,26 @@ static int kvm_init(MachineState *ms)
 
     s->coalesced_mmio = kvm_check_extension(s, KVM_CAP_COALESCED_MMIO);
 
+    /* Let migration fetch the dirty log without write-protecting all of
+     * guest memory at once, and re-arm it chunk by chunk instead.  With
+     * KVM_DIRTY_LOG_INITIALLY_SET starting the log does not have to
+     * write-protect everything up front either. */
+    dirty_log_manual_caps =
+        kvm_check_extension(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2);
+    dirty_log_manual_caps &= (KVM_DIRTY_LOG_MANUAL_PROTECT_ENABLE |
+                              KVM_DIRTY_LOG_INITIALLY_SET);
+    if (dirty_log_manual_caps) {
+        ret = kvm_vm_enable_cap(s, KVM_CAP_MANUAL_DIRTY_LOG_PROTECT2, 0,
+                                dirty_log_manual_caps);
+        if (ret) {
+            fprintf(stderr, "Warning: cannot enable manual dirty log "
+                    "protection: %s, falling back to the legacy mode\n",
+                    strerror(-ret));
+        } else {
+            s->manual_dirty_log_protect = true;
+        }
+    }
+
     s->broken_set_mem_region = 1;
     ret = kvm_check_extension(s, KVM_CAP_JOIN_MEMORY_REGIONS_WORKS);
     if (ret > 0) {
@@ -1749,6 +1886,56 @@ void kvm_cpu_clean_state(CPUState *cpu)
     cpu->kvm_vcpu_dirty = false;
 }
 
+/* Handle the exits that are not port or MMIO accesses.  Called with the
+ * BQL held.
+ */
+static int kvm_handle_exit(CPUState *cpu, struct kvm_run *run)
+{
+    int ret;
+
+    switch (run->exit_reason) {
+    case KVM_EXIT_IRQ_WINDOW_OPEN:
+        DPRINTF("irq_window_open\n");
+        ret = EXCP_INTERRUPT;
+        break;
+    case KVM_EXIT_SHUTDOWN:
+        DPRINTF("shutdown\n");
+        qemu_system_reset_request();
+        ret = EXCP_INTERRUPT;
+        break;
+    case KVM_EXIT_UNKNOWN:
+        fprintf(stderr, "KVM: unknown exit, hardware reason %" PRIx64 "\n",
+                (uint64_t)run->hw.hardware_exit_reason);
+        ret = -1;
+        break;
+    case KVM_EXIT_INTERNAL_ERROR:
+        ret = kvm_handle_internal_error(cpu, run);
+        break;
+    case KVM_EXIT_SYSTEM_EVENT:
+        switch (run->system_event.type) {
+        case KVM_SYSTEM_EVENT_SHUTDOWN:
+            qemu_system_shutdown_request();
+            ret = EXCP_INTERRUPT;
+            break;
+        case KVM_SYSTEM_EVENT_RESET:
+            qemu_system_reset_request();
+            ret = EXCP_INTERRUPT;
+            break;
+        default:
+            DPRINTF("kvm_arch_handle_exit\n");
+            ret = kvm_arch_handle_exit(cpu, run);
+            break;
+        }
+        break;
+    default:
+        DPRINTF("kvm_arch_handle_exit\n");
+        ret = kvm_arch_handle_exit(cpu, run);
+        break;
+    }
+
+    return ret;
+}
+
 int kvm_cpu_exec(CPUState *cpu)
 {
     struct kvm_run *run = cpu->kvm_run;
@@ -1761,6 +1948,14 @@ int kvm_cpu_exec(CPUState *cpu)
         return EXCP_HLT;
     }
 
+    /* The BQL is only taken back for exits that need it.  Port and MMIO
+     * accesses go through address_space_rw, which takes it for memory
+     * regions that have not opted out of global locking.  The arch
+     * pre_run/post_run hooks take it themselves where they touch shared
+     * state.
+     */
+    qemu_mutex_unlock_iothread();
+
     do {
         if (cpu->kvm_vcpu_dirty) {
             kvm_arch_put_registers(cpu, KVM_PUT_RUNTIME_STATE);
@@ -1777,11 +1972,9 @@ int kvm_cpu_exec(CPUState *cpu)
              */
             qemu_cpu_kick_self();
         }
-        qemu_mutex_unlock_iothread();
 
         run_ret = kvm_vcpu_ioctl(cpu, KVM_RUN, 0);
 
-        qemu_mutex_lock_iothread();
         kvm_arch_post_run(cpu, run);
 
         if (run_ret < 0) {
@@ -1815,46 +2008,16 @@ int kvm_cpu_exec(CPUState *cpu)
                                    run->mmio.is_write);
             ret = 0;
             break;
-        case KVM_EXIT_IRQ_WINDOW_OPEN:
-            DPRINTF("irq_window_open\n");
-            ret = EXCP_INTERRUPT;
-            break;
-        case KVM_EXIT_SHUTDOWN:
-            DPRINTF("shutdown\n");
-            qemu_system_reset_request();
-            ret = EXCP_INTERRUPT;
-            break;
-        case KVM_EXIT_UNKNOWN:
-            fprintf(stderr, "KVM: unknown exit, hardware reason %" PRIx64 "\n",
-                    (uint64_t)run->hw.hardware_exit_reason);
-            ret = -1;
-            break;
-        case KVM_EXIT_INTERNAL_ERROR:
-            ret = kvm_handle_internal_error(cpu, run);
-            break;
-        case KVM_EXIT_SYSTEM_EVENT:
-            switch (run->system_event.type) {
-            case KVM_SYSTEM_EVENT_SHUTDOWN:
-                qemu_system_shutdown_request();
-                ret = EXCP_INTERRUPT;
-                break;
-            case KVM_SYSTEM_EVENT_RESET:
-                qemu_system_reset_request();
-                ret = EXCP_INTERRUPT;
-                break;
-            default:
-                DPRINTF("kvm_arch_handle_exit\n");
-                ret = kvm_arch_handle_exit(cpu, run);
-                break;
-            }
-            break;
         default:
-            DPRINTF("kvm_arch_handle_exit\n");
-            ret = kvm_arch_handle_exit(cpu, run);
+            qemu_mutex_lock_iothread();
+            ret = kvm_handle_exit(cpu, run);
+            qemu_mutex_unlock_iothread();
             break;
         }
     } while (ret == 0);
 
+    qemu_mutex_lock_iothread();
+
     if (ret < 0) {
         cpu_dump_state(cpu, stderr, fprintf, CPU_DUMP_CODE);
         vm_stop(RUN_STATE_INTERNAL_ERROR);
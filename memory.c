@@ -36,6 +36,17 @@ static bool global_dirty_log = false;
 static QTAILQ_HEAD(memory_listeners, MemoryListener) memory_listeners
     = QTAILQ_HEAD_INITIALIZER(memory_listeners);
 
+/* Changes to memory_listeners happen under the iothread lock, and also take
+ * this lock so that memory_region_clear_dirty_bitmap() can walk the list
+ * from the migration thread.
+ */
+static QemuMutex memory_listeners_lock;
+
+static void __attribute__((constructor)) memory_listeners_lock_init(void)
+{
+    qemu_mutex_init(&memory_listeners_lock);
+}
+
 static QTAILQ_HEAD(, AddressSpace) address_spaces
     = QTAILQ_HEAD_INITIALIZER(address_spaces);
 
@@ -484,6 +495,78 @@ static AddressSpace *memory_region_to_address_space(MemoryRegion *mr)
     return NULL;
 }
 
+/* Dirty range tracking, for incremental FlatView updates.
+ *
+ * Every change that affects how a region renders records, for each
+ * address space, the part of the address space where the region is
+ * visible, either through its chain of containers or through aliases.
+ * A change that moves or resizes a region records both its old and its
+ * new extent.  At commit time only the recorded ranges are rendered
+ * again, and listeners only see additions and removals within them.
+ * The ranges may cover more than what actually changed; that only
+ * costs time.
+ */
+#define ADDRESS_SPACE_MAX_DIRTY 32
+
+static void address_space_add_dirty(AddressSpace *as, AddrRange range)
+{
+    AddrRange all = addrrange_make(int128_zero(), int128_2_64());
+
+    if (as->dirty_all || !addrrange_intersects(range, all)) {
+        return;
+    }
+    if (as->dirty_nb == ADDRESS_SPACE_MAX_DIRTY) {
+        /* Not worth it, render everything */
+        as->dirty_all = true;
+        return;
+    }
+    if (!as->dirty_ranges) {
+        as->dirty_ranges = g_new(AddrRange, ADDRESS_SPACE_MAX_DIRTY);
+    }
+    as->dirty_ranges[as->dirty_nb++] = addrrange_intersection(range, all);
+}
+
+static void address_space_clear_dirty(AddressSpace *as)
+{
+    as->dirty_nb = 0;
+    as->dirty_all = false;
+}
+
+/* Mark @range, in the coordinates of @mr, dirty in every address space
+ * that can see it.
+ */
+static void memory_region_mark_range_dirty(MemoryRegion *mr, AddrRange range)
+{
+    AddrRange extent = addrrange_make(int128_zero(), mr->size);
+    AddressSpace *as;
+    MemoryRegion *alias;
+
+    if (!addrrange_intersects(range, extent)) {
+        return;
+    }
+    range = addrrange_intersection(range, extent);
+
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        if (as->root == mr) {
+            address_space_add_dirty(as, range);
+        }
+    }
+    if (mr->container) {
+        memory_region_mark_range_dirty(mr->container,
+            addrrange_shift(range, int128_make64(mr->addr)));
+    }
+    QTAILQ_FOREACH(alias, &mr->aliases, aliases_link) {
+        Int128 delta = int128_neg(int128_make64(alias->alias_offset));
+
+        memory_region_mark_range_dirty(alias, addrrange_shift(range, delta));
+    }
+}
+
+static void memory_region_mark_dirty(MemoryRegion *mr)
+{
+    memory_region_mark_range_dirty(mr, addrrange_make(int128_zero(), mr->size));
+}
+
 /* Render a memory region into the global view.  Ranges in @view obscure
  * ranges in @mr.
  */
@@ -588,6 +671,172 @@ static FlatView *generate_memory_topology(MemoryRegion *mr)
     return view;
 }
 
+static int addrrange_cmp(const void *a, const void *b)
+{
+    const AddrRange *r1 = a, *r2 = b;
+
+    if (int128_lt(r1->start, r2->start)) {
+        return -1;
+    }
+    return int128_lt(r2->start, r1->start);
+}
+
+/* Sort @ranges and merge the ones that overlap or touch.  Returns the
+ * new number of ranges.
+ */
+static unsigned addrrange_coalesce(AddrRange *ranges, unsigned nr)
+{
+    unsigned i, n = 0;
+
+    qsort(ranges, nr, sizeof(*ranges), addrrange_cmp);
+    for (i = 0; i < nr; i++) {
+        if (n && int128_ge(addrrange_end(ranges[n - 1]), ranges[i].start)) {
+            Int128 end = int128_max(addrrange_end(ranges[n - 1]),
+                                    addrrange_end(ranges[i]));
+            ranges[n - 1].size = int128_sub(end, ranges[n - 1].start);
+        } else {
+            ranges[n++] = ranges[i];
+        }
+    }
+    return n;
+}
+
+/* Append to @view the part of @fr that lies within [@start, @end).  */
+static void flatview_append_clipped(FlatView *view, const FlatRange *fr,
+                                    Int128 start, Int128 end)
+{
+    AddrRange clip;
+    FlatRange tmp;
+
+    if (int128_ge(start, end)) {
+        return;
+    }
+    clip = addrrange_make(start, int128_sub(end, start));
+    if (!addrrange_intersects(fr->addr, clip)) {
+        return;
+    }
+
+    tmp = *fr;
+    tmp.addr = addrrange_intersection(fr->addr, clip);
+    tmp.offset_in_region += int128_get64(int128_sub(tmp.addr.start,
+                                                    fr->addr.start));
+    flatview_insert(view, view->nr, &tmp);
+}
+
+/* Build a new view for @as out of @old_view.  Ranges outside the dirty
+ * ranges of @as are copied over, the dirty ranges are rendered again.
+ * The dirty ranges must be sorted and disjoint.
+ */
+static FlatView *generate_memory_topology_incremental(AddressSpace *as,
+                                                      const FlatView *old_view)
+{
+    FlatView *view, *part;
+    Int128 gap_start = int128_zero(), gap_end;
+    unsigned i, j = 0, k;
+
+    view = g_new(FlatView, 1);
+    flatview_init(view);
+
+    for (k = 0; k <= as->dirty_nb; k++) {
+        gap_end = k < as->dirty_nb ? as->dirty_ranges[k].start : int128_2_64();
+
+        /* Keep what the old view had between two dirty ranges.  A range
+         * that extends past the gap is looked at again for the next one.
+         */
+        while (j < old_view->nr) {
+            const FlatRange *fr = &old_view->ranges[j];
+
+            if (int128_ge(fr->addr.start, gap_end)) {
+                break;
+            }
+            flatview_append_clipped(view, fr, gap_start, gap_end);
+            if (int128_gt(addrrange_end(fr->addr), gap_end)) {
+                break;
+            }
+            j++;
+        }
+
+        if (k == as->dirty_nb) {
+            break;
+        }
+
+        part = g_new(FlatView, 1);
+        flatview_init(part);
+        render_memory_region(part, as->root, int128_zero(),
+                             as->dirty_ranges[k], false);
+        for (i = 0; i < part->nr; i++) {
+            flatview_insert(view, view->nr, &part->ranges[i]);
+        }
+        flatview_unref(part);
+        gap_start = addrrange_end(as->dirty_ranges[k]);
+    }
+    flatview_simplify(view);
+
+    return view;
+}
+
+/* Return the index of the first range in @view that ends after @addr.  */
+static unsigned flatview_find_index(const FlatView *view, Int128 addr)
+{
+    unsigned lo = 0, hi = view->nr;
+
+    while (lo < hi) {
+        unsigned mid = lo + (hi - lo) / 2;
+
+        if (int128_ge(addr, addrrange_end(view->ranges[mid].addr))) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+/* Grow @span so that no range in @view crosses its boundaries.  Returns
+ * true if @span changed.
+ */
+static bool flatview_extend_span(const FlatView *view, AddrRange *span)
+{
+    Int128 start = span->start;
+    Int128 end = addrrange_end(*span);
+    unsigned first, last;
+
+    first = flatview_find_index(view, start);
+    last = flatview_find_index(view, int128_sub(end, int128_one()));
+    if (first < view->nr && int128_lt(view->ranges[first].addr.start, start)) {
+        start = view->ranges[first].addr.start;
+    }
+    if (last < view->nr && int128_lt(view->ranges[last].addr.start, end)) {
+        end = int128_max(end, addrrange_end(view->ranges[last].addr));
+    }
+    if (int128_eq(start, span->start) && int128_eq(end, addrrange_end(*span))) {
+        return false;
+    }
+    *span = addrrange_make(start, int128_sub(end, start));
+    return true;
+}
+
+/* Turn the dirty ranges of @as into spans whose boundaries fall between
+ * ranges of both @old_view and @new_view.  Outside the spans, the two
+ * views then hold exactly the same ranges.
+ */
+static void address_space_dirty_to_spans(AddressSpace *as,
+                                         const FlatView *old_view,
+                                         const FlatView *new_view)
+{
+    bool changed;
+    unsigned i;
+
+    do {
+        changed = false;
+        for (i = 0; i < as->dirty_nb; i++) {
+            changed |= flatview_extend_span(old_view, &as->dirty_ranges[i]);
+            changed |= flatview_extend_span(new_view, &as->dirty_ranges[i]);
+        }
+        as->dirty_nb = addrrange_coalesce(as->dirty_ranges, as->dirty_nb);
+    } while (changed);
+}
+
 static void address_space_add_del_ioeventfds(AddressSpace *as,
                                              MemoryRegionIoeventfd *fds_new,
                                              unsigned fds_new_nb,
@@ -682,25 +931,25 @@ static void address_space_update_ioeventfds(AddressSpace *as)
     flatview_unref(view);
 }
 
-static void address_space_update_topology_pass(AddressSpace *as,
-                                               const FlatView *old_view,
-                                               const FlatView *new_view,
-                                               bool adding)
+static void address_space_update_range_pass(AddressSpace *as,
+                                            const FlatView *old_view,
+                                            unsigned iold, unsigned old_end,
+                                            const FlatView *new_view,
+                                            unsigned inew, unsigned new_end,
+                                            bool adding)
 {
-    unsigned iold, inew;
     FlatRange *frold, *frnew;
 
     /* Generate a symmetric difference of the old and new memory maps.
      * Kill ranges in the old map, and instantiate ranges in the new map.
      */
-    iold = inew = 0;
-    while (iold < old_view->nr || inew < new_view->nr) {
-        if (iold < old_view->nr) {
+    while (iold < old_end || inew < new_end) {
+        if (iold < old_end) {
             frold = &old_view->ranges[iold];
         } else {
             frold = NULL;
         }
-        if (inew < new_view->nr) {
+        if (inew < new_end) {
             frnew = &new_view->ranges[inew];
         } else {
             frnew = NULL;
@@ -744,18 +993,90 @@ static void address_space_update_topology_pass(AddressSpace *as,
     }
 }
 
+/* Compare @old_view and @new_view within @spans only; ranges outside
+ * them are known to be the same in both views.  A NULL @spans compares
+ * the whole views.
+ */
+static void address_space_update_topology_pass(AddressSpace *as,
+                                               const FlatView *old_view,
+                                               const FlatView *new_view,
+                                               const AddrRange *spans,
+                                               unsigned nr_spans,
+                                               bool adding)
+{
+    unsigned iold = 0, inew = 0, old_end, new_end, i;
+
+    if (!spans) {
+        address_space_update_range_pass(as, old_view, 0, old_view->nr,
+                                        new_view, 0, new_view->nr, adding);
+        return;
+    }
+
+    for (i = 0; i <= nr_spans; i++) {
+        if (i < nr_spans) {
+            old_end = flatview_find_index(old_view, spans[i].start);
+            new_end = flatview_find_index(new_view, spans[i].start);
+        } else {
+            old_end = old_view->nr;
+            new_end = new_view->nr;
+        }
+
+        /* Unchanged ranges; listeners that rebuild their view from
+         * scratch on every transaction still need to hear about them.
+         */
+        assert(old_end - iold == new_end - inew);
+        if (adding) {
+            for (; inew < new_end; inew++) {
+                MEMORY_LISTENER_UPDATE_REGION(&new_view->ranges[inew],
+                                              as, Forward, region_nop);
+            }
+        }
+        iold = old_end;
+        inew = new_end;
+
+        if (i < nr_spans) {
+            old_end = flatview_find_index(old_view, addrrange_end(spans[i]));
+            new_end = flatview_find_index(new_view, addrrange_end(spans[i]));
+            address_space_update_range_pass(as, old_view, iold, old_end,
+                                            new_view, inew, new_end, adding);
+            iold = old_end;
+            inew = new_end;
+        }
+    }
+}
 
 static void address_space_update_topology(AddressSpace *as)
 {
     FlatView *old_view = address_space_get_flatview(as);
-    FlatView *new_view = generate_memory_topology(as->root);
+    FlatView *new_view;
+    const AddrRange *spans = NULL;
+    unsigned nr_spans = 0;
+
+    if (as->dirty_all || !as->root) {
+        new_view = generate_memory_topology(as->root);
+    } else if (as->dirty_nb == 0) {
+        /* Nothing changed here, but listeners still get region_nop */
+        new_view = old_view;
+        spans = as->dirty_ranges;
+    } else {
+        as->dirty_nb = addrrange_coalesce(as->dirty_ranges, as->dirty_nb);
+        new_view = generate_memory_topology_incremental(as, old_view);
+        address_space_dirty_to_spans(as, old_view, new_view);
+        spans = as->dirty_ranges;
+        nr_spans = as->dirty_nb;
+    }
 
-    address_space_update_topology_pass(as, old_view, new_view, false);
-    address_space_update_topology_pass(as, old_view, new_view, true);
+    address_space_update_topology_pass(as, old_view, new_view,
+                                       spans, nr_spans, false);
+    address_space_update_topology_pass(as, old_view, new_view,
+                                       spans, nr_spans, true);
+    address_space_clear_dirty(as);
 
-    /* Writes are protected by the BQL.  */
-    atomic_rcu_set(&as->current_map, new_view);
-    call_rcu(old_view, flatview_unref, rcu);
+    if (new_view != old_view) {
+        /* Writes are protected by the BQL.  */
+        atomic_rcu_set(&as->current_map, new_view);
+        call_rcu(old_view, flatview_unref, rcu);
+    }
 
     /* Note that all the old MemoryRegions are still alive up to this
      * point.  This relieves most MemoryListeners from the need to
@@ -776,8 +1097,13 @@ void memory_region_transaction_begin(void)
 
 static void memory_region_clear_pending(void)
 {
+    AddressSpace *as;
+
     memory_region_update_pending = false;
     ioeventfd_update_pending = false;
+    QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
+        address_space_clear_dirty(as);
+    }
 }
 
 void memory_region_transaction_commit(void)
@@ -815,6 +1141,7 @@ static void memory_region_destructor_ram(MemoryRegion *mr)
 
 static void memory_region_destructor_alias(MemoryRegion *mr)
 {
+    QTAILQ_REMOVE(&mr->alias->aliases, mr, aliases_link);
     memory_region_unref(mr->alias);
 }
 
@@ -953,8 +1280,10 @@ static void memory_region_initfn(Object *obj)
     mr->ops = &unassigned_mem_ops;
     mr->enabled = true;
     mr->romd_mode = true;
+    mr->global_locking = true;
     mr->destructor = memory_region_destructor_none;
     QTAILQ_INIT(&mr->subregions);
+    QTAILQ_INIT(&mr->aliases);
     QTAILQ_INIT(&mr->coalesced);
 
     op = object_property_add(OBJECT(mr), "container",
@@ -1205,6 +1534,7 @@ void memory_region_init_alias(MemoryRegion *mr,
     mr->destructor = memory_region_destructor_alias;
     mr->alias = orig;
     mr->alias_offset = offset;
+    QTAILQ_INSERT_TAIL(&orig->aliases, mr, aliases_link);
 }
 
 void memory_region_init_rom_device(MemoryRegion *mr,
@@ -1356,6 +1686,7 @@ void memory_region_set_log(MemoryRegion *mr, bool log, unsigned client)
 
     memory_region_transaction_begin();
     mr->dirty_log_mask = (mr->dirty_log_mask & ~mask) | (log * mask);
+    memory_region_mark_dirty(mr);
     memory_region_update_pending |= mr->enabled;
     memory_region_transaction_commit();
 }
@@ -1382,6 +1713,7 @@ bool memory_region_test_and_clear_dirty(MemoryRegion *mr, hwaddr addr,
     ret = cpu_physical_memory_get_dirty(mr->ram_addr + addr, size, client);
     if (ret) {
         cpu_physical_memory_reset_dirty(mr->ram_addr + addr, size, client);
+        memory_region_clear_dirty_bitmap(mr, addr, size);
     }
     return ret;
 }
@@ -1403,11 +1735,62 @@ void memory_region_sync_dirty_bitmap(MemoryRegion *mr)
     }
 }
 
+/* Unlike the other dirty log entry points this may be called by the
+ * migration thread without the iothread lock.  The listener list is
+ * protected by memory_listeners_lock and the FlatView by RCU; listeners
+ * implementing log_clear must be bound to an address space and protect
+ * their own state, without calling back into the memory API.
+ */
+void memory_region_clear_dirty_bitmap(MemoryRegion *mr, hwaddr start,
+                                      hwaddr len)
+{
+    MemoryListener *listener;
+    FlatView *view;
+    FlatRange *fr;
+    hwaddr sec_start, sec_end;
+
+    qemu_mutex_lock(&memory_listeners_lock);
+    QTAILQ_FOREACH(listener, &memory_listeners, link) {
+        AddressSpace *as = listener->address_space_filter;
+
+        if (!listener->log_clear || !as) {
+            continue;
+        }
+        view = address_space_get_flatview(as);
+        FOR_EACH_FLAT_RANGE(fr, view) {
+            MemoryRegionSection section;
+
+            if (fr->mr != mr) {
+                continue;
+            }
+            sec_start = MAX(fr->offset_in_region, start);
+            sec_end = MIN(fr->offset_in_region + int128_get64(fr->addr.size),
+                          start + len);
+            if (sec_start >= sec_end) {
+                continue;
+            }
+            section = (MemoryRegionSection) {
+                .mr = fr->mr,
+                .address_space = as,
+                .offset_within_region = sec_start,
+                .size = int128_make64(sec_end - sec_start),
+                .offset_within_address_space = int128_get64(fr->addr.start) +
+                                               sec_start - fr->offset_in_region,
+                .readonly = fr->readonly,
+            };
+            listener->log_clear(listener, &section);
+        }
+        flatview_unref(view);
+    }
+    qemu_mutex_unlock(&memory_listeners_lock);
+}
+
 void memory_region_set_readonly(MemoryRegion *mr, bool readonly)
 {
     if (mr->readonly != readonly) {
         memory_region_transaction_begin();
         mr->readonly = readonly;
+        memory_region_mark_dirty(mr);
         memory_region_update_pending |= mr->enabled;
         memory_region_transaction_commit();
     }
@@ -1418,6 +1801,7 @@ void memory_region_rom_device_set_romd(MemoryRegion *mr, bool romd_mode)
     if (mr->romd_mode != romd_mode) {
         memory_region_transaction_begin();
         mr->romd_mode = romd_mode;
+        memory_region_mark_dirty(mr);
         memory_region_update_pending |= mr->enabled;
         memory_region_transaction_commit();
     }
@@ -1428,6 +1812,7 @@ void memory_region_reset_dirty(MemoryRegion *mr, hwaddr addr,
 {
     assert(mr->terminates);
     cpu_physical_memory_reset_dirty(mr->ram_addr + addr, size, client);
+    memory_region_clear_dirty_bitmap(mr, addr, size);
 }
 
 int memory_region_get_fd(MemoryRegion *mr)
@@ -1441,6 +1826,17 @@ int memory_region_get_fd(MemoryRegion *mr)
     return qemu_get_ram_fd(mr->ram_addr & TARGET_PAGE_MASK);
 }
 
+bool memory_region_is_shared(MemoryRegion *mr)
+{
+    if (mr->alias) {
+        return memory_region_is_shared(mr->alias);
+    }
+
+    assert(mr->terminates);
+
+    return qemu_ram_addr_is_shared(mr->ram_addr & TARGET_PAGE_MASK);
+}
+
 void *memory_region_get_ram_ptr(MemoryRegion *mr)
 {
     if (mr->alias) {
@@ -1549,6 +1945,16 @@ void memory_region_clear_flush_coalesced(MemoryRegion *mr)
     }
 }
 
+void memory_region_set_global_locking(MemoryRegion *mr)
+{
+    mr->global_locking = true;
+}
+
+void memory_region_clear_global_locking(MemoryRegion *mr)
+{
+    mr->global_locking = false;
+}
+
 void memory_region_add_eventfd(MemoryRegion *mr,
                                hwaddr addr,
                                unsigned size,
@@ -1653,6 +2059,7 @@ static void memory_region_update_container_subregions(MemoryRegion *subregion)
     }
     QTAILQ_INSERT_TAIL(&mr->subregions, subregion, subregions_link);
 done:
+    memory_region_mark_dirty(subregion);
     memory_region_update_pending |= mr->enabled && subregion->enabled;
     memory_region_transaction_commit();
 }
@@ -1691,6 +2098,7 @@ void memory_region_del_subregion(MemoryRegion *mr,
 {
     memory_region_transaction_begin();
     assert(subregion->container == mr);
+    memory_region_mark_dirty(subregion);
     subregion->container = NULL;
     QTAILQ_REMOVE(&mr->subregions, subregion, subregions_link);
     memory_region_unref(subregion);
@@ -1705,6 +2113,7 @@ void memory_region_set_enabled(MemoryRegion *mr, bool enabled)
     }
     memory_region_transaction_begin();
     mr->enabled = enabled;
+    memory_region_mark_dirty(mr);
     memory_region_update_pending = true;
     memory_region_transaction_commit();
 }
@@ -1720,7 +2129,9 @@ void memory_region_set_size(MemoryRegion *mr, uint64_t size)
         return;
     }
     memory_region_transaction_begin();
+    memory_region_mark_dirty(mr);
     mr->size = s;
+    memory_region_mark_dirty(mr);
     memory_region_update_pending = true;
     memory_region_transaction_commit();
 }
@@ -1743,8 +2154,11 @@ static void memory_region_readd_subregion(MemoryRegion *mr)
 void memory_region_set_address(MemoryRegion *mr, hwaddr addr)
 {
     if (addr != mr->addr) {
+        memory_region_transaction_begin();
+        memory_region_mark_dirty(mr);
         mr->addr = addr;
         memory_region_readd_subregion(mr);
+        memory_region_transaction_commit();
     }
 }
 
@@ -1758,6 +2172,7 @@ void memory_region_set_alias_offset(MemoryRegion *mr, hwaddr offset)
 
     memory_region_transaction_begin();
     mr->alias_offset = offset;
+    memory_region_mark_dirty(mr);
     memory_region_update_pending |= mr->enabled;
     memory_region_transaction_commit();
 }
@@ -1918,6 +2333,7 @@ void memory_listener_register(MemoryListener *listener, AddressSpace *filter)
     AddressSpace *as;
 
     listener->address_space_filter = filter;
+    qemu_mutex_lock(&memory_listeners_lock);
     if (QTAILQ_EMPTY(&memory_listeners)
         || listener->priority >= QTAILQ_LAST(&memory_listeners,
                                              memory_listeners)->priority) {
@@ -1930,6 +2346,7 @@ void memory_listener_register(MemoryListener *listener, AddressSpace *filter)
         }
         QTAILQ_INSERT_BEFORE(other, listener, link);
     }
+    qemu_mutex_unlock(&memory_listeners_lock);
 
     QTAILQ_FOREACH(as, &address_spaces, address_spaces_link) {
         listener_add_address_space(listener, as);
@@ -1938,7 +2355,9 @@ void memory_listener_register(MemoryListener *listener, AddressSpace *filter)
 
 void memory_listener_unregister(MemoryListener *listener)
 {
+    qemu_mutex_lock(&memory_listeners_lock);
     QTAILQ_REMOVE(&memory_listeners, listener, link);
+    qemu_mutex_unlock(&memory_listeners_lock);
 }
 
 void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
@@ -1947,6 +2366,9 @@ void address_space_init(AddressSpace *as, MemoryRegion *root, const char *name)
     as->root = root;
     as->current_map = g_new(FlatView, 1);
     flatview_init(as->current_map);
+    as->dirty_ranges = NULL;
+    as->dirty_nb = 0;
+    as->dirty_all = true;
     as->ioeventfd_nb = 0;
     as->ioeventfds = NULL;
     QTAILQ_INSERT_TAIL(&address_spaces, as, address_spaces_link);
@@ -1968,6 +2390,7 @@ static void do_address_space_destroy(AddressSpace *as)
 
     flatview_unref(as->current_map);
     g_free(as->name);
+    g_free(as->dirty_ranges);
     g_free(as->ioeventfds);
 }
 
@@ -1976,6 +2399,7 @@ void address_space_destroy(AddressSpace *as)
     /* Flush out anything from MemoryListeners listening in on this */
     memory_region_transaction_begin();
     as->root = NULL;
+    as->dirty_all = true;
     memory_region_transaction_commit();
     QTAILQ_REMOVE(&address_spaces, as, address_spaces_link);
     address_space_unregister(as);
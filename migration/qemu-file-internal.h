@@ -27,6 +27,7 @@
 
 #include "qemu-common.h"
 #include "qemu/iov.h"
+#include "qemu/bitmap.h"
 
 #define IO_BUF_SIZE 32768
 #define MAX_IOV_SIZE MIN(IOV_MAX, 64)
@@ -46,6 +47,9 @@ struct QEMUFile {
 
     struct iovec iov[MAX_IOV_SIZE];
     unsigned int iovcnt;
+    bool zerocopy;
+    /* iov entries that point outside buf and may be sent without copy */
+    DECLARE_BITMAP(iov_zerocopy, MAX_IOV_SIZE);
 
     int last_error;
 };
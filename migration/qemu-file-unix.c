@@ -24,13 +24,38 @@
 #include "qemu-common.h"
 #include "qemu/iov.h"
 #include "qemu/sockets.h"
+#include "qemu/queue.h"
+#include "qemu/timer.h"
 #include "block/coroutine.h"
 #include "migration/qemu-file.h"
 #include "migration/qemu-file-internal.h"
+#include "trace.h"
+
+#ifdef CONFIG_MSG_ZEROCOPY
+#include <poll.h>
+#include <linux/errqueue.h>
+
+/* How long to wait for the peer to acknowledge outstanding sends */
+#define ZEROCOPY_REAP_TIMEOUT_MS    10000
+#endif
+
+/*
+ * Bytes of a zero-copy send that had to be copied anyway (headers and
+ * device state living in the QEMUFile buffer).  They are kept until the
+ * kernel reports that it is done with send @seq.
+ */
+typedef struct QEMUFileSocketBounce {
+    uint32_t seq;
+    uint8_t *data;
+    QSIMPLEQ_ENTRY(QEMUFileSocketBounce) next;
+} QEMUFileSocketBounce;
 
 typedef struct QEMUFileSocket {
     int fd;
     QEMUFile *file;
+    uint32_t zerocopy_sent;     /* MSG_ZEROCOPY sends issued */
+    uint32_t zerocopy_done;     /* MSG_ZEROCOPY sends completed */
+    QSIMPLEQ_HEAD(, QEMUFileSocketBounce) bounces;
 } QEMUFileSocket;
 
 static ssize_t socket_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
@@ -47,6 +72,183 @@ static ssize_t socket_writev_buffer(void *opaque, struct iovec *iov, int iovcnt,
     return len;
 }
 
+#ifdef CONFIG_MSG_ZEROCOPY
+static void socket_zerocopy_free_bounces(QEMUFileSocket *s)
+{
+    QEMUFileSocketBounce *b;
+
+    while ((b = QSIMPLEQ_FIRST(&s->bounces)) != NULL &&
+           (int32_t)(b->seq - s->zerocopy_done) < 0) {
+        QSIMPLEQ_REMOVE_HEAD(&s->bounces, next);
+        g_free(b->data);
+        g_free(b);
+    }
+}
+
+/*
+ * Reap MSG_ZEROCOPY completions from the socket error queue.  Unless @wait
+ * is set this only consumes what is already there; otherwise it returns
+ * once every send issued so far has completed, or fails with -ETIMEDOUT
+ * if the peer does not acknowledge them within ZEROCOPY_REAP_TIMEOUT_MS.
+ * TCP completes sends in order, so a notification for [lo, hi] retires
+ * everything up to hi.
+ */
+static int socket_zerocopy_reap(QEMUFileSocket *s, bool wait)
+{
+    int64_t deadline = 0;
+
+    while (s->zerocopy_done != s->zerocopy_sent) {
+        char control[CMSG_SPACE(sizeof(struct sock_extended_err))];
+        struct msghdr msg = {
+            .msg_control = control,
+            .msg_controllen = sizeof(control),
+        };
+        struct sock_extended_err *serr;
+        struct cmsghdr *cm;
+        ssize_t ret;
+
+        ret = recvmsg(s->fd, &msg, MSG_ERRQUEUE);
+        if (ret < 0) {
+            if (errno == EAGAIN && wait) {
+                struct pollfd pfd = { .fd = s->fd };
+                int64_t now = get_clock() / SCALE_MS;
+
+                if (!deadline) {
+                    deadline = now + ZEROCOPY_REAP_TIMEOUT_MS;
+                } else if (now >= deadline) {
+                    return -ETIMEDOUT;
+                }
+                /* POLLERR is reported whatever the requested events are */
+                if (poll(&pfd, 1, deadline - now) < 0 && errno != EINTR) {
+                    return -errno;
+                }
+                if (pfd.revents & POLLHUP) {
+                    /* Nothing will be acknowledged any more */
+                    return -EPIPE;
+                }
+                continue;
+            } else if (errno == EINTR) {
+                continue;
+            } else if (errno == EAGAIN) {
+                break;
+            }
+            return -errno;
+        }
+
+        cm = CMSG_FIRSTHDR(&msg);
+        if (!cm || !((cm->cmsg_level == SOL_IP && cm->cmsg_type == IP_RECVERR) ||
+                     (cm->cmsg_level == SOL_IPV6 &&
+                      cm->cmsg_type == IPV6_RECVERR))) {
+            continue;
+        }
+        serr = (struct sock_extended_err *)CMSG_DATA(cm);
+        if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0) {
+            continue;
+        }
+
+        trace_qemu_file_zerocopy_complete(serr->ee_info, serr->ee_data,
+                                          serr->ee_code &
+                                          SO_EE_CODE_ZEROCOPY_COPIED);
+        s->zerocopy_done = serr->ee_data + 1;
+        socket_zerocopy_free_bounces(s);
+    }
+    return 0;
+}
+
+static ssize_t socket_writev_buffer_zerocopy(void *opaque, struct iovec *iov,
+                                             int iovcnt,
+                                             const unsigned long *zerocopy,
+                                             int64_t pos)
+{
+    QEMUFileSocket *s = opaque;
+    QEMUFileSocketBounce *b = NULL;
+    unsigned int cnt = iovcnt;
+    ssize_t size = iov_size(iov, iovcnt);
+    size_t copied = 0;
+    ssize_t total = 0;
+    int i, ret;
+
+    /* Anything that lives in the QEMUFile buffer is copied aside */
+    for (i = 0; i < iovcnt; i++) {
+        if (!test_bit(i, zerocopy)) {
+            copied += iov[i].iov_len;
+        }
+    }
+    if (copied) {
+        b = g_new0(QEMUFileSocketBounce, 1);
+        b->data = g_malloc(copied);
+        copied = 0;
+        for (i = 0; i < iovcnt; i++) {
+            if (!test_bit(i, zerocopy)) {
+                memcpy(b->data + copied, iov[i].iov_base, iov[i].iov_len);
+                iov[i].iov_base = b->data + copied;
+                copied += iov[i].iov_len;
+            }
+        }
+    }
+
+    while (total < size) {
+        struct msghdr msg = {
+            .msg_iov = iov,
+            .msg_iovlen = cnt,
+        };
+        ssize_t len;
+
+        len = sendmsg(s->fd, &msg, MSG_ZEROCOPY);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            } else if (errno == ENOBUFS) {
+                /* Too much pinned memory outstanding, let some complete */
+                ret = socket_zerocopy_reap(s, true);
+                if (ret < 0) {
+                    total = ret;
+                    break;
+                }
+                continue;
+            }
+            total = -errno;
+            break;
+        }
+        s->zerocopy_sent++;
+        iov_discard_front(&iov, &cnt, len);
+        total += len;
+    }
+
+    if (b && s->zerocopy_sent != s->zerocopy_done) {
+        b->seq = s->zerocopy_sent - 1;
+        QSIMPLEQ_INSERT_TAIL(&s->bounces, b, next);
+    } else if (b) {
+        g_free(b->data);
+        g_free(b);
+    }
+
+    ret = socket_zerocopy_reap(s, false);
+    if (total >= 0 && ret < 0) {
+        total = ret;
+    }
+    return total;
+}
+
+static int socket_set_zerocopy(void *opaque, bool enable)
+{
+    QEMUFileSocket *s = opaque;
+    int val = enable;
+    int ret;
+
+    if (!enable) {
+        ret = socket_zerocopy_reap(s, true);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    if (setsockopt(s->fd, SOL_SOCKET, SO_ZEROCOPY, &val, sizeof(val)) < 0) {
+        return -errno;
+    }
+    return 0;
+}
+#endif
+
 static int socket_get_fd(void *opaque)
 {
     QEMUFileSocket *s = opaque;
@@ -80,6 +282,21 @@ static int socket_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
 static int socket_close(void *opaque)
 {
     QEMUFileSocket *s = opaque;
+
+#ifdef CONFIG_MSG_ZEROCOPY
+    /*
+     * The kernel may still be reading the bounce buffers.  Do not wait
+     * for a stream that already failed, nor for a peer that stopped
+     * reading: shut the socket down so that the kernel drops the data
+     * it still holds, then free the buffers.
+     */
+    if (s->zerocopy_sent != s->zerocopy_done &&
+        (qemu_file_get_error(s->file) || socket_zerocopy_reap(s, true) < 0)) {
+        shutdown(s->fd, SHUT_RDWR);
+    }
+    s->zerocopy_done = s->zerocopy_sent;
+    socket_zerocopy_free_bounces(s);
+#endif
     closesocket(s->fd);
     g_free(s);
     return 0;
@@ -161,6 +378,18 @@ static int unix_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
     return len;
 }
 
+static int64_t unix_seek(void *opaque, int64_t offset, int whence)
+{
+    QEMUFileSocket *s = opaque;
+    off_t ret;
+
+    ret = lseek(s->fd, offset, whence);
+    if (ret == (off_t)-1) {
+        return -errno;
+    }
+    return ret;
+}
+
 static int unix_close(void *opaque)
 {
     QEMUFileSocket *s = opaque;
@@ -172,6 +401,7 @@ static int unix_close(void *opaque)
 static const QEMUFileOps unix_read_ops = {
     .get_fd =     socket_get_fd,
     .get_buffer = unix_get_buffer,
+    .seek =       unix_seek,
     .close =      unix_close
 };
 
@@ -215,7 +445,11 @@ static const QEMUFileOps socket_write_ops = {
     .get_fd        = socket_get_fd,
     .writev_buffer = socket_writev_buffer,
     .close         = socket_close,
-    .shut_down     = socket_shutdown
+    .shut_down     = socket_shutdown,
+#ifdef CONFIG_MSG_ZEROCOPY
+    .writev_buffer_zerocopy = socket_writev_buffer_zerocopy,
+    .set_zerocopy  = socket_set_zerocopy,
+#endif
 };
 
 QEMUFile *qemu_fopen_socket(int fd, const char *mode)
@@ -228,6 +462,7 @@ QEMUFile *qemu_fopen_socket(int fd, const char *mode)
 
     s = g_malloc0(sizeof(QEMUFileSocket));
     s->fd = fd;
+    QSIMPLEQ_INIT(&s->bounces);
     if (mode[0] == 'w') {
         qemu_set_block(s->fd);
         s->file = qemu_fopen_ops(s, &socket_write_ops);
@@ -89,6 +89,28 @@ bool qemu_file_is_writable(QEMUFile *f)
     return f->ops->writev_buffer || f->ops->put_buffer;
 }
 
+/*
+ * Switch buffers queued with qemu_put_buffer_async to zero-copy sends.
+ *
+ * Returns 0 on success, -ENOTSUP if the file has no zero-copy support or
+ * the transport's error otherwise.
+ */
+int qemu_file_set_zerocopy(QEMUFile *f, bool enable)
+{
+    int ret;
+
+    if (!f->ops->set_zerocopy || !f->ops->writev_buffer_zerocopy) {
+        return -ENOTSUP;
+    }
+
+    qemu_fflush(f);
+    ret = f->ops->set_zerocopy(f->opaque, enable);
+    if (ret == 0) {
+        f->zerocopy = enable;
+    }
+    return ret;
+}
+
 /**
  * Flushes QEMUFile buffer
  *
@@ -104,7 +126,10 @@ void qemu_fflush(QEMUFile *f)
     }
 
     if (f->ops->writev_buffer) {
-        if (f->iovcnt > 0) {
+        if (f->iovcnt > 0 && f->zerocopy) {
+            ret = f->ops->writev_buffer_zerocopy(f->opaque, f->iov, f->iovcnt,
+                                                 f->iov_zerocopy, f->pos);
+        } else if (f->iovcnt > 0) {
             ret = f->ops->writev_buffer(f->opaque, f->iov, f->iovcnt, f->pos);
         }
     } else {
@@ -225,6 +250,59 @@ int qemu_get_fd(QEMUFile *f)
     return -1;
 }
 
+/*
+ * For a file that reads from a seekable file descriptor, return the
+ * descriptor and store in @offset the position in it that corresponds
+ * to the current read position, so that the caller can mmap the data
+ * that follows instead of reading it.  Returns -ENOTSUP for other files.
+ */
+int qemu_file_get_mapping(QEMUFile *f, int64_t *offset)
+{
+    int64_t pos;
+
+    if (qemu_file_is_writable(f) || !f->ops->seek) {
+        return -ENOTSUP;
+    }
+
+    pos = f->ops->seek(f->opaque, 0, SEEK_CUR);
+    if (pos < 0) {
+        return -ENOTSUP;
+    }
+
+    /* The file descriptor is past the data that is still in the buffer */
+    *offset = pos - (f->buf_size - f->buf_index);
+    return qemu_get_fd(f);
+}
+
+/*
+ * Skip 'size' bytes of input without reading them; only for files on
+ * which qemu_file_get_mapping succeeded.
+ * Returns 0 on success, or -err, which is also set as the file's error.
+ */
+int qemu_file_seek_forward(QEMUFile *f, int64_t size)
+{
+    int pending = f->buf_size - f->buf_index;
+    int64_t ret;
+
+    assert(f->ops->seek);
+
+    if (size <= pending) {
+        f->buf_index += size;
+        return 0;
+    }
+
+    ret = f->ops->seek(f->opaque, size - pending, SEEK_CUR);
+    if (ret < 0) {
+        qemu_file_set_error(f, ret);
+        return ret;
+    }
+
+    f->pos += size - pending;
+    f->buf_index = 0;
+    f->buf_size = 0;
+    return 0;
+}
+
 void qemu_update_position(QEMUFile *f, size_t size)
 {
     f->pos += size;
@@ -261,13 +339,20 @@ int qemu_fclose(QEMUFile *f)
     return ret;
 }
 
-static void add_to_iovec(QEMUFile *f, const uint8_t *buf, int size)
+static void add_to_iovec(QEMUFile *f, const uint8_t *buf, int size,
+                         bool zerocopy)
 {
     /* check for adjacent buffer and coalesce them */
     if (f->iovcnt > 0 && buf == f->iov[f->iovcnt - 1].iov_base +
-        f->iov[f->iovcnt - 1].iov_len) {
+        f->iov[f->iovcnt - 1].iov_len &&
+        zerocopy == test_bit(f->iovcnt - 1, f->iov_zerocopy)) {
         f->iov[f->iovcnt - 1].iov_len += size;
     } else {
+        if (zerocopy) {
+            set_bit(f->iovcnt, f->iov_zerocopy);
+        } else {
+            clear_bit(f->iovcnt, f->iov_zerocopy);
+        }
         f->iov[f->iovcnt].iov_base = (uint8_t *)buf;
         f->iov[f->iovcnt++].iov_len = size;
     }
@@ -289,7 +374,7 @@ void qemu_put_buffer_async(QEMUFile *f, const uint8_t *buf, int size)
     }
 
     f->bytes_xfer += size;
-    add_to_iovec(f, buf, size);
+    add_to_iovec(f, buf, size, true);
 }
 
 void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
@@ -308,7 +393,7 @@ void qemu_put_buffer(QEMUFile *f, const uint8_t *buf, int size)
         memcpy(f->buf + f->buf_index, buf, l);
         f->bytes_xfer += l;
         if (f->ops->writev_buffer) {
-            add_to_iovec(f, f->buf + f->buf_index, l);
+            add_to_iovec(f, f->buf + f->buf_index, l, false);
         }
         f->buf_index += l;
         if (f->buf_index == IO_BUF_SIZE) {
@@ -331,7 +416,7 @@ void qemu_put_byte(QEMUFile *f, int v)
     f->buf[f->buf_index] = v;
     f->bytes_xfer++;
     if (f->ops->writev_buffer) {
-        add_to_iovec(f, f->buf + f->buf_index, 1);
+        add_to_iovec(f, f->buf + f->buf_index, 1, false);
     }
     f->buf_index++;
     if (f->buf_index == IO_BUF_SIZE) {
@@ -457,6 +542,11 @@ int64_t qemu_ftell_fast(QEMUFile *f)
     int64_t ret = f->pos;
     int i;
 
+    if (!qemu_file_is_writable(f)) {
+        /* pos is the end of the buffered data when reading */
+        return ret - f->buf_size + f->buf_index;
+    }
+
     if (f->ops->writev_buffer) {
         for (i = 0; i < f->iovcnt; i++) {
             ret += f->iov[i].iov_len;
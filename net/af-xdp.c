@@ -0,0 +1,437 @@
+/*
+ * AF_XDP network backend.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+
+#include <sys/socket.h>
+#include <net/if.h>
+#include <linux/if_link.h>
+#include <xdp/xsk.h>
+
+#include "net/net.h"
+#include "clients.h"
+#include "sysemu/sysemu.h"
+#include "qemu/error-report.h"
+#include "qemu/iov.h"
+#include "qemu/timer.h"
+
+/* Maximum number of frames forwarded to the peer in one read callback. */
+#define AF_XDP_BATCH_SIZE   64
+
+/* Frames owned by the fill/rx rings plus frames owned by the tx/cq rings. */
+#define AF_XDP_NUM_FRAMES   (XSK_RING_PROD__DEFAULT_NUM_DESCS * 2)
+
+/* How often to look for TX completions while every frame is in flight. */
+#define AF_XDP_TX_RETRY_US  50
+
+typedef struct AFXDPState {
+    NetClientState          nc;
+    struct xsk_socket       *xsk;
+    struct xsk_umem         *umem;
+    struct xsk_ring_cons    rx;
+    struct xsk_ring_prod    tx;
+    struct xsk_ring_cons    cq;
+    struct xsk_ring_prod    fq;
+    char                    *buffer;
+    uint64_t                *pool;      /* Stack of free UMEM frame addresses. */
+    uint32_t                n_pool;
+    bool                    read_poll;
+    bool                    write_poll;
+    QEMUTimer               *tx_timer;  /* Waits for frames to complete. */
+    char                    ifname[IFNAMSIZ];
+    uint32_t                xdp_flags;
+} AFXDPState;
+
+/* Tell the event-loop if the AF_XDP backend can send packets
+   to the frontend. */
+static int af_xdp_can_send(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    return qemu_can_send_packet(&s->nc);
+}
+
+static void af_xdp_send(void *opaque);
+static void af_xdp_writable(void *opaque);
+
+/* Set the event-loop handlers for the AF_XDP backend. */
+static void af_xdp_update_fd_handler(AFXDPState *s)
+{
+    qemu_set_fd_handler2(xsk_socket__fd(s->xsk),
+                         s->read_poll  ? af_xdp_can_send : NULL,
+                         s->read_poll  ? af_xdp_send     : NULL,
+                         s->write_poll ? af_xdp_writable : NULL,
+                         s);
+}
+
+/* Update the read handler. */
+static void af_xdp_read_poll(AFXDPState *s, bool enable)
+{
+    if (s->read_poll != enable) { /* Do nothing if not changed. */
+        s->read_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+/* Update the write handler. */
+static void af_xdp_write_poll(AFXDPState *s, bool enable)
+{
+    if (s->write_poll != enable) {
+        s->write_poll = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+static void af_xdp_poll(NetClientState *nc, bool enable)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    if (s->read_poll != enable || s->write_poll != enable) {
+        s->write_poll = enable;
+        s->read_poll  = enable;
+        af_xdp_update_fd_handler(s);
+    }
+}
+
+/* Return the frames of transmitted packets to the pool. */
+static void af_xdp_complete_tx(AFXDPState *s)
+{
+    uint32_t idx = 0;
+    uint32_t i, n;
+
+    n = xsk_ring_cons__peek(&s->cq, XSK_RING_CONS__DEFAULT_NUM_DESCS, &idx);
+    for (i = 0; i < n; i++) {
+        s->pool[s->n_pool++] = *xsk_ring_cons__comp_addr(&s->cq, idx++);
+    }
+    xsk_ring_cons__release(&s->cq, n);
+}
+
+/* Give up to @n free frames to the kernel for packet reception. */
+static void af_xdp_fq_refill(AFXDPState *s, uint32_t n)
+{
+    uint32_t idx = 0;
+    uint32_t i;
+
+    n = MIN(n, s->n_pool);
+    if (!n || !xsk_ring_prod__reserve(&s->fq, n, &idx)) {
+        return;
+    }
+    for (i = 0; i < n; i++) {
+        *xsk_ring_prod__fill_addr(&s->fq, idx++) = s->pool[--s->n_pool];
+    }
+    xsk_ring_prod__submit(&s->fq, n);
+
+    if (xsk_ring_prod__needs_wakeup(&s->fq)) {
+        /* Kick the kernel: the fill queue was empty. */
+        recvfrom(xsk_socket__fd(s->xsk), NULL, 0, MSG_DONTWAIT, NULL, NULL);
+    }
+}
+
+/*
+ * The fd_write() callback, invoked if the fd is marked as
+ * writable after a poll. Unregister the handler and flush any
+ * buffered packets.
+ */
+static void af_xdp_writable(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    af_xdp_complete_tx(s);
+    af_xdp_write_poll(s, false);
+    qemu_flush_queued_packets(&s->nc);
+}
+
+/* Timer callback while the frame pool is empty: flush once frames are back. */
+static void af_xdp_tx_retry(void *opaque)
+{
+    AFXDPState *s = opaque;
+
+    af_xdp_complete_tx(s);
+    qemu_flush_queued_packets(&s->nc);
+}
+
+static ssize_t af_xdp_receive_iov(NetClientState *nc,
+                                  const struct iovec *iov, int iovcnt)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+    struct xdp_desc *desc;
+    size_t size = iov_size(iov, iovcnt);
+    uint32_t idx = 0;
+
+    if (unlikely(size > XSK_UMEM__DEFAULT_FRAME_SIZE)) {
+        /* Drop. */
+        return size;
+    }
+
+    af_xdp_complete_tx(s);
+
+    if (!s->n_pool) {
+        /* No free frame.  POLLOUT only reports room in the TX ring, so it
+         * would fire over and over; check the completion queue from a
+         * timer until frames come back instead.
+         */
+        if (!timer_pending(s->tx_timer)) {
+            timer_mod(s->tx_timer, qemu_clock_get_us(QEMU_CLOCK_REALTIME) +
+                                   AF_XDP_TX_RETRY_US);
+        }
+        return 0;
+    }
+    if (!xsk_ring_prod__reserve(&s->tx, 1, &idx)) {
+        /* No TX slot; wait for the kernel to drain the ring. */
+        af_xdp_write_poll(s, true);
+        return 0;
+    }
+
+    desc = xsk_ring_prod__tx_desc(&s->tx, idx);
+    desc->addr = s->pool[--s->n_pool];
+    desc->len = iov_to_buf(iov, iovcnt, 0,
+                           xsk_umem__get_data(s->buffer, desc->addr), size);
+    xsk_ring_prod__submit(&s->tx, 1);
+
+    if (xsk_ring_prod__needs_wakeup(&s->tx)) {
+        /* Kick the kernel to start transmission. */
+        sendto(xsk_socket__fd(s->xsk), NULL, 0, MSG_DONTWAIT, NULL, 0);
+    }
+
+    return size;
+}
+
+static ssize_t af_xdp_receive(NetClientState *nc,
+                              const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    return af_xdp_receive_iov(nc, &iov, 1);
+}
+
+/* Complete a previous send (backend --> guest) and enable the
+   fd_read callback. */
+static void af_xdp_send_completed(NetClientState *nc, ssize_t len)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    af_xdp_read_poll(s, true);
+}
+
+static void af_xdp_send(void *opaque)
+{
+    AFXDPState *s = opaque;
+    uint32_t idx = 0;
+    uint32_t i, n;
+
+    n = xsk_ring_cons__peek(&s->rx, AF_XDP_BATCH_SIZE, &idx);
+    for (i = 0; i < n; ) {
+        const struct xdp_desc *desc = xsk_ring_cons__rx_desc(&s->rx, idx++);
+        ssize_t size;
+
+        i++;
+        size = qemu_send_packet_async(&s->nc,
+                                      xsk_umem__get_data(s->buffer,
+                                                         desc->addr),
+                                      desc->len, af_xdp_send_completed);
+
+        /* The net queue copies packets it cannot deliver right away,
+         * so the frame can be recycled in either case.
+         */
+        s->pool[s->n_pool++] = xsk_umem__extract_addr(desc->addr);
+
+        if (size == 0) {
+            /* The peer does not receive anymore. Packet is queued, stop
+             * reading from the backend until af_xdp_send_completed()
+             */
+            af_xdp_read_poll(s, false);
+            break;
+        }
+    }
+    xsk_ring_cons__release(&s->rx, i);
+    af_xdp_fq_refill(s, i);
+}
+
+/* Flush and close. */
+static void af_xdp_cleanup(NetClientState *nc)
+{
+    AFXDPState *s = DO_UPCAST(AFXDPState, nc, nc);
+
+    qemu_purge_queued_packets(nc);
+
+    if (s->tx_timer) {
+        timer_del(s->tx_timer);
+        timer_free(s->tx_timer);
+        s->tx_timer = NULL;
+    }
+    if (s->xsk) {
+        af_xdp_poll(nc, false);
+        xsk_socket__delete(s->xsk);
+        s->xsk = NULL;
+    }
+    if (s->umem) {
+        xsk_umem__delete(s->umem);
+        s->umem = NULL;
+    }
+    qemu_vfree(s->buffer);
+    s->buffer = NULL;
+    g_free(s->pool);
+    s->pool = NULL;
+}
+
+/* NetClientInfo methods */
+static NetClientInfo net_af_xdp_info = {
+    .type = NET_CLIENT_OPTIONS_KIND_AF_XDP,
+    .size = sizeof(AFXDPState),
+    .receive = af_xdp_receive,
+    .receive_iov = af_xdp_receive_iov,
+    .poll = af_xdp_poll,
+    .cleanup = af_xdp_cleanup,
+};
+
+static int af_xdp_umem_create(AFXDPState *s)
+{
+    struct xsk_umem_config config = {
+        .fill_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        .comp_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        .frame_size = XSK_UMEM__DEFAULT_FRAME_SIZE,
+        .frame_headroom = 0,
+    };
+    uint64_t size = (uint64_t)AF_XDP_NUM_FRAMES * XSK_UMEM__DEFAULT_FRAME_SIZE;
+    uint32_t i;
+    int ret;
+
+    s->buffer = qemu_memalign(getpagesize(), size);
+    memset(s->buffer, 0, size);
+
+    ret = xsk_umem__create(&s->umem, s->buffer, size, &s->fq, &s->cq, &config);
+    if (ret) {
+        error_report("af-xdp: failed to create umem for %s: %s",
+                     s->ifname, strerror(-ret));
+        return -1;
+    }
+
+    s->pool = g_new(uint64_t, AF_XDP_NUM_FRAMES);
+    s->n_pool = AF_XDP_NUM_FRAMES;
+    for (i = 0; i < AF_XDP_NUM_FRAMES; i++) {
+        s->pool[i] = (uint64_t)i * XSK_UMEM__DEFAULT_FRAME_SIZE;
+    }
+    return 0;
+}
+
+static int af_xdp_socket_create(AFXDPState *s, const NetdevAFXDPOptions *opts,
+                                int queue_id)
+{
+    struct xsk_socket_config cfg = {
+        .rx_size = XSK_RING_CONS__DEFAULT_NUM_DESCS,
+        .tx_size = XSK_RING_PROD__DEFAULT_NUM_DESCS,
+        .libxdp_flags = 0,
+        .bind_flags = XDP_USE_NEED_WAKEUP,
+        .xdp_flags = XDP_FLAGS_UPDATE_IF_NOEXIST,
+    };
+    int ret = -EINVAL;
+
+    if (opts->has_force_copy && opts->force_copy) {
+        cfg.bind_flags |= XDP_COPY;
+    }
+
+    if (s->xdp_flags) {
+        /* A previous queue already settled on a mode. */
+        cfg.xdp_flags |= s->xdp_flags;
+        ret = xsk_socket__create(&s->xsk, s->ifname, queue_id,
+                                 s->umem, &s->rx, &s->tx, &cfg);
+    } else {
+        if (!opts->has_mode || opts->mode == AFXDP_MODE_NATIVE) {
+            cfg.xdp_flags = XDP_FLAGS_UPDATE_IF_NOEXIST | XDP_FLAGS_DRV_MODE;
+            ret = xsk_socket__create(&s->xsk, s->ifname, queue_id,
+                                     s->umem, &s->rx, &s->tx, &cfg);
+            if (!ret) {
+                s->xdp_flags = XDP_FLAGS_DRV_MODE;
+            }
+        }
+        if (ret && (!opts->has_mode || opts->mode == AFXDP_MODE_SKB)) {
+            cfg.xdp_flags = XDP_FLAGS_UPDATE_IF_NOEXIST | XDP_FLAGS_SKB_MODE;
+            ret = xsk_socket__create(&s->xsk, s->ifname, queue_id,
+                                     s->umem, &s->rx, &s->tx, &cfg);
+            if (!ret) {
+                s->xdp_flags = XDP_FLAGS_SKB_MODE;
+            }
+        }
+    }
+
+    if (ret) {
+        s->xsk = NULL;
+        error_report("af-xdp: failed to create socket for %s queue %d: %s",
+                     s->ifname, queue_id, strerror(-ret));
+        return -1;
+    }
+    return 0;
+}
+
+/* The exported init function
+ *
+ * ... -netdev af-xdp,ifname="..."
+ */
+int net_init_af_xdp(const NetClientOptions *opts,
+                    const char *name, NetClientState *peer)
+{
+    const NetdevAFXDPOptions *af_xdp_opts = opts->af_xdp;
+    NetClientState *nc, *nc0 = NULL;
+    AFXDPState *s;
+    uint32_t xdp_flags = 0;
+    int64_t queues, start_queue, i;
+
+    queues = af_xdp_opts->has_queues ? af_xdp_opts->queues : 1;
+    start_queue = af_xdp_opts->has_start_queue ? af_xdp_opts->start_queue : 0;
+
+    /* QEMU vlans do not support multiqueue backends, in this case peer is
+     * set.  For -netdev, peer is always NULL. */
+    if (peer && queues > 1) {
+        error_report("Multiqueue af-xdp cannot be used with QEMU vlans");
+        return -1;
+    }
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_report("af-xdp: invalid number of queues (%" PRId64 ")",
+                     queues);
+        return -1;
+    }
+    if (start_queue < 0 || start_queue > INT_MAX - queues) {
+        error_report("af-xdp: invalid start queue (%" PRId64 ")",
+                     start_queue);
+        return -1;
+    }
+    if (!if_nametoindex(af_xdp_opts->ifname)) {
+        error_report("af-xdp: interface %s not found: %s",
+                     af_xdp_opts->ifname, strerror(errno));
+        return -1;
+    }
+
+    for (i = 0; i < queues; i++) {
+        nc = qemu_new_net_client(&net_af_xdp_info, peer, "af-xdp", name);
+        if (!nc0) {
+            nc0 = nc;
+        }
+        s = DO_UPCAST(AFXDPState, nc, nc);
+        pstrcpy(s->ifname, sizeof(s->ifname), af_xdp_opts->ifname);
+        s->xdp_flags = xdp_flags;
+        s->tx_timer = timer_new_us(QEMU_CLOCK_REALTIME, af_xdp_tx_retry, s);
+
+        if (af_xdp_umem_create(s) ||
+            af_xdp_socket_create(s, af_xdp_opts, start_queue + i)) {
+            /* Deletes all the queues created so far. */
+            qemu_del_net_client(nc0);
+            return -1;
+        }
+        xdp_flags = s->xdp_flags;
+        af_xdp_fq_refill(s, XSK_RING_PROD__DEFAULT_NUM_DESCS);
+
+        snprintf(nc->info_str, sizeof(nc->info_str),
+                 "af-xdp: ifname=%s queue=%" PRId64 " mode=%s",
+                 s->ifname, start_queue + i,
+                 s->xdp_flags == XDP_FLAGS_DRV_MODE ? "native" : "skb");
+        af_xdp_read_poll(s, true); /* Initially only poll for reads. */
+    }
+
+    return 0;
+}
@@ -0,0 +1,363 @@
+/*
+ * Generic receive offload for emulated NICs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+/*
+ * In-order TCP/IPv4 segments of the same flow that a backend sends to a
+ * NIC within one main loop iteration are merged into a single large frame,
+ * which is handed to the NIC with a virtio-net GSO header, exactly as a
+ * host kernel with GRO would do for tap.  This is only useful for NICs that
+ * can pass such frames to the guest (virtio-net with GUEST_TSO4, vmxnet3
+ * with LRO), and only works when frames carry a virtio-net header.
+ *
+ * Packets that cannot be merged are delivered as usual, after any segments
+ * of the same flow that are still held so that the flow stays in order.
+ */
+
+#include "net/net.h"
+#include "net/eth.h"
+#include "net/checksum.h"
+#include "net/tap.h"
+#include "qemu/iov.h"
+#include "qemu/main-loop.h"
+#include "gro.h"
+#include "trace.h"
+
+#define GRO_MAX_FLOWS       8
+#define GRO_MAX_SEGS        64
+/* Largest IPv4 datagram, i.e. largest ip_len of a merged frame. */
+#define GRO_MAX_IP_LEN      ETH_MAX_IP_DGRAM_LEN
+
+#define GRO_IP_HLEN         sizeof(struct ip_header)
+#define GRO_TCP_MAX_HLEN    60
+#define GRO_MAX_HDR_LEN     (sizeof(struct virtio_net_hdr_mrg_rxbuf) + \
+                             sizeof(struct eth_header) + GRO_IP_HLEN + \
+                             GRO_TCP_MAX_HLEN)
+
+#define GRO_TCP_FLAGS_MASK  0x0fff
+
+typedef struct NetGROFlow {
+    NetClientState *sender;
+    int segs;               /* 0 if the slot is free */
+    uint32_t saddr;
+    uint32_t daddr;
+    uint16_t sport;
+    uint16_t dport;
+    uint32_t next_seq;
+    uint16_t mss;
+    size_t hdr_len;         /* vnet header + Ethernet + IP + TCP */
+    size_t len;             /* bytes used in buf */
+    uint8_t *buf;
+} NetGROFlow;
+
+struct NetGRO {
+    NetClientState *nc;
+    int vnet_hdr_len;
+    QEMUBH *bh;
+    NetGROFlow flows[GRO_MAX_FLOWS];
+};
+
+/* Header pointers into a linear copy of the start of a frame. */
+typedef struct NetGROPacket {
+    struct virtio_net_hdr *vhdr;
+    struct ip_header *ip;
+    tcp_header *tcp;
+    size_t hdr_len;
+    size_t payload_len;
+    uint16_t tcp_flags;
+} NetGROPacket;
+
+static inline struct ip_header *net_gro_flow_ip(NetGRO *gro, NetGROFlow *f)
+{
+    return (struct ip_header *)(f->buf + gro->vnet_hdr_len +
+                                sizeof(struct eth_header));
+}
+
+static inline tcp_header *net_gro_flow_tcp(NetGRO *gro, NetGROFlow *f)
+{
+    return (tcp_header *)((uint8_t *)net_gro_flow_ip(gro, f) + GRO_IP_HLEN);
+}
+
+/*
+ * Parse the headers of a frame.  Return false unless it is a TCP/IPv4
+ * segment; @mergeable tells whether it may be coalesced with others.
+ */
+static bool net_gro_parse(NetGRO *gro, uint8_t *hdr, size_t hdr_size,
+                          size_t size, NetGROPacket *pkt, bool *mergeable)
+{
+    struct eth_header *eth = (struct eth_header *)(hdr + gro->vnet_hdr_len);
+    size_t l2_len = gro->vnet_hdr_len + sizeof(struct eth_header);
+    size_t ip_len, tcp_hlen;
+
+    if (hdr_size < l2_len + GRO_IP_HLEN + sizeof(tcp_header) ||
+        be16_to_cpu(eth->h_proto) != ETH_P_IP) {
+        return false;
+    }
+
+    pkt->vhdr = (struct virtio_net_hdr *)hdr;
+    pkt->ip = (struct ip_header *)(hdr + l2_len);
+    if (IP_HEADER_VERSION(pkt->ip) != IP_HEADER_VERSION_4 ||
+        IP_HDR_GET_LEN(pkt->ip) != GRO_IP_HLEN ||
+        pkt->ip->ip_p != IP_PROTO_TCP) {
+        return false;
+    }
+
+    pkt->tcp = (tcp_header *)((uint8_t *)pkt->ip + GRO_IP_HLEN);
+    tcp_hlen = (be16_to_cpu(pkt->tcp->th_offset_flags) >> 12) * 4;
+    ip_len = be16_to_cpu(pkt->ip->ip_len);
+    if (tcp_hlen < sizeof(tcp_header) ||
+        l2_len + GRO_IP_HLEN + tcp_hlen > hdr_size ||
+        GRO_IP_HLEN + tcp_hlen > ip_len || l2_len + ip_len > size) {
+        return false;
+    }
+
+    pkt->hdr_len = l2_len + GRO_IP_HLEN + tcp_hlen;
+    pkt->payload_len = ip_len - GRO_IP_HLEN - tcp_hlen;
+    pkt->tcp_flags = be16_to_cpu(pkt->tcp->th_offset_flags) &
+                     GRO_TCP_FLAGS_MASK;
+
+    /* Only plain data segments whose checksum the backend has either
+     * verified or left for the NIC are merged; anything else (SYN, FIN,
+     * RST, URG, ECN marks, fragments, GSO frames) goes through as is.
+     */
+    *mergeable = pkt->payload_len &&
+                 (pkt->tcp_flags & ~TH_PUSH) == TH_ACK &&
+                 !(be16_to_cpu(pkt->ip->ip_off) & (IP_MF | IP_OFFMASK)) &&
+                 IPTOS_ECN(pkt->ip->ip_tos) != IPTOS_ECN_CE &&
+                 pkt->vhdr->gso_type == VIRTIO_NET_HDR_GSO_NONE &&
+                 (pkt->vhdr->flags & (VIRTIO_NET_HDR_F_NEEDS_CSUM |
+                                      VIRTIO_NET_HDR_F_DATA_VALID));
+    return true;
+}
+
+static NetGROFlow *net_gro_find_flow(NetGRO *gro, NetGROPacket *pkt)
+{
+    int i;
+
+    for (i = 0; i < GRO_MAX_FLOWS; i++) {
+        NetGROFlow *f = &gro->flows[i];
+
+        if (f->segs &&
+            f->saddr == pkt->ip->ip_src && f->daddr == pkt->ip->ip_dst &&
+            f->sport == pkt->tcp->th_sport && f->dport == pkt->tcp->th_dport) {
+            return f;
+        }
+    }
+    return NULL;
+}
+
+/* Can @pkt be appended to the segments held in @f? */
+static bool net_gro_can_merge(NetGRO *gro, NetGROFlow *f, NetGROPacket *pkt,
+                              NetClientState *sender)
+{
+    struct ip_header *ip = net_gro_flow_ip(gro, f);
+    tcp_header *tcp = net_gro_flow_tcp(gro, f);
+    size_t tcp_hlen = pkt->hdr_len - gro->vnet_hdr_len -
+                      sizeof(struct eth_header) - GRO_IP_HLEN;
+
+    return f->sender == sender &&
+           f->hdr_len == pkt->hdr_len &&
+           f->segs < GRO_MAX_SEGS &&
+           be32_to_cpu(pkt->tcp->th_seq) == f->next_seq &&
+           pkt->payload_len <= f->mss &&
+           f->len - gro->vnet_hdr_len - sizeof(struct eth_header) +
+               pkt->payload_len <= GRO_MAX_IP_LEN &&
+           pkt->ip->ip_tos == ip->ip_tos &&
+           pkt->ip->ip_ttl == ip->ip_ttl &&
+           pkt->tcp->th_ack == tcp->th_ack &&
+           /* Options (e.g. timestamps) must match byte for byte. */
+           !memcmp((uint8_t *)pkt->tcp + sizeof(tcp_header),
+                   (uint8_t *)tcp + sizeof(tcp_header),
+                   tcp_hlen - sizeof(tcp_header));
+}
+
+static void net_gro_flush_flow(NetGRO *gro, NetGROFlow *f)
+{
+    NetClientState *sender = f->sender;
+
+    if (f->segs > 1) {
+        struct virtio_net_hdr *vhdr = (struct virtio_net_hdr *)f->buf;
+        struct ip_header *ip = net_gro_flow_ip(gro, f);
+        tcp_header *tcp = net_gro_flow_tcp(gro, f);
+        uint16_t ip_len = f->len - gro->vnet_hdr_len -
+                          sizeof(struct eth_header);
+        uint32_t csum;
+
+        ip->ip_len = cpu_to_be16(ip_len);
+        eth_fix_ip4_checksum(ip, GRO_IP_HLEN);
+
+        /* Leave the TCP checksum to the guest, like a GSO frame from tap:
+         * the field holds the folded pseudo-header sum.
+         */
+        csum = eth_calc_pseudo_hdr_csum(ip, ip_len - GRO_IP_HLEN);
+        tcp->th_sum = cpu_to_be16((uint16_t)~net_checksum_finish(csum));
+
+        vhdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+        vhdr->gso_type = VIRTIO_NET_HDR_GSO_TCPV4;
+        vhdr->hdr_len = f->hdr_len - gro->vnet_hdr_len;
+        vhdr->gso_size = f->mss;
+        vhdr->csum_start = sizeof(struct eth_header) + GRO_IP_HLEN;
+        vhdr->csum_offset = offsetof(tcp_header, th_sum);
+    }
+
+    trace_net_gro_flush(gro->nc, f->segs, f->len);
+    f->segs = 0;
+
+    if (!sender->link_down) {
+        qemu_net_queue_send(gro->nc->incoming_queue, sender,
+                            QEMU_NET_PACKET_FLAG_NONE, f->buf, f->len, NULL);
+    }
+}
+
+void net_gro_flush(NetGRO *gro)
+{
+    int i;
+
+    for (i = 0; i < GRO_MAX_FLOWS; i++) {
+        if (gro->flows[i].segs) {
+            net_gro_flush_flow(gro, &gro->flows[i]);
+        }
+    }
+}
+
+static void net_gro_bh(void *opaque)
+{
+    net_gro_flush(opaque);
+}
+
+static void net_gro_start_flow(NetGRO *gro, NetGROFlow *f, NetGROPacket *pkt,
+                               NetClientState *sender, uint8_t *hdr,
+                               const struct iovec *iov, int iovcnt)
+{
+    if (!f->buf) {
+        f->buf = g_malloc(gro->vnet_hdr_len + sizeof(struct eth_header) +
+                          GRO_MAX_IP_LEN);
+    }
+    f->sender = sender;
+    f->segs = 1;
+    f->saddr = pkt->ip->ip_src;
+    f->daddr = pkt->ip->ip_dst;
+    f->sport = pkt->tcp->th_sport;
+    f->dport = pkt->tcp->th_dport;
+    f->next_seq = be32_to_cpu(pkt->tcp->th_seq) + pkt->payload_len;
+    f->mss = pkt->payload_len;
+    f->hdr_len = pkt->hdr_len;
+    memcpy(f->buf, hdr, pkt->hdr_len);
+    f->len = pkt->hdr_len + iov_to_buf(iov, iovcnt, pkt->hdr_len,
+                                       f->buf + pkt->hdr_len,
+                                       pkt->payload_len);
+    qemu_bh_schedule(gro->bh);
+}
+
+/*
+ * Offer a packet from @sender to the GRO engine.  Return true if it was
+ * absorbed, false if the caller must deliver it as usual.
+ */
+bool net_gro_receive(NetGRO *gro, NetClientState *sender,
+                     const struct iovec *iov, int iovcnt)
+{
+    uint8_t hdr[GRO_MAX_HDR_LEN];
+    size_t size = iov_size(iov, iovcnt);
+    size_t hdr_size;
+    NetGROPacket pkt;
+    NetGROFlow *f;
+    bool mergeable;
+    int i;
+
+    hdr_size = iov_to_buf(iov, iovcnt, 0, hdr,
+                          gro->vnet_hdr_len + sizeof(struct eth_header) +
+                          GRO_IP_HLEN + GRO_TCP_MAX_HLEN);
+    if (!net_gro_parse(gro, hdr, hdr_size, size, &pkt, &mergeable)) {
+        return false;
+    }
+
+    f = net_gro_find_flow(gro, &pkt);
+    if (f && mergeable && net_gro_can_merge(gro, f, &pkt, sender)) {
+        tcp_header *tcp = net_gro_flow_tcp(gro, f);
+
+        f->len += iov_to_buf(iov, iovcnt, pkt.hdr_len, f->buf + f->len,
+                             pkt.payload_len);
+        f->next_seq += pkt.payload_len;
+        f->segs++;
+        tcp->th_win = pkt.tcp->th_win;
+        tcp->th_offset_flags |= pkt.tcp->th_offset_flags &
+                                cpu_to_be16(TH_PUSH);
+
+        /* A short or pushed segment ends the burst. */
+        if (pkt.payload_len < f->mss || (pkt.tcp_flags & TH_PUSH)) {
+            net_gro_flush_flow(gro, f);
+        }
+        return true;
+    }
+
+    if (f) {
+        /* Keep the flow in order. */
+        net_gro_flush_flow(gro, f);
+    }
+    if (!mergeable || (pkt.tcp_flags & TH_PUSH)) {
+        return false;
+    }
+
+    for (i = 0; i < GRO_MAX_FLOWS; i++) {
+        if (!gro->flows[i].segs) {
+            break;
+        }
+    }
+    if (i == GRO_MAX_FLOWS) {
+        /* Too many flows in this burst; make room. */
+        net_gro_flush(gro);
+        i = 0;
+    }
+
+    net_gro_start_flow(gro, &gro->flows[i], &pkt, sender, hdr, iov, iovcnt);
+    return true;
+}
+
+/* Drop the segments held for @sender, which is going away. */
+void net_gro_purge(NetGRO *gro, NetClientState *sender)
+{
+    int i;
+
+    for (i = 0; i < GRO_MAX_FLOWS; i++) {
+        if (gro->flows[i].sender == sender) {
+            gro->flows[i].segs = 0;
+            gro->flows[i].sender = NULL;
+        }
+    }
+}
+
+int net_gro_vnet_hdr_len(NetGRO *gro)
+{
+    return gro->vnet_hdr_len;
+}
+
+NetGRO *net_gro_new(NetClientState *nc, int vnet_hdr_len)
+{
+    NetGRO *gro = g_new0(NetGRO, 1);
+
+    assert(vnet_hdr_len >= sizeof(struct virtio_net_hdr) &&
+           vnet_hdr_len <= sizeof(struct virtio_net_hdr_mrg_rxbuf));
+
+    gro->nc = nc;
+    gro->vnet_hdr_len = vnet_hdr_len;
+    gro->bh = qemu_bh_new(net_gro_bh, gro);
+    return gro;
+}
+
+void net_gro_free(NetGRO *gro)
+{
+    int i;
+
+    if (!gro) {
+        return;
+    }
+    qemu_bh_delete(gro->bh);
+    for (i = 0; i < GRO_MAX_FLOWS; i++) {
+        g_free(gro->flows[i].buf);
+    }
+    g_free(gro);
+}
@@ -0,0 +1,23 @@
+/*
+ * Generic receive offload for emulated NICs
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef QEMU_NET_GRO_H
+#define QEMU_NET_GRO_H
+
+#include "qemu-common.h"
+#include "net/net.h"
+
+NetGRO *net_gro_new(NetClientState *nc, int vnet_hdr_len);
+void net_gro_free(NetGRO *gro);
+int net_gro_vnet_hdr_len(NetGRO *gro);
+bool net_gro_receive(NetGRO *gro, NetClientState *sender,
+                     const struct iovec *iov, int iovcnt);
+void net_gro_flush(NetGRO *gro);
+void net_gro_purge(NetGRO *gro, NetClientState *sender);
+
+#endif /* QEMU_NET_GRO_H */
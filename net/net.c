@@ -26,6 +26,7 @@
 #include "net/net.h"
 #include "clients.h"
 #include "hub.h"
+#include "gro.h"
 #include "net/slirp.h"
 #include "net/eth.h"
 #include "util.h"
@@ -299,6 +300,9 @@ static void qemu_cleanup_net_client(NetClientState *nc)
 {
     QTAILQ_REMOVE(&net_clients, nc, next);
 
+    if (nc->peer && nc->peer->gro) {
+        net_gro_purge(nc->peer->gro, nc);
+    }
     if (nc->info->cleanup) {
         nc->info->cleanup(nc);
     }
@@ -306,6 +310,7 @@ static void qemu_cleanup_net_client(NetClientState *nc)
 
 static void qemu_free_net_client(NetClientState *nc)
 {
+    net_gro_free(nc->gro);
     if (nc->incoming_queue) {
         qemu_del_net_queue(nc->incoming_queue);
     }
@@ -452,6 +457,27 @@ void qemu_set_vnet_hdr_len(NetClientState *nc, int len)
     nc->info->set_vnet_hdr_len(nc, len);
 }
 
+/*
+ * Enable or disable coalescing of TCP segments that the peer sends to the
+ * NIC @nc.  The NIC must accept GSO frames with a virtio-net header of
+ * @vnet_hdr_len bytes, which the peer must also be using.
+ */
+void qemu_set_gro(NetClientState *nc, bool enable, int vnet_hdr_len)
+{
+    if (nc->gro) {
+        if (enable && net_gro_vnet_hdr_len(nc->gro) == vnet_hdr_len) {
+            return;
+        }
+        net_gro_flush(nc->gro);
+        net_gro_free(nc->gro);
+        nc->gro = NULL;
+    }
+
+    if (enable) {
+        nc->gro = net_gro_new(nc, vnet_hdr_len);
+    }
+}
+
 int qemu_can_send_packet(NetClientState *sender)
 {
     int vm_running = runstate_is_running();
@@ -509,6 +535,9 @@ void qemu_purge_queued_packets(NetClientState *nc)
         return;
     }
 
+    if (nc->peer->gro) {
+        net_gro_purge(nc->peer->gro, nc);
+    }
     qemu_net_queue_purge(nc->peer->incoming_queue, nc);
 }
 
@@ -554,6 +583,17 @@ static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
         return size;
     }
 
+    if (sender->peer->gro && !(flags & QEMU_NET_PACKET_FLAG_RAW)) {
+        struct iovec iov = {
+            .iov_base = (void *)buf,
+            .iov_len = size,
+        };
+
+        if (net_gro_receive(sender->peer->gro, sender, &iov, 1)) {
+            return size;
+        }
+    }
+
     queue = sender->peer->incoming_queue;
 
     return qemu_net_queue_send(queue, sender, flags, buf, size, sent_cb);
@@ -619,9 +659,11 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
     return ret;
 }
 
-ssize_t qemu_sendv_packet_async(NetClientState *sender,
-                                const struct iovec *iov, int iovcnt,
-                                NetPacketSent *sent_cb)
+static ssize_t qemu_sendv_packet_async_with_flags(NetClientState *sender,
+                                                  unsigned flags,
+                                                  const struct iovec *iov,
+                                                  int iovcnt,
+                                                  NetPacketSent *sent_cb)
 {
     NetQueue *queue;
 
@@ -629,13 +671,40 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
         return iov_size(iov, iovcnt);
     }
 
+    if (sender->peer->gro && !(flags & QEMU_NET_PACKET_FLAG_RAW) &&
+        net_gro_receive(sender->peer->gro, sender, iov, iovcnt)) {
+        return iov_size(iov, iovcnt);
+    }
+
     queue = sender->peer->incoming_queue;
 
-    return qemu_net_queue_send_iov(queue, sender,
-                                   QEMU_NET_PACKET_FLAG_NONE,
+    return qemu_net_queue_send_iov(queue, sender, flags,
                                    iov, iovcnt, sent_cb);
 }
 
+ssize_t qemu_sendv_packet_async(NetClientState *sender,
+                                const struct iovec *iov, int iovcnt,
+                                NetPacketSent *sent_cb)
+{
+    return qemu_sendv_packet_async_with_flags(sender,
+                                              QEMU_NET_PACKET_FLAG_NONE,
+                                              iov, iovcnt, sent_cb);
+}
+
+/* Like qemu_sendv_packet_async(), but the caller guarantees that the
+ * buffers described by @iov stay valid until @sent_cb is invoked, so the
+ * packet is never copied if the peer cannot take it right away.
+ */
+ssize_t qemu_sendv_packet_async_zerocopy(NetClientState *sender,
+                                         const struct iovec *iov, int iovcnt,
+                                         NetPacketSent *sent_cb)
+{
+    assert(sent_cb);
+    return qemu_sendv_packet_async_with_flags(sender,
+                                              QEMU_NET_PACKET_FLAG_ZEROCOPY,
+                                              iov, iovcnt, sent_cb);
+}
+
 ssize_t
 qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
 {
@@ -814,6 +883,9 @@ static int (* const net_client_init_fun[NET_CLIENT_OPTIONS_KIND_MAX])(
 #endif
 #ifdef CONFIG_NETMAP
         [NET_CLIENT_OPTIONS_KIND_NETMAP]    = net_init_netmap,
+#endif
+#ifdef CONFIG_AF_XDP
+        [NET_CLIENT_OPTIONS_KIND_AF_XDP]    = net_init_af_xdp,
 #endif
         [NET_CLIENT_OPTIONS_KIND_DUMP]      = net_init_dump,
 #ifdef CONFIG_NET_BRIDGE
@@ -855,6 +927,9 @@ static int net_client_init1(const void *object, int is_netdev, Error **errp)
 #ifdef CONFIG_NETMAP
         case NET_CLIENT_OPTIONS_KIND_NETMAP:
 #endif
+#ifdef CONFIG_AF_XDP
+        case NET_CLIENT_OPTIONS_KIND_AF_XDP:
+#endif
 #ifdef CONFIG_NET_BRIDGE
         case NET_CLIENT_OPTIONS_KIND_BRIDGE:
 #endif
@@ -24,6 +24,7 @@
 #include "net/queue.h"
 #include "qemu/queue.h"
 #include "net/net.h"
+#include "qemu/iov.h"
 
 /* The delivery handler may only return zero if it will call
  * qemu_net_queue_flush() when it determines that it is once again able
@@ -37,6 +38,11 @@
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
  * unbounded queueing.
+ *
+ * If the sender also passes QEMU_NET_PACKET_FLAG_ZEROCOPY, it promises not
+ * to reuse the buffers until the callback has been invoked; only the iovec
+ * array is then saved, and the data is sent straight from the sender's
+ * buffers when the queue is flushed.
  */
 
 struct NetPacket {
@@ -45,6 +51,8 @@ struct NetPacket {
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
+    struct iovec *iov;      /* sender's buffers, for zero-copy packets */
+    int iovcnt;
     uint8_t data[0];
 };
 
@@ -81,6 +89,7 @@ void qemu_del_net_queue(NetQueue *queue)
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         QTAILQ_REMOVE(&queue->packets, packet, entry);
+        g_free(packet->iov);
         g_free(packet);
     }
 
@@ -104,6 +113,8 @@ static void qemu_net_queue_append(NetQueue *queue,
     packet->flags = flags;
     packet->size = size;
     packet->sent_cb = sent_cb;
+    packet->iov = NULL;
+    packet->iovcnt = 0;
     memcpy(packet->data, buf, size);
 
     queue->nq_count++;
@@ -124,6 +135,21 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
+
+    if ((flags & QEMU_NET_PACKET_FLAG_ZEROCOPY) && sent_cb) {
+        packet = g_malloc(sizeof(NetPacket));
+        packet->sender = sender;
+        packet->sent_cb = sent_cb;
+        packet->flags = flags;
+        packet->size = iov_size(iov, iovcnt);
+        packet->iov = g_memdup(iov, iovcnt * sizeof(*iov));
+        packet->iovcnt = iovcnt;
+
+        queue->nq_count++;
+        QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+        return;
+    }
+
     for (i = 0; i < iovcnt; i++) {
         max_len += iov[i].iov_len;
     }
@@ -133,6 +159,8 @@ static void qemu_net_queue_append_iov(NetQueue *queue,
     packet->sent_cb = sent_cb;
     packet->flags = flags;
     packet->size = 0;
+    packet->iov = NULL;
+    packet->iovcnt = 0;
 
     for (i = 0; i < iovcnt; i++) {
         size_t len = iov[i].iov_len;
@@ -236,6 +264,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
             if (packet->sent_cb) {
                 packet->sent_cb(packet->sender, 0);
             }
+            g_free(packet->iov);
             g_free(packet);
         }
     }
@@ -251,11 +280,19 @@ bool qemu_net_queue_flush(NetQueue *queue)
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         queue->nq_count--;
 
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
+        if (packet->iov) {
+            ret = qemu_net_queue_deliver_iov(queue,
+                                             packet->sender,
+                                             packet->flags,
+                                             packet->iov,
+                                             packet->iovcnt);
+        } else {
+            ret = qemu_net_queue_deliver(queue,
+                                         packet->sender,
+                                         packet->flags,
+                                         packet->data,
+                                         packet->size);
+        }
         if (ret == 0) {
             queue->nq_count++;
             QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
@@ -266,6 +303,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
+        g_free(packet->iov);
         g_free(packet);
     }
     return true;
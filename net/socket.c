@@ -89,31 +89,46 @@ static void net_socket_writable(void *opaque)
     qemu_flush_queued_packets(&s->nc);
 }
 
-static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+static ssize_t net_socket_receive_iov(NetClientState *nc,
+                                      const struct iovec *iov, int iovcnt)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    size_t size = iov_size(iov, iovcnt);
     uint32_t len = htonl(size);
-    struct iovec iov[] = {
-        {
-            .iov_base = &len,
-            .iov_len  = sizeof(len),
-        }, {
-            .iov_base = (void *)buf,
-            .iov_len  = size,
-        },
-    };
+    struct iovec iov_copy[IOV_MAX];
+    uint8_t *buf = NULL;
     size_t remaining;
     ssize_t ret;
+    int cnt;
+
+    /* Send the length prefix and the packet with a single sendmsg(). */
+    iov_copy[0].iov_base = &len;
+    iov_copy[0].iov_len = sizeof(len);
+    if (iovcnt < IOV_MAX) {
+        memcpy(&iov_copy[1], iov, iovcnt * sizeof(*iov));
+        cnt = iovcnt + 1;
+    } else {
+        /* More fragments than sendmsg() takes; linearize the packet */
+        buf = g_malloc(size);
+        iov_to_buf(iov, iovcnt, 0, buf, size);
+        iov_copy[1].iov_base = buf;
+        iov_copy[1].iov_len = size;
+        cnt = 2;
+    }
 
-    remaining = iov_size(iov, 2) - s->send_index;
-    ret = iov_send(s->fd, iov, 2, s->send_index, remaining);
+    remaining = sizeof(len) + size - s->send_index;
+    ret = iov_send(s->fd, iov_copy, cnt, s->send_index, remaining);
+    if (ret == -1) {
+        ret = -errno;
+    }
+    g_free(buf);
 
-    if (ret == -1 && errno == EAGAIN) {
+    if (ret == -EAGAIN) {
         ret = 0; /* handled further down */
     }
-    if (ret == -1) {
+    if (ret < 0) {
         s->send_index = 0;
-        return -errno;
+        return ret;
     }
     if (ret < (ssize_t)remaining) {
         s->send_index += ret;
@@ -124,6 +139,16 @@ static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t
     return size;
 }
 
+static ssize_t net_socket_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len  = size,
+    };
+
+    return net_socket_receive_iov(nc, &iov, 1);
+}
+
 static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf, size_t size)
 {
     NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
@@ -142,6 +167,32 @@ static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf,
     return ret;
 }
 
+#ifndef _WIN32
+static ssize_t net_socket_receive_dgram_iov(NetClientState *nc,
+                                            const struct iovec *iov,
+                                            int iovcnt)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    struct msghdr msg = {
+        .msg_name = &s->dgram_dst,
+        .msg_namelen = sizeof(s->dgram_dst),
+        .msg_iov = (struct iovec *)iov,
+        .msg_iovlen = iovcnt,
+    };
+    ssize_t ret;
+
+    do {
+        ret = sendmsg(s->fd, &msg, 0);
+    } while (ret == -1 && errno == EINTR);
+
+    if (ret == -1 && errno == EAGAIN) {
+        net_socket_write_poll(s, true);
+        return 0;
+    }
+    return ret;
+}
+#endif
+
 static void net_socket_send(void *opaque)
 {
     NetSocketState *s = opaque;
@@ -342,6 +393,9 @@ static NetClientInfo net_dgram_socket_info = {
     .type = NET_CLIENT_OPTIONS_KIND_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive_dgram,
+#ifndef _WIN32
+    .receive_iov = net_socket_receive_dgram_iov,
+#endif
     .cleanup = net_socket_cleanup,
 };
 
@@ -425,6 +479,7 @@ static NetClientInfo net_socket_info = {
     .type = NET_CLIENT_OPTIONS_KIND_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive,
+    .receive_iov = net_socket_receive_iov,
     .cleanup = net_socket_cleanup,
 };
 
@@ -40,7 +40,7 @@ static int vhost_user_running(VhostUserState *s)
     return (s->vhost_net) ? 1 : 0;
 }
 
-static int vhost_user_start(VhostUserState *s)
+static int vhost_user_start_one(VhostUserState *s)
 {
     VhostNetOptions options;
 
@@ -58,6 +58,40 @@ static int vhost_user_start(VhostUserState *s)
     return vhost_user_running(s) ? 0 : -1;
 }
 
+static void vhost_user_stop(VhostUserState *s);
+
+/* All queue pairs share the chardev; bring them up in queue order. */
+static int vhost_user_start(int queues, NetClientState *ncs[])
+{
+    VhostUserState *s;
+    uint64_t max_queues;
+    int i;
+
+    for (i = 0; i < queues; i++) {
+        s = DO_UPCAST(VhostUserState, nc, ncs[i]);
+        if (vhost_user_start_one(s) < 0) {
+            goto err;
+        }
+
+        if (i == 0) {
+            max_queues = vhost_net_get_max_queues(s->vhost_net);
+            if (queues > max_queues) {
+                error_report("you are asking more queues than supported: %"
+                             PRIu64, max_queues);
+                goto err;
+            }
+        }
+    }
+
+    return 0;
+
+err:
+    for (; i >= 0; i--) {
+        vhost_user_stop(DO_UPCAST(VhostUserState, nc, ncs[i]));
+    }
+    return -1;
+}
+
 static void vhost_user_stop(VhostUserState *s)
 {
     if (vhost_user_running(s)) {
@@ -97,61 +131,102 @@ static NetClientInfo net_vhost_user_info = {
         .has_ufo = vhost_user_has_ufo,
 };
 
-static void net_vhost_link_down(VhostUserState *s, bool link_down)
+/*
+ * The guest sees a single link, so only the first queue pair reports the
+ * change to its peer.
+ */
+static void net_vhost_link_down(int queues, NetClientState *ncs[],
+                                bool link_down)
 {
-    s->nc.link_down = link_down;
+    NetClientState *nc;
+    int i;
 
-    if (s->nc.peer) {
-        s->nc.peer->link_down = link_down;
+    for (i = 0; i < queues; i++) {
+        nc = ncs[i];
+
+        nc->link_down = link_down;
+
+        if (nc->peer) {
+            nc->peer->link_down = link_down;
+        }
     }
 
-    if (s->nc.info->link_status_changed) {
-        s->nc.info->link_status_changed(&s->nc);
+    nc = ncs[0];
+
+    if (nc->info->link_status_changed) {
+        nc->info->link_status_changed(nc);
     }
 
-    if (s->nc.peer && s->nc.peer->info->link_status_changed) {
-        s->nc.peer->info->link_status_changed(s->nc.peer);
+    if (nc->peer && nc->peer->info->link_status_changed) {
+        nc->peer->info->link_status_changed(nc->peer);
     }
 }
 
 static void net_vhost_user_event(void *opaque, int event)
 {
-    VhostUserState *s = opaque;
+    const char *name = opaque;
+    NetClientState *ncs[MAX_QUEUE_NUM];
+    VhostUserState *s;
+    int queues, i;
+
+    queues = qemu_find_net_clients_except(name, ncs,
+                                          NET_CLIENT_OPTIONS_KIND_NIC,
+                                          MAX_QUEUE_NUM);
+    if (queues == 0) {
+        return;
+    }
+    s = DO_UPCAST(VhostUserState, nc, ncs[0]);
 
     switch (event) {
     case CHR_EVENT_OPENED:
-        vhost_user_start(s);
-        net_vhost_link_down(s, false);
-        error_report("chardev \"%s\" went up\n", s->chr->label);
+        if (vhost_user_start(queues, ncs) < 0) {
+            error_report("chardev \"%s\": vhost-user setup failed",
+                         s->chr->label);
+            break;
+        }
+        net_vhost_link_down(queues, ncs, false);
+        error_report("chardev \"%s\" went up", s->chr->label);
         break;
     case CHR_EVENT_CLOSED:
-        net_vhost_link_down(s, true);
-        vhost_user_stop(s);
-        error_report("chardev \"%s\" went down\n", s->chr->label);
+        /* Stopping the device hands each ring's position back to the
+         * guest side, so a reconnecting backend resumes where this one
+         * left off.
+         */
+        net_vhost_link_down(queues, ncs, true);
+        for (i = 0; i < queues; i++) {
+            vhost_user_stop(DO_UPCAST(VhostUserState, nc, ncs[i]));
+        }
+        error_report("chardev \"%s\" went down", s->chr->label);
         break;
     }
 }
 
 static int net_vhost_user_init(NetClientState *peer, const char *device,
                                const char *name, CharDriverState *chr,
-                               bool vhostforce)
+                               bool vhostforce, int queues)
 {
     NetClientState *nc;
     VhostUserState *s;
+    int i;
+
+    for (i = 0; i < queues; i++) {
+        nc = qemu_new_net_client(&net_vhost_user_info, peer, device, name);
 
-    nc = qemu_new_net_client(&net_vhost_user_info, peer, device, name);
+        snprintf(nc->info_str, sizeof(nc->info_str), "vhost-user%d to %s",
+                 i, chr->label);
 
-    snprintf(nc->info_str, sizeof(nc->info_str), "vhost-user to %s",
-             chr->label);
+        nc->queue_index = i;
 
-    s = DO_UPCAST(VhostUserState, nc, nc);
+        s = DO_UPCAST(VhostUserState, nc, nc);
 
-    /* We don't provide a receive callback */
-    s->nc.receive_disabled = 1;
-    s->chr = chr;
-    s->vhostforce = vhostforce;
+        /* We don't provide a receive callback */
+        s->nc.receive_disabled = 1;
+        s->chr = chr;
+        s->vhostforce = vhostforce;
+    }
 
-    qemu_chr_add_handlers(s->chr, NULL, NULL, net_vhost_user_event, s);
+    /* nc->name lives as long as the clients do */
+    qemu_chr_add_handlers(chr, NULL, NULL, net_vhost_user_event, nc->name);
 
     return 0;
 }
@@ -167,6 +242,8 @@ static int net_vhost_chardev_opts(const char *name, const char *value,
         props->is_unix = true;
     } else if (strcmp(name, "server") == 0) {
         props->is_server = true;
+    } else if (strcmp(name, "reconnect") == 0) {
+        /* the client side retries; net_vhost_user_event does the rest */
     } else {
         error_report("vhost-user does not support a chardev"
                      " with the following option:\n %s = %s",
@@ -231,6 +308,7 @@ int net_init_vhost_user(const NetClientOptions *opts, const char *name,
     const NetdevVhostUserOptions *vhost_user_opts;
     CharDriverState *chr;
     bool vhostforce;
+    int64_t queues;
 
     assert(opts->kind == NET_CLIENT_OPTIONS_KIND_VHOST_USER);
     vhost_user_opts = opts->vhost_user;
@@ -254,5 +332,13 @@ int net_init_vhost_user(const NetClientOptions *opts, const char *name,
         vhostforce = false;
     }
 
-    return net_vhost_user_init(peer, "vhost_user", name, chr, vhostforce);
+    queues = vhost_user_opts->has_queues ? vhost_user_opts->queues : 1;
+    if (queues < 1 || queues > MAX_QUEUE_NUM) {
+        error_report("vhost-user number of queues must be in range [1, %d]",
+                     MAX_QUEUE_NUM);
+        return -1;
+    }
+
+    return net_vhost_user_init(peer, "vhost_user", name, chr, vhostforce,
+                               queues);
 }
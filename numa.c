@@ -77,6 +77,16 @@ static void numa_node_parse(NumaNodeOptions *node, QemuOpts *opts, Error **errp)
         bitmap_set(numa_info[nodenr].node_cpu, cpus->value, 1);
     }
 
+    for (cpus = node->host_cpus; cpus; cpus = cpus->next) {
+        if (cpus->value >= MAX_HOST_CPUS) {
+            error_setg(errp, "Host CPU number %" PRIu16 " is bigger than %d",
+                       cpus->value, MAX_HOST_CPUS - 1);
+            return;
+        }
+        bitmap_set(numa_info[nodenr].host_cpus, cpus->value, 1);
+        numa_info[nodenr].has_host_cpus = true;
+    }
+
     if (node->has_mem && node->has_memdev) {
         error_setg(errp, "qemu: cannot specify both mem= and memdev=\n");
         return;
@@ -248,6 +258,30 @@ void set_numa_modes(void)
     }
 }
 
+/* Called from the thread of VCPU @cpu_index when it starts, so that
+ * everything the thread allocates afterwards comes from the host node
+ * it runs on.
+ */
+void numa_set_vcpu_affinity(int cpu_index, QemuThread *thread)
+{
+    int i, ret;
+
+    for (i = 0; i < nb_numa_nodes; i++) {
+        if (test_bit(cpu_index, numa_info[i].node_cpu)) {
+            break;
+        }
+    }
+    if (i == nb_numa_nodes || !numa_info[i].has_host_cpus) {
+        return;
+    }
+
+    ret = qemu_thread_set_affinity(thread, numa_info[i].host_cpus);
+    if (ret < 0) {
+        error_report("Failed to set host CPU affinity of VCPU %d: %s",
+                     cpu_index, strerror(-ret));
+    }
+}
+
 static void allocate_system_memory_nonnuma(MemoryRegion *mr, Object *owner,
                                            const char *name,
                                            uint64_t ram_size)
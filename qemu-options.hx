@@ -103,11 +103,12 @@ specifies the maximum number of hotpluggable CPUs.
 ETEXI
 
 DEF("numa", HAS_ARG, QEMU_OPTION_numa,
-    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node]\n"
-    "-numa node[,memdev=id][,cpus=cpu[-cpu]][,nodeid=node]\n", QEMU_ARCH_ALL)
+    "-numa node[,mem=size][,cpus=cpu[-cpu]][,nodeid=node][,host-cpus=cpu[-cpu]]\n"
+    "-numa node[,memdev=id][,cpus=cpu[-cpu]][,nodeid=node][,host-cpus=cpu[-cpu]]\n",
+    QEMU_ARCH_ALL)
 STEXI
-@item -numa node[,mem=@var{size}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}]
-@item -numa node[,memdev=@var{id}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}]
+@item -numa node[,mem=@var{size}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}][,host-cpus=@var{cpu[-cpu]}]
+@item -numa node[,memdev=@var{id}][,cpus=@var{cpu[-cpu]}][,nodeid=@var{node}][,host-cpus=@var{cpu[-cpu]}]
 @findex -numa
 Simulate a multi node NUMA system. If @samp{mem}, @samp{memdev}
 and @samp{cpus} are omitted, resources are split equally. Also, note
@@ -119,6 +120,21 @@ to specify the memory backend for the @samp{memdev} suboption.
 
 @samp{mem} and @samp{memdev} are mutually exclusive.  Furthermore, if one
 node uses @samp{memdev}, all of them have to use it.
+
+@samp{host-cpus} restricts the threads of the node's VCPUs to the given
+host CPUs; it can be repeated to add more ranges.  It is usually combined
+with a @samp{memdev} whose @samp{host-nodes} is the host node of the same
+CPUs, for example:
+@example
+-object memory-backend-ram,size=4G,host-nodes=0,policy=bind,id=ram0 \
+-numa node,memdev=ram0,cpus=0-3,host-cpus=0-7
+@end example
+The same property is accepted by @code{-object iothread}, and pins the
+I/O thread.  Put the thread near the memory that its devices use, so
+that the requests it handles are allocated on the same host node.
+
+Thread pinning is only implemented for VCPU threads of the KVM
+accelerator.
 ETEXI
 
 DEF("add-fd", HAS_ARG, QEMU_OPTION_add_fd,
@@ -259,7 +275,9 @@ DEF("mem-prealloc", 0, QEMU_OPTION_mem_prealloc,
 STEXI
 @item -mem-prealloc
 @findex -mem-prealloc
-Preallocate memory when using -mem-path.
+Preallocate memory when using -mem-path.  Memory is touched by one thread
+per VCPU, capped at the number of host CPUs; memory backends accept a
+@samp{prealloc-threads} property to change the number of threads.
 ETEXI
 
 DEF("k", HAS_ARG, QEMU_OPTION_k,
@@ -1485,6 +1503,12 @@ DEF("net", HAS_ARG, QEMU_OPTION_net,
     "                attach to the existing netmap-enabled network interface 'name', or to a\n"
     "                VALE port (created on the fly) called 'name' ('nmname' is name of the \n"
     "                netmap device, defaults to '/dev/netmap')\n"
+#endif
+#ifdef CONFIG_AF_XDP
+    "-net af-xdp,ifname=name[,mode=native|skb][,force-copy=on|off]\n"
+    "         [,queues=n][,start-queue=m]\n"
+    "                attach to queues 'm' to 'm+n-1' of the host network interface\n"
+    "                'name' using AF_XDP sockets (the default is one queue, queue 0)\n"
 #endif
     "-net dump[,vlan=n][,file=f][,len=n]\n"
     "                dump traffic on vlan 'n' to file 'f' (max n bytes per packet)\n"
@@ -1502,6 +1526,9 @@ DEF("netdev", HAS_ARG, QEMU_OPTION_netdev,
 #endif
 #ifdef CONFIG_NETMAP
     "netmap|"
+#endif
+#ifdef CONFIG_AF_XDP
+    "af-xdp|"
 #endif
     "vhost-user|"
     "socket|"
@@ -1886,6 +1913,31 @@ vde_switch -F -sock /tmp/myswitch
 qemu-system-i386 linux.img -net nic -net vde,sock=/tmp/myswitch
 @end example
 
+@item -netdev af-xdp,id=@var{id},ifname=@var{name}[,mode=native|skb][,force-copy=on|off][,queues=@var{n}][,start-queue=@var{m}]
+@item -net af-xdp[,vlan=@var{n}][,name=@var{name}],ifname=@var{name}[,mode=native|skb][,force-copy=on|off][,queues=@var{n}][,start-queue=@var{m}]
+Attach to the host network interface @var{name} through AF_XDP sockets,
+bypassing the host network stack.  Frames received on queues @var{m} to
+@var{m}+@var{n}-1 of the interface are redirected to QEMU by an XDP program
+and frames sent by the guest are transmitted directly on the same queues.
+Use the host's ethtool to steer traffic to those queues.
+
+@option{mode=native} loads the XDP program in the network driver, while
+@option{mode=skb} uses generic XDP.  If @option{mode} is not given, native
+mode is tried first and QEMU falls back to generic XDP if the driver lacks
+native support.  @option{force-copy=on} disables zero-copy even if the driver
+supports it.  This option is only available if QEMU has been compiled with
+libxdp support and requires the CAP_NET_ADMIN and CAP_BPF capabilities.
+
+Example:
+@example
+# create a veth pair and attach to one end of it
+ip link add veth0 type veth peer name veth1
+ip link set veth0 up
+ip link set veth1 up
+qemu-system-i386 linux.img -netdev af-xdp,id=n1,ifname=veth0,mode=skb \
+                 -device virtio-net-pci,netdev=n1
+@end example
+
 @item -netdev hubport,id=@var{id},hubid=@var{hubid}
 
 Create a hub port on QEMU "vlan" @var{hubid}.
@@ -1894,13 +1946,21 @@ The hubport netdev lets you connect a NIC to a QEMU "vlan" instead of a single
 netdev.  @code{-net} and @code{-device} with parameter @option{vlan} create the
 required hub automatically.
 
-@item -netdev vhost-user,chardev=@var{id}[,vhostforce=on|off]
+@item -netdev vhost-user,chardev=@var{id}[,vhostforce=on|off][,queues=@var{n}]
 
 Establish a vhost-user netdev, backed by a chardev @var{id}. The chardev should
 be a unix domain socket backed one. The vhost-user uses a specifically defined
 protocol to pass vhost ioctl replacement messages to an application on the other
 end of the socket. On non-MSIX guests, the feature can be forced with
-@var{vhostforce}.
+@var{vhostforce}. Use 'queues=@var{n}' to specify the number of queue pairs
+to be created for multiqueue vhost-user; the backend must support at least
+that many, and the virtio-net device needs @option{mq=on}.
+
+If the backend application goes away, the link is reported down to the guest
+and the rings are handed back to QEMU.  When the socket connects again, the
+device is set up from scratch and the link comes back up.  Give the chardev a
+@option{reconnect} interval, or use @option{server}, to have QEMU wait for a
+restarted backend.
 
 Example:
 @example
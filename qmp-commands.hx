@@ -3107,6 +3107,20 @@ The main json-object contains the following:
             but this way upper levels don't need to care about page
             size (json-int)
          - "dirty-sync-count": times that dirty ram was synchronized (json-int)
+- "cpu-throttle-percentage": only present while auto-converge is throttling
+                             guest cpus, percentage of time the cpus are
+                             kept out of the guest (json-int)
+- "section-stats": only present after sections were saved or loaded, a
+  json-array of json-objects, one per section of the stream, with:
+         - "name": section name (json-string)
+         - "instance-id": section instance (json-int)
+         - "iterate-bytes", "iterate-time": bytes saved and microseconds
+            spent during setup and the live iterations (json-int)
+         - "complete-bytes", "complete-time": bytes saved and microseconds
+            spent while the guest was stopped (json-int)
+         - "load-iterate-bytes", "load-iterate-time",
+           "load-complete-bytes", "load-complete-time": the same on the
+            incoming side (json-int)
 - "disk": only present if "status" is "active" and it is a block migration,
   it is a json-object with the following disk information:
          - "transferred": amount transferred in bytes (json-int)
@@ -3251,6 +3265,9 @@ Enable/Disable migration capabilities
 - "rdma-pin-all": pin all pages when using RDMA during migration
 - "auto-converge": throttle down guest to help convergence of migration
 - "zero-blocks": compress zero blocks during block migration
+- "zero-copy-send": send RAM pages without copying them into the socket
+- "x-ignore-shared": skip RAM shared with the destination through a file
+- "x-mapped-ram": store RAM page-aligned so that it can be mapped on load
 
 Arguments:
 
@@ -3278,6 +3295,9 @@ Query current migration capabilities
          - "rdma-pin-all" : RDMA Pin Page state (json-bool)
          - "auto-converge" : Auto Converge state (json-bool)
          - "zero-blocks" : Zero Blocks state (json-bool)
+         - "zero-copy-send" : Zero Copy Send state (json-bool)
+         - "x-ignore-shared" : Ignore Shared RAM state (json-bool)
+         - "x-mapped-ram" : Mapped RAM state (json-bool)
 
 Arguments:
 
@@ -3294,6 +3314,66 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_migrate_capabilities,
     },
 
+SQMP
+migrate-set-parameters
+----------------------
+
+Set migration parameters
+
+- "cpu-throttle-initial": initial percentage of time guest cpus are throttled
+                          when auto-converge kicks in (json-int)
+- "cpu-throttle-increment": largest change of the throttle percentage in one
+                            dirty bitmap sync period (json-int)
+- "cpu-throttle-max": maximum percentage of time guest cpus may be
+                      throttled (json-int)
+
+Arguments:
+
+Example:
+
+-> { "execute": "migrate-set-parameters" , "arguments":
+      { "cpu-throttle-initial": 30 } }
+
+EQMP
+
+    {
+        .name       = "migrate-set-parameters",
+        .args_type  =
+            "cpu-throttle-initial:i?,cpu-throttle-increment:i?,cpu-throttle-max:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
+    },
+SQMP
+query-migrate-parameters
+------------------------
+
+Query current migration parameters
+
+- "parameters": migration parameters value
+         - "cpu-throttle-initial" : initial throttle percentage (json-int)
+         - "cpu-throttle-increment" : throttle step size (json-int)
+         - "cpu-throttle-max" : maximum throttle percentage (json-int)
+
+Arguments:
+
+Example:
+
+-> { "execute": "query-migrate-parameters" }
+<- {
+      "return": {
+         "cpu-throttle-initial": 20,
+         "cpu-throttle-increment": 10,
+         "cpu-throttle-max": 99
+      }
+   }
+
+EQMP
+
+    {
+        .name       = "query-migrate-parameters",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_parameters,
+    },
+
 SQMP
 query-balloon
 -------------
@@ -233,6 +233,18 @@ typedef struct SaveStateEntry {
     void *opaque;
     CompatEntry *compat;
     int is_ram;
+
+    /* Bytes and microseconds spent on this section by the last migration,
+     * split between the live and the stopped phase on each side.
+     */
+    uint64_t iterate_bytes;
+    int64_t iterate_time;
+    uint64_t complete_bytes;
+    int64_t complete_time;
+    uint64_t load_iterate_bytes;
+    int64_t load_iterate_time;
+    uint64_t load_complete_bytes;
+    int64_t load_complete_time;
 } SaveStateEntry;
 
 
@@ -602,6 +614,53 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se, QJSON *vmdesc)
     vmstate_save_state(f, se->vmsd, se->opaque, vmdesc);
 }
 
+static void savevm_section_account(SaveStateEntry *se, QEMUFile *f,
+                                   int64_t start_pos, int64_t start_time,
+                                   uint64_t *bytes, int64_t *time)
+{
+    int64_t len = qemu_ftell_fast(f) - start_pos;
+    int64_t us = (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - start_time) /
+                 SCALE_US;
+
+    *bytes += len;
+    *time += us;
+    trace_savevm_section_stats(se->idstr, se->section_id, len, us);
+}
+
+MigrationSectionStatsList *qemu_savevm_section_stats(void)
+{
+    MigrationSectionStatsList *head = NULL, **tail = &head;
+    SaveStateEntry *se;
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        MigrationSectionStatsList *entry;
+        MigrationSectionStats *stats;
+
+        if (!se->iterate_bytes && !se->complete_bytes &&
+            !se->load_iterate_bytes && !se->load_complete_bytes) {
+            continue;
+        }
+
+        stats = g_malloc0(sizeof(*stats));
+        stats->name = g_strdup(se->idstr);
+        stats->instance_id = se->instance_id;
+        stats->iterate_bytes = se->iterate_bytes;
+        stats->iterate_time = se->iterate_time;
+        stats->complete_bytes = se->complete_bytes;
+        stats->complete_time = se->complete_time;
+        stats->load_iterate_bytes = se->load_iterate_bytes;
+        stats->load_iterate_time = se->load_iterate_time;
+        stats->load_complete_bytes = se->load_complete_bytes;
+        stats->load_complete_time = se->load_complete_time;
+
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = stats;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return head;
+}
+
 bool qemu_savevm_state_blocked(Error **errp)
 {
     SaveStateEntry *se;
@@ -623,6 +682,11 @@ void qemu_savevm_state_begin(QEMUFile *f,
     int ret;
 
     trace_savevm_state_begin();
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        se->iterate_bytes = se->complete_bytes = 0;
+        se->iterate_time = se->complete_time = 0;
+    }
+
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         if (!se->ops || !se->ops->set_params) {
             continue;
@@ -634,6 +698,7 @@ void qemu_savevm_state_begin(QEMUFile *f,
     qemu_put_be32(f, QEMU_VM_FILE_VERSION);
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        int64_t start_pos, start_time;
         int len;
 
         if (!se->ops || !se->ops->save_live_setup) {
@@ -644,6 +709,8 @@ void qemu_savevm_state_begin(QEMUFile *f,
                 continue;
             }
         }
+        start_pos = qemu_ftell_fast(f);
+        start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_START);
         qemu_put_be32(f, se->section_id);
@@ -657,6 +724,8 @@ void qemu_savevm_state_begin(QEMUFile *f,
         qemu_put_be32(f, se->version_id);
 
         ret = se->ops->save_live_setup(f, se->opaque);
+        savevm_section_account(se, f, start_pos, start_time,
+                               &se->iterate_bytes, &se->iterate_time);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
             break;
@@ -677,6 +746,8 @@ int qemu_savevm_state_iterate(QEMUFile *f)
 
     trace_savevm_state_iterate();
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        int64_t start_pos, start_time;
+
         if (!se->ops || !se->ops->save_live_iterate) {
             continue;
         }
@@ -689,11 +760,15 @@ int qemu_savevm_state_iterate(QEMUFile *f)
             return 0;
         }
         trace_savevm_section_start(se->idstr, se->section_id);
+        start_pos = qemu_ftell_fast(f);
+        start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_PART);
         qemu_put_be32(f, se->section_id);
 
         ret = se->ops->save_live_iterate(f, se->opaque);
+        savevm_section_account(se, f, start_pos, start_time,
+                               &se->iterate_bytes, &se->iterate_time);
         trace_savevm_section_end(se->idstr, se->section_id, ret);
 
         if (ret < 0) {
@@ -722,6 +797,8 @@ void qemu_savevm_state_complete(QEMUFile *f)
     cpu_synchronize_all_states();
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        int64_t start_pos, start_time;
+
         if (!se->ops || !se->ops->save_live_complete) {
             continue;
         }
@@ -731,11 +808,15 @@ void qemu_savevm_state_complete(QEMUFile *f)
             }
         }
         trace_savevm_section_start(se->idstr, se->section_id);
+        start_pos = qemu_ftell_fast(f);
+        start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
         /* Section type */
         qemu_put_byte(f, QEMU_VM_SECTION_END);
         qemu_put_be32(f, se->section_id);
 
         ret = se->ops->save_live_complete(f, se->opaque);
+        savevm_section_account(se, f, start_pos, start_time,
+                               &se->complete_bytes, &se->complete_time);
         trace_savevm_section_end(se->idstr, se->section_id, ret);
         if (ret < 0) {
             qemu_file_set_error(f, ret);
@@ -747,12 +828,15 @@ void qemu_savevm_state_complete(QEMUFile *f)
     json_prop_int(vmdesc, "page_size", TARGET_PAGE_SIZE);
     json_start_array(vmdesc, "devices");
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        int64_t start_pos, start_time;
         int len;
 
         if ((!se->ops || !se->ops->save_state) && !se->vmsd) {
             continue;
         }
         trace_savevm_section_start(se->idstr, se->section_id);
+        start_pos = qemu_ftell_fast(f);
+        start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
 
         json_start_object(vmdesc, NULL);
         json_prop_str(vmdesc, "name", se->idstr);
@@ -771,6 +855,8 @@ void qemu_savevm_state_complete(QEMUFile *f)
         qemu_put_be32(f, se->version_id);
 
         vmstate_save(f, se, vmdesc);
+        savevm_section_account(se, f, start_pos, start_time,
+                               &se->complete_bytes, &se->complete_time);
 
         json_end_object(vmdesc);
         trace_savevm_section_end(se->idstr, se->section_id, 0);
@@ -926,6 +1012,7 @@ int qemu_loadvm_state(QEMUFile *f)
         QLIST_HEAD_INITIALIZER(loadvm_handlers);
     LoadStateEntry *le, *new_le;
     Error *local_err = NULL;
+    SaveStateEntry *se;
     uint8_t section_type;
     unsigned int v;
     int ret;
@@ -952,13 +1039,21 @@ int qemu_loadvm_state(QEMUFile *f)
         return -ENOTSUP;
     }
 
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        se->load_iterate_bytes = se->load_complete_bytes = 0;
+        se->load_iterate_time = se->load_complete_time = 0;
+    }
+
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
-        SaveStateEntry *se;
+        int64_t start_pos, start_time;
         char idstr[257];
         int len;
 
         trace_qemu_loadvm_state_section(section_type);
+        /* The section type byte has been read already */
+        start_pos = qemu_ftell_fast(f) - 1;
+        start_time = qemu_clock_get_ns(QEMU_CLOCK_REALTIME);
         switch (section_type) {
         case QEMU_VM_SECTION_START:
         case QEMU_VM_SECTION_FULL:
@@ -1003,6 +1098,15 @@ int qemu_loadvm_state(QEMUFile *f)
                              " device '%s'", instance_id, idstr);
                 goto out;
             }
+            if (section_type == QEMU_VM_SECTION_START) {
+                savevm_section_account(se, f, start_pos, start_time,
+                                       &se->load_iterate_bytes,
+                                       &se->load_iterate_time);
+            } else {
+                savevm_section_account(se, f, start_pos, start_time,
+                                       &se->load_complete_bytes,
+                                       &se->load_complete_time);
+            }
             break;
         case QEMU_VM_SECTION_PART:
         case QEMU_VM_SECTION_END:
@@ -1026,6 +1130,16 @@ int qemu_loadvm_state(QEMUFile *f)
                              section_id, le->se->idstr);
                 goto out;
             }
+            se = le->se;
+            if (section_type == QEMU_VM_SECTION_PART) {
+                savevm_section_account(se, f, start_pos, start_time,
+                                       &se->load_iterate_bytes,
+                                       &se->load_iterate_time);
+            } else {
+                savevm_section_account(se, f, start_pos, start_time,
+                                       &se->load_complete_bytes,
+                                       &se->load_complete_time);
+            }
             break;
         default:
             error_report("Unknown savevm section type %d", section_type);
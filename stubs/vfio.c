@@ -0,0 +1,7 @@
+#include "qemu-common.h"
+#include "hw/vfio/vfio.h"
+
+bool vfio_has_containers(void)
+{
+    return false;
+}
@@ -0,0 +1,75 @@
+/*
+ * QTest testcase for the AF_XDP network backend
+ *
+ * Attaches the backend to the loopback interface in generic (skb) mode.
+ * Loading the XDP program needs root, so unprivileged runs register no
+ * test case.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include <unistd.h>
+#include "libqtest.h"
+
+static char *hmp_command(const char *command_line)
+{
+    QDict *response;
+    char *output;
+
+    response = qmp("{'execute': 'human-monitor-command',"
+                   " 'arguments': { 'command-line': %s } }", command_line);
+    g_assert(response);
+    output = g_strdup(qdict_get_try_str(response, "return"));
+    g_assert(output);
+    QDECREF(response);
+    return output;
+}
+
+static void test_info(void)
+{
+    char *output;
+
+    qtest_start("-netdev af-xdp,id=n0,ifname=lo,mode=skb,queues=1 "
+                "-device virtio-net-pci,netdev=n0");
+
+    output = hmp_command("info network");
+    g_assert(strstr(output, "af-xdp: ifname=lo queue=0 mode=skb"));
+    g_free(output);
+
+    qtest_end();
+}
+
+static void test_netdev_del(void)
+{
+    QDict *response;
+    char *output;
+
+    qtest_start("-netdev af-xdp,id=n0,ifname=lo,mode=skb");
+
+    response = qmp("{'execute': 'netdev_del', 'arguments': { 'id': 'n0' } }");
+    g_assert(response);
+    g_assert(qdict_haskey(response, "return"));
+    QDECREF(response);
+
+    /* The XDP program is detached again, so the interface can be reused */
+    output = hmp_command("netdev_add af-xdp,id=n1,ifname=lo,mode=skb");
+    g_assert_cmpstr(output, ==, "");
+    g_free(output);
+
+    qtest_end();
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    if (geteuid() == 0) {
+        qtest_add_func("/net/af-xdp/info", test_info);
+        qtest_add_func("/net/af-xdp/netdev_del", test_netdev_del);
+    }
+
+    return g_test_run();
+}
@@ -0,0 +1,174 @@
+/*
+ * qtest memory topology update test and benchmark
+ *
+ * Maps the BARs of a few hundred PCI functions and then moves them
+ * around, checking that the flat view stays right after each update.
+ * With -m perf it also times a long series of BAR moves.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include <stdint.h>
+
+#include "libqtest.h"
+#include "libqos/pci.h"
+#include "libqos/pci-pc.h"
+#include "hw/pci/pci_regs.h"
+
+/* pci-testdev functions are placed in slots 3 to 31, eight per slot */
+#define FIRST_SLOT      3
+#define NR_SLOTS        29
+#define NR_FUNCS        (NR_SLOTS * 8)
+
+/* Offset of the test name in the pci-testdev header; the name of test 0
+ * of the MMIO BAR is "mmio-no-eventfd".
+ */
+#define TESTDEV_NAME    16
+
+/* Free space above the BARs that libqos hands out */
+#define SPARE_BASE      0xF0000000ULL
+
+typedef struct TestState {
+    QPCIBus *bus;
+    QPCIDevice *dev[NR_FUNCS];
+    uint64_t addr[NR_FUNCS];
+} TestState;
+
+static void test_start(TestState *s)
+{
+    GString *cmdline = g_string_new("-nodefaults");
+    uint64_t size;
+    int i;
+
+    for (i = 0; i < NR_FUNCS; i++) {
+        g_string_append_printf(cmdline,
+                               " -device pci-testdev,addr=%02x.%x%s",
+                               FIRST_SLOT + i / 8, i % 8,
+                               i % 8 ? "" : ",multifunction=on");
+    }
+    qtest_start(cmdline->str);
+    g_string_free(cmdline, true);
+
+    s->bus = qpci_init_pc();
+    for (i = 0; i < NR_FUNCS; i++) {
+        s->dev[i] = qpci_device_find(s->bus,
+                                     QPCI_DEVFN(FIRST_SLOT + i / 8, i % 8));
+        g_assert(s->dev[i] != NULL);
+        s->addr[i] = (uintptr_t)qpci_iomap(s->dev[i], 0, &size);
+        qpci_device_enable(s->dev[i]);
+
+        /* Select test 0 so that the header reads back a known name */
+        writeb(s->addr[i], 0);
+    }
+}
+
+static void test_end(TestState *s)
+{
+    int i;
+
+    for (i = 0; i < NR_FUNCS; i++) {
+        g_free(s->dev[i]);
+    }
+    qpci_free_pc(s->bus);
+    qtest_end();
+}
+
+static void move_bar(TestState *s, int i, uint64_t addr)
+{
+    qpci_config_writel(s->dev[i], PCI_BASE_ADDRESS_0, addr);
+    s->addr[i] = addr;
+}
+
+static void check_mapped(TestState *s, int i)
+{
+    g_assert_cmphex(readb(s->addr[i] + TESTDEV_NAME), ==, 'm');
+}
+
+static void test_bar_remap(void)
+{
+    TestState s;
+    uint64_t old;
+    int i;
+
+    test_start(&s);
+
+    for (i = 0; i < NR_FUNCS; i++) {
+        check_mapped(&s, i);
+    }
+
+    /* Move every BAR out and back, checking the neighbours each time */
+    for (i = 0; i < NR_FUNCS; i++) {
+        old = s.addr[i];
+        move_bar(&s, i, SPARE_BASE + i * 0x1000);
+        check_mapped(&s, i);
+        g_assert_cmphex(readb(old + TESTDEV_NAME), ==, 0);
+        if (i > 0) {
+            check_mapped(&s, i - 1);
+        }
+        if (i + 1 < NR_FUNCS) {
+            check_mapped(&s, i + 1);
+        }
+        move_bar(&s, i, old);
+        check_mapped(&s, i);
+    }
+
+    /* Disable decoding on every other function, then enable it again */
+    for (i = 0; i < NR_FUNCS; i += 2) {
+        qpci_config_writew(s.dev[i], PCI_COMMAND, 0);
+    }
+    for (i = 0; i < NR_FUNCS; i++) {
+        if (i & 1) {
+            check_mapped(&s, i);
+        } else {
+            g_assert_cmphex(readb(s.addr[i] + TESTDEV_NAME), ==, 0);
+        }
+    }
+    for (i = 0; i < NR_FUNCS; i += 2) {
+        qpci_device_enable(s.dev[i]);
+    }
+    for (i = 0; i < NR_FUNCS; i++) {
+        check_mapped(&s, i);
+    }
+
+    test_end(&s);
+}
+
+static void perf_bar_remap(void)
+{
+    TestState s;
+    unsigned int i, max;
+    uint64_t old;
+    double duration;
+
+    max = 20000;
+    test_start(&s);
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        old = s.addr[i % NR_FUNCS];
+        move_bar(&s, i % NR_FUNCS, SPARE_BASE);
+        move_bar(&s, i % NR_FUNCS, old);
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("%u BAR moves with %u mapped functions: %f s, "
+                   "%f us per move\n",
+                   2 * max, NR_FUNCS, duration, duration * 1e6 / (2 * max));
+
+    test_end(&s);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/memory-topology/bar-remap", test_bar_remap);
+    if (g_test_perf()) {
+        qtest_add_func("/memory-topology/perf/bar-remap", perf_bar_remap);
+    }
+
+    return g_test_run();
+}
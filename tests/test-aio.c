@@ -376,6 +376,53 @@ static void test_flush_event_notifier(void)
     event_notifier_cleanup(&data.e);
 }
 
+/* Enough descriptors to make aio_poll switch to epoll where available.
+ * The tests that run after this one use the same AioContext, so they
+ * exercise whichever backend aio_poll ends up with.
+ */
+#define MANY_NOTIFIERS 128
+
+static void test_wait_event_notifier_many(void)
+{
+    EventNotifierTestData data[MANY_NOTIFIERS];
+    int i;
+
+    for (i = 0; i < MANY_NOTIFIERS; i++) {
+        data[i] = (EventNotifierTestData) { .n = 0, .active = 1 };
+        event_notifier_init(&data[i].e, false);
+        aio_set_event_notifier(ctx, &data[i].e, event_ready_cb);
+    }
+    g_assert(!aio_poll(ctx, false));
+
+    for (i = 0; i < MANY_NOTIFIERS; i += 3) {
+        event_notifier_set(&data[i].e);
+    }
+    g_assert(aio_poll(ctx, false));
+    for (i = 0; i < MANY_NOTIFIERS; i++) {
+        g_assert_cmpint(data[i].n, ==, i % 3 == 0);
+    }
+    g_assert(!aio_poll(ctx, false));
+
+    /* Removed handlers must not fire, the others must keep working */
+    for (i = 0; i < MANY_NOTIFIERS; i += 2) {
+        aio_set_event_notifier(ctx, &data[i].e, NULL);
+    }
+    for (i = 0; i < MANY_NOTIFIERS; i++) {
+        event_notifier_set(&data[i].e);
+    }
+    g_assert(aio_poll(ctx, true));
+    do {} while (aio_poll(ctx, false));
+    for (i = 0; i < MANY_NOTIFIERS; i++) {
+        g_assert_cmpint(data[i].n, ==, (i % 3 == 0) + (i & 1));
+    }
+
+    for (i = 0; i < MANY_NOTIFIERS; i++) {
+        aio_set_event_notifier(ctx, &data[i].e, NULL);
+        event_notifier_cleanup(&data[i].e);
+    }
+    g_assert(!aio_poll(ctx, false));
+}
+
 static void test_wait_event_notifier_noflush(void)
 {
     EventNotifierTestData data = { .n = 0 };
@@ -843,6 +890,7 @@ int main(int argc, char **argv)
     g_test_add_func("/aio/event/wait",              test_wait_event_notifier);
     g_test_add_func("/aio/event/wait/no-flush-cb",  test_wait_event_notifier_noflush);
     g_test_add_func("/aio/event/flush",             test_flush_event_notifier);
+    g_test_add_func("/aio/event/many",              test_wait_event_notifier_many);
     g_test_add_func("/aio/timer/schedule",          test_timer_schedule);
 
     g_test_add_func("/aio-gsource/notify",                  test_source_notify);
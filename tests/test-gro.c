@@ -0,0 +1,188 @@
+/*
+ * Generic receive offload tests
+ *
+ * Feeds TCP/IPv4 segments with a virtio-net header to the GRO engine and
+ * checks the frames it hands to the NIC: a maximum-size first segment must
+ * be held and delivered intact, and a flow must be flushed before merging
+ * would push the IP length past 64 KiB.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qapi/error.h"
+#include "qemu/main-loop.h"
+#include "net/net.h"
+#include "net/eth.h"
+#include "net/tap.h"
+#include "net/queue.h"
+#include "net/gro.h"
+
+#define VNET_HDR_LEN    sizeof(struct virtio_net_hdr)
+#define L2_LEN          (VNET_HDR_LEN + sizeof(struct eth_header))
+#define TCPIP_HLEN      (sizeof(struct ip_header) + sizeof(tcp_header))
+#define MSS             1460
+
+#define MAX_FRAMES      4
+
+typedef struct Frame {
+    uint8_t *data;
+    size_t len;
+} Frame;
+
+static NetClientState nic, backend;
+static Frame delivered[MAX_FRAMES];
+static unsigned nr_delivered;
+
+/* The GRO engine delivers to the NIC's incoming queue; catch it here. */
+ssize_t qemu_net_queue_send(NetQueue *queue, NetClientState *sender,
+                            unsigned flags, const uint8_t *data,
+                            size_t size, NetPacketSent *sent_cb)
+{
+    g_assert(sender == &backend);
+    g_assert_cmpuint(nr_delivered, <, MAX_FRAMES);
+    delivered[nr_delivered].data = g_memdup(data, size);
+    delivered[nr_delivered].len = size;
+    nr_delivered++;
+    return size;
+}
+
+/* Build a data segment of @payload_len bytes starting at sequence @seq. */
+static uint8_t *build_segment(uint32_t seq, size_t payload_len, size_t *size)
+{
+    uint8_t *buf;
+    struct virtio_net_hdr *vhdr;
+    struct eth_header *eth;
+    struct ip_header *ip;
+    tcp_header *tcp;
+    size_t i;
+
+    *size = L2_LEN + TCPIP_HLEN + payload_len;
+    buf = g_malloc0(*size);
+    vhdr = (struct virtio_net_hdr *)buf;
+    eth = (struct eth_header *)(buf + VNET_HDR_LEN);
+    ip = (struct ip_header *)(buf + L2_LEN);
+    tcp = (tcp_header *)(ip + 1);
+
+    vhdr->flags = VIRTIO_NET_HDR_F_DATA_VALID;
+    vhdr->gso_type = VIRTIO_NET_HDR_GSO_NONE;
+    eth->h_proto = cpu_to_be16(ETH_P_IP);
+    ip->ip_ver_len = (IP_HEADER_VERSION_4 << 4) | (sizeof(*ip) / 4);
+    ip->ip_len = cpu_to_be16(TCPIP_HLEN + payload_len);
+    ip->ip_ttl = 64;
+    ip->ip_p = IP_PROTO_TCP;
+    ip->ip_src = cpu_to_be32(0x0a000001);
+    ip->ip_dst = cpu_to_be32(0x0a000002);
+    tcp->th_sport = cpu_to_be16(5001);
+    tcp->th_dport = cpu_to_be16(40000);
+    tcp->th_seq = cpu_to_be32(seq);
+    tcp->th_offset_flags = cpu_to_be16((sizeof(*tcp) / 4) << 12 | TH_ACK);
+
+    for (i = 0; i < payload_len; i++) {
+        buf[L2_LEN + TCPIP_HLEN + i] = seq + i;
+    }
+    return buf;
+}
+
+static bool send_segment(NetGRO *gro, uint32_t seq, size_t payload_len)
+{
+    struct iovec iov;
+    size_t size;
+    bool absorbed;
+
+    iov.iov_base = build_segment(seq, payload_len, &size);
+    iov.iov_len = size;
+    absorbed = net_gro_receive(gro, &backend, &iov, 1);
+    g_free(iov.iov_base);
+    return absorbed;
+}
+
+/* Check that @frame holds the bytes from @seq on, as built above. */
+static void check_frame(Frame *frame, uint32_t seq, size_t payload_len,
+                        int segs)
+{
+    struct virtio_net_hdr *vhdr = (struct virtio_net_hdr *)frame->data;
+    struct ip_header *ip = (struct ip_header *)(frame->data + L2_LEN);
+    tcp_header *tcp = (tcp_header *)(ip + 1);
+    size_t i;
+
+    g_assert_cmpuint(frame->len, ==, L2_LEN + TCPIP_HLEN + payload_len);
+    g_assert_cmpuint(be16_to_cpu(ip->ip_len), ==, TCPIP_HLEN + payload_len);
+    g_assert_cmpuint(be32_to_cpu(tcp->th_seq), ==, seq);
+    g_assert_cmpuint(vhdr->gso_type, ==, segs > 1 ? VIRTIO_NET_HDR_GSO_TCPV4
+                                                  : VIRTIO_NET_HDR_GSO_NONE);
+    for (i = 0; i < payload_len; i++) {
+        g_assert_cmpuint(frame->data[L2_LEN + TCPIP_HLEN + i], ==,
+                         (uint8_t)(seq + i));
+    }
+}
+
+static NetGRO *test_setup(void)
+{
+    nr_delivered = 0;
+    return net_gro_new(&nic, VNET_HDR_LEN);
+}
+
+static void test_teardown(NetGRO *gro)
+{
+    unsigned i;
+
+    net_gro_free(gro);
+    for (i = 0; i < nr_delivered; i++) {
+        g_free(delivered[i].data);
+    }
+}
+
+static void test_max_first_segment(void)
+{
+    NetGRO *gro = test_setup();
+    size_t payload_len = ETH_MAX_IP_DGRAM_LEN - TCPIP_HLEN;
+
+    g_assert(send_segment(gro, 1000, payload_len));
+    g_assert_cmpuint(nr_delivered, ==, 0);
+
+    net_gro_flush(gro);
+    g_assert_cmpuint(nr_delivered, ==, 1);
+    check_frame(&delivered[0], 1000, payload_len, 1);
+
+    test_teardown(gro);
+}
+
+static void test_merge_bound(void)
+{
+    NetGRO *gro = test_setup();
+    unsigned max_segs = (ETH_MAX_IP_DGRAM_LEN - TCPIP_HLEN) / MSS;
+    uint32_t seq = 1;
+    unsigned i;
+
+    for (i = 0; i < max_segs; i++) {
+        g_assert(send_segment(gro, seq + i * MSS, MSS));
+    }
+    g_assert_cmpuint(nr_delivered, ==, 0);
+
+    /* One more would not fit in an IP datagram: the held segments go out
+     * as one frame and the new one starts a flow of its own.
+     */
+    g_assert(send_segment(gro, seq + max_segs * MSS, MSS));
+    g_assert_cmpuint(nr_delivered, ==, 1);
+    check_frame(&delivered[0], seq, max_segs * MSS, max_segs);
+
+    net_gro_flush(gro);
+    g_assert_cmpuint(nr_delivered, ==, 2);
+    check_frame(&delivered[1], seq + max_segs * MSS, MSS, 1);
+
+    test_teardown(gro);
+}
+
+int main(int argc, char **argv)
+{
+    qemu_init_main_loop(&error_abort);
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/gro/max_first_segment", test_max_first_segment);
+    g_test_add_func("/gro/merge_bound",       test_merge_bound);
+
+    return g_test_run();
+}
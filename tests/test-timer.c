@@ -0,0 +1,254 @@
+/*
+ * QEMUTimerList tests
+ *
+ * Arms, re-arms and deletes a large number of timers in random order and
+ * checks that they fire in expire time order, with ties broken by the
+ * order in which they were armed.  With -m perf it also times timer_mod
+ * and timer_del on a long timer list.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu/timer.h"
+
+#define NR_TIMERS       4096
+#define NR_OPS          (16 * NR_TIMERS)
+
+/* Expire times below PAST are already expired, those above FUTURE never
+ * expire while the test runs.
+ */
+#define PAST            (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) - \
+                         60 * get_ticks_per_sec())
+#define FUTURE          (qemu_clock_get_ns(QEMU_CLOCK_REALTIME) + \
+                         3600 * get_ticks_per_sec())
+
+typedef struct TestTimer {
+    QEMUTimer timer;
+    int64_t expire;             /* expected expire time, or -1 */
+    unsigned armed;             /* value of armed_seq when last armed */
+    bool fired;
+} TestTimer;
+
+static TestTimer timers[NR_TIMERS];
+static QEMUTimerList *tl;
+static unsigned armed_seq;
+
+static TestTimer *last_fired;
+static unsigned nr_fired;
+
+static void timer_cb(void *opaque)
+{
+    TestTimer *t = opaque;
+
+    g_assert(!t->fired);
+    g_assert(t->expire != -1);
+    g_assert(!timer_pending(&t->timer));
+    if (last_fired) {
+        g_assert_cmpint(last_fired->expire, <=, t->expire);
+        if (last_fired->expire == t->expire) {
+            g_assert_cmpuint(last_fired->armed, <, t->armed);
+        }
+    }
+    last_fired = t;
+    t->fired = true;
+    nr_fired++;
+}
+
+static void test_setup(void)
+{
+    int i;
+
+    tl = timerlist_new(QEMU_CLOCK_REALTIME, NULL, NULL);
+    for (i = 0; i < NR_TIMERS; i++) {
+        timer_init_tl(&timers[i].timer, tl, SCALE_NS, timer_cb, &timers[i]);
+        timers[i].expire = -1;
+        timers[i].fired = false;
+    }
+    last_fired = NULL;
+    nr_fired = 0;
+}
+
+static void test_teardown(void)
+{
+    int i;
+
+    for (i = 0; i < NR_TIMERS; i++) {
+        timer_del(&timers[i].timer);
+    }
+    g_assert(!timerlist_has_timers(tl));
+    timerlist_free(tl);
+}
+
+static void arm(TestTimer *t, int64_t expire)
+{
+    timer_mod_ns(&t->timer, expire);
+    t->expire = expire;
+    t->armed = armed_seq++;
+}
+
+static void arm_anticipate(TestTimer *t, int64_t expire)
+{
+    timer_mod_anticipate_ns(&t->timer, expire);
+    if (t->expire == -1 || t->expire > expire) {
+        t->expire = expire;
+        t->armed = armed_seq++;
+    }
+}
+
+static void disarm(TestTimer *t)
+{
+    timer_del(&t->timer);
+    t->expire = -1;
+}
+
+static void test_order(void)
+{
+    int64_t past = PAST, future = FUTURE;
+    int64_t first_future = INT64_MAX;
+    unsigned expected = 0;
+    int i;
+
+    test_setup();
+    g_assert(!timerlist_has_timers(tl));
+    g_assert_cmpint(timerlist_deadline_ns(tl), ==, -1);
+
+    for (i = 0; i < NR_OPS; i++) {
+        TestTimer *t = &timers[g_test_rand_int_range(0, NR_TIMERS)];
+        /* Use a small range of expire times so that there are many ties */
+        int64_t base = g_test_rand_bit() ? past : future;
+        int64_t expire = base + g_test_rand_int_range(0, 64);
+
+        switch (g_test_rand_int_range(0, 4)) {
+        case 0:
+        case 1:
+            arm(t, expire);
+            break;
+        case 2:
+            arm_anticipate(t, expire);
+            break;
+        case 3:
+            disarm(t);
+            break;
+        }
+        g_assert_cmpint(timer_pending(&t->timer), ==, t->expire != -1);
+    }
+
+    for (i = 0; i < NR_TIMERS; i++) {
+        if (timers[i].expire == -1) {
+            continue;
+        }
+        if (timers[i].expire < future) {
+            expected++;
+        } else {
+            first_future = MIN(first_future, timers[i].expire);
+        }
+    }
+
+    g_assert(timerlist_has_timers(tl));
+    if (expected) {
+        g_assert(timerlist_expired(tl));
+        g_assert_cmpint(timerlist_deadline_ns(tl), ==, 0);
+    }
+
+    g_assert_cmpint(timerlist_run_timers(tl), ==, expected != 0);
+    g_assert_cmpuint(nr_fired, ==, expected);
+
+    for (i = 0; i < NR_TIMERS; i++) {
+        g_assert_cmpint(timers[i].fired, ==,
+                        timers[i].expire != -1 && timers[i].expire < future);
+        g_assert_cmpint(timer_pending(&timers[i].timer), ==,
+                        timers[i].expire >= future);
+    }
+
+    /* Only timers in the future are left */
+    g_assert(!timerlist_expired(tl));
+    if (first_future == INT64_MAX) {
+        g_assert(!timerlist_has_timers(tl));
+        g_assert_cmpint(timerlist_deadline_ns(tl), ==, -1);
+    } else {
+        int64_t deadline = timerlist_deadline_ns(tl);
+
+        g_assert_cmpint(deadline, >, 0);
+        g_assert_cmpint(deadline, <=,
+                        first_future - qemu_clock_get_ns(QEMU_CLOCK_REALTIME));
+    }
+
+    test_teardown();
+}
+
+static int rearm_count;
+
+static void rearm_cb(void *opaque)
+{
+    TestTimer *t = opaque;
+
+    /* A callback may re-arm its own timer; if the new expire time has
+     * already passed, the timer runs again in the same pass.
+     */
+    if (++rearm_count < 3) {
+        timer_mod_ns(&t->timer, PAST);
+    }
+}
+
+static void test_rearm_from_cb(void)
+{
+    test_setup();
+    timer_init_tl(&timers[0].timer, tl, SCALE_NS, rearm_cb, &timers[0]);
+    rearm_count = 0;
+
+    timer_mod_ns(&timers[0].timer, PAST);
+    g_assert(timerlist_run_timers(tl));
+    g_assert_cmpint(rearm_count, ==, 3);
+    g_assert(!timer_pending(&timers[0].timer));
+    g_assert(!timerlist_run_timers(tl));
+
+    test_teardown();
+}
+
+static void perf_mod_del(void)
+{
+    int64_t future = FUTURE;
+    unsigned int i, max;
+    double duration;
+
+    max = 10000000;
+    test_setup();
+
+    for (i = 0; i < NR_TIMERS; i++) {
+        arm(&timers[i], future + g_test_rand_int());
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < max; i++) {
+        TestTimer *t = &timers[g_test_rand_int_range(0, NR_TIMERS)];
+
+        if (i & 1) {
+            timer_del(&t->timer);
+        } else {
+            timer_mod_ns(&t->timer, future + g_test_rand_int());
+        }
+    }
+    duration = g_test_timer_elapsed();
+
+    g_test_message("%u timer operations with %u timers: %f s, "
+                   "%f ns per operation\n",
+                   max, NR_TIMERS, duration, duration * 1e9 / max);
+
+    test_teardown();
+}
+
+int main(int argc, char **argv)
+{
+    init_clocks();
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/timer/order",          test_order);
+    g_test_add_func("/timer/rearm_from_cb",  test_rearm_from_cb);
+    if (g_test_perf()) {
+        g_test_add_func("/timer/perf/mod_del", perf_mod_del);
+    }
+
+    return g_test_run();
+}
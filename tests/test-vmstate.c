@@ -482,6 +482,57 @@ static void test_load_skip(void)
     qsb_free(qsb);
 }
 
+#define SEEK_TEST_SIZE 100000
+
+static uint8_t seek_test_byte(int64_t offset)
+{
+    return offset * 7 + (offset >> 8);
+}
+
+static void test_seek_forward(void)
+{
+    uint8_t data[SEEK_TEST_SIZE];
+    uint8_t head[3];
+    int64_t offset;
+    QEMUFile *f;
+    QEMUSizedBuffer *qsb;
+    int i;
+
+    for (i = 0; i < SEEK_TEST_SIZE; i++) {
+        data[i] = seek_test_byte(i);
+    }
+    f = open_test_file(true);
+    qemu_put_buffer(f, data, sizeof(data));
+    g_assert(!qemu_file_get_error(f));
+    qemu_fclose(f);
+
+    f = open_test_file(false);
+    g_assert_cmpint(qemu_get_buffer(f, head, sizeof(head)), ==, sizeof(head));
+    SUCCESS(memcmp(head, data, sizeof(head)));
+    g_assert_cmpint(qemu_file_get_mapping(f, &offset), >=, 0);
+    g_assert_cmpint(offset, ==, 3);
+
+    /* Within the buffered data */
+    SUCCESS(qemu_file_seek_forward(f, 10));
+    g_assert_cmpint(qemu_get_byte(f), ==, seek_test_byte(13));
+
+    /* Past the buffered data */
+    SUCCESS(qemu_file_seek_forward(f, 50000));
+    g_assert_cmpint(qemu_file_get_mapping(f, &offset), >=, 0);
+    g_assert_cmpint(offset, ==, 50014);
+    g_assert_cmpint(qemu_get_byte(f), ==, seek_test_byte(50014));
+    g_assert_cmpint(qemu_ftell_fast(f), ==, 50015);
+    g_assert(!qemu_file_get_error(f));
+    qemu_fclose(f);
+
+    /* Memory files cannot be mapped */
+    qsb = qsb_create(data, sizeof(data));
+    f = qemu_bufopen("r", qsb);
+    g_assert_cmpint(qemu_file_get_mapping(f, &offset), ==, -ENOTSUP);
+    qemu_fclose(f);
+    qsb_free(qsb);
+}
+
 int main(int argc, char **argv)
 {
     temp_fd = mkstemp(temp_file);
@@ -494,6 +545,7 @@ int main(int argc, char **argv)
     g_test_add_func("/vmstate/field_exists/load/skip", test_load_skip);
     g_test_add_func("/vmstate/field_exists/save/noskip", test_save_noskip);
     g_test_add_func("/vmstate/field_exists/save/skip", test_save_skip);
+    g_test_add_func("/vmstate/qemu-file/seek_forward", test_seek_forward);
     g_test_run();
 
     close(temp_fd);
@@ -344,11 +344,31 @@ char *qemu_get_exec_dir(void)
     return g_strdup(exec_dir);
 }
 
-static sigjmp_buf sigjump;
+/* Bytes that a preallocation thread touches between progress reports */
+#define MEM_PREALLOC_PROGRESS_CHUNK (1ULL << 30)
+
+typedef struct MemsetThread {
+    QemuThread thread;
+    char *addr;
+    size_t numpages;
+    size_t hpagesize;
+    const unsigned long *host_cpus;
+    sigjmp_buf env;
+} MemsetThread;
+
+static __thread MemsetThread *memset_thread_self;
+static bool memset_thread_failed;
+static char *memset_area;
+static size_t memset_size;
+static size_t memset_done;
 
 static void sigbus_handler(int signal)
 {
-    siglongjmp(sigjump, 1);
+    /* SIGBUS is delivered to the thread that touched the page */
+    if (!memset_thread_self) {
+        abort();
+    }
+    siglongjmp(memset_thread_self->env, 1);
 }
 
 static size_t fd_getpagesize(int fd)
@@ -371,12 +391,76 @@ static size_t fd_getpagesize(int fd)
     return getpagesize();
 }
 
-void os_mem_prealloc(int fd, char *area, size_t memory)
+static void *do_touch_pages(void *opaque)
 {
-    int ret;
-    struct sigaction act, oldact;
+    MemsetThread *t = opaque;
     sigset_t set, oldset;
 
+    memset_thread_self = t;
+    if (t->host_cpus) {
+        QemuThread self;
+
+        /* Not fatal: the memory policy decides where the pages go, this
+         * only avoids touching them from a remote node.
+         */
+        qemu_thread_get_self(&self);
+        qemu_thread_set_affinity(&self, t->host_cpus);
+    }
+
+    /* unblock SIGBUS */
+    sigemptyset(&set);
+    sigaddset(&set, SIGBUS);
+    pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
+
+    if (sigsetjmp(t->env, 1)) {
+        atomic_set(&memset_thread_failed, true);
+    } else {
+        char *p = t->addr;
+        size_t i, chunk = 0;
+
+        for (i = 0; i < t->numpages; i++) {
+            /*
+             * Fault the page in for writing without clobbering what the
+             * file holds; the RAM may be shared with a running guest, so
+             * the read and write-back must be a single atomic operation.
+             */
+            atomic_fetch_add(p, 0);
+            p += t->hpagesize;
+
+            chunk += t->hpagesize;
+            if (chunk >= MEM_PREALLOC_PROGRESS_CHUNK || i + 1 == t->numpages) {
+                size_t done = atomic_fetch_add(&memset_done, chunk) + chunk;
+
+                trace_os_mem_prealloc_progress(memset_area, done, memset_size);
+                chunk = 0;
+                if (atomic_read(&memset_thread_failed)) {
+                    break;
+                }
+            }
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    memset_thread_self = NULL;
+    return NULL;
+}
+
+/* Touch every page of @area, using up to @threads threads that each
+ * handle a contiguous slice.  If @host_cpus is not NULL, the threads run
+ * on those host CPUs, normally the ones of the node the memory is bound
+ * to.  Exits if the host cannot provide the memory.
+ */
+void os_mem_prealloc(int fd, char *area, size_t memory, int threads,
+                     const unsigned long *host_cpus)
+{
+    int ret, i;
+    struct sigaction act, oldact;
+    size_t hpagesize = fd_getpagesize(fd);
+    size_t numpages, numpages_per_thread, leftover;
+    long host_cpus_online = sysconf(_SC_NPROCESSORS_ONLN);
+    MemsetThread *memset_threads;
+    char *addr = area;
+
     memset(&act, 0, sizeof(act));
     act.sa_handler = &sigbus_handler;
     act.sa_flags = 0;
@@ -387,31 +471,47 @@ void os_mem_prealloc(int fd, char *area, size_t memory)
         exit(1);
     }
 
-    /* unblock SIGBUS */
-    sigemptyset(&set);
-    sigaddset(&set, SIGBUS);
-    pthread_sigmask(SIG_UNBLOCK, &set, &oldset);
+    /* MAP_POPULATE silently ignores failures */
+    numpages = DIV_ROUND_UP(memory, hpagesize);
+    threads = MAX(threads, 1);
+    if (host_cpus_online > 0) {
+        threads = MIN(threads, host_cpus_online);
+    }
+    threads = MIN(threads, MAX(numpages, 1));
+
+    memset_thread_failed = false;
+    memset_area = area;
+    memset_size = numpages * hpagesize;
+    memset_done = 0;
+    trace_os_mem_prealloc(area, memset_size, hpagesize, threads);
+
+    memset_threads = g_new0(MemsetThread, threads);
+    numpages_per_thread = numpages / threads;
+    leftover = numpages % threads;
+    for (i = 0; i < threads; i++) {
+        memset_threads[i].addr = addr;
+        memset_threads[i].numpages = numpages_per_thread + (i < leftover);
+        memset_threads[i].hpagesize = hpagesize;
+        memset_threads[i].host_cpus = host_cpus;
+        qemu_thread_create(&memset_threads[i].thread, "mem-prealloc",
+                           do_touch_pages, &memset_threads[i],
+                           QEMU_THREAD_JOINABLE);
+        addr += memset_threads[i].numpages * hpagesize;
+    }
+    for (i = 0; i < threads; i++) {
+        qemu_thread_join(&memset_threads[i].thread);
+    }
+    g_free(memset_threads);
 
-    if (sigsetjmp(sigjump, 1)) {
+    if (memset_thread_failed) {
         fprintf(stderr, "os_mem_prealloc: Insufficient free host memory "
                         "pages available to allocate guest RAM\n");
         exit(1);
-    } else {
-        int i;
-        size_t hpagesize = fd_getpagesize(fd);
-
-        /* MAP_POPULATE silently ignores failures */
-        memory = (memory + hpagesize - 1) & -hpagesize;
-        for (i = 0; i < (memory / hpagesize); i++) {
-            memset(area + (hpagesize * i), 0, 1);
-        }
-
-        ret = sigaction(SIGBUS, &oldact, NULL);
-        if (ret) {
-            perror("os_mem_prealloc: failed to reinstall signal handler");
-            exit(1);
-        }
+    }
 
-        pthread_sigmask(SIG_SETMASK, &oldset, NULL);
+    ret = sigaction(SIGBUS, &oldact, NULL);
+    if (ret) {
+        perror("os_mem_prealloc: failed to reinstall signal handler");
+        exit(1);
     }
 }
@@ -20,6 +20,7 @@
 #include <limits.h>
 #include <unistd.h>
 #include <sys/time.h>
+#include <sched.h>
 #ifdef __linux__
 #include <sys/syscall.h>
 #include <linux/futex.h>
@@ -27,6 +28,7 @@
 #include "qemu/thread.h"
 #include "qemu/atomic.h"
 #include "qemu/notify.h"
+#include "qemu/bitops.h"
 
 static bool name_threads;
 
@@ -490,6 +492,35 @@ void qemu_thread_get_self(QemuThread *thread)
     thread->thread = pthread_self();
 }
 
+/* Restrict @thread to the host CPUs set in @host_cpus, a bitmap of
+ * MAX_HOST_CPUS bits.  Returns 0 on success, a negative errno otherwise.
+ */
+int qemu_thread_set_affinity(QemuThread *thread,
+                             const unsigned long *host_cpus)
+{
+#ifdef CONFIG_PTHREAD_SETAFFINITY_NP
+    cpu_set_t *set;
+    size_t size = CPU_ALLOC_SIZE(MAX_HOST_CPUS);
+    int i, err;
+
+    set = CPU_ALLOC(MAX_HOST_CPUS);
+    if (!set) {
+        return -ENOMEM;
+    }
+    CPU_ZERO_S(size, set);
+    for (i = 0; i < MAX_HOST_CPUS; i++) {
+        if (test_bit(i, host_cpus)) {
+            CPU_SET_S(i, size, set);
+        }
+    }
+    err = pthread_setaffinity_np(thread->thread, size, set);
+    CPU_FREE(set);
+    return -err;
+#else
+    return -ENOSYS;
+#endif
+}
+
 bool qemu_thread_is_self(QemuThread *thread)
 {
    return pthread_equal(pthread_self(), thread->thread);
@@ -394,6 +394,12 @@ void qemu_thread_get_self(QemuThread *thread)
     thread->tid = GetCurrentThreadId();
 }
 
+int qemu_thread_set_affinity(QemuThread *thread,
+                             const unsigned long *host_cpus)
+{
+    return -ENOSYS;
+}
+
 HANDLE qemu_thread_get_handle(QemuThread *thread)
 {
     QemuThreadData *data;